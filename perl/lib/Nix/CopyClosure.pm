@@ -31,8 +31,9 @@ sub copyToOpen {
     my @missing = grep { !$present{$_} } @closure;
     return if !@missing;
 
+    my $infos = queryPathInfos(1, @missing);
     my $missingSize = 0;
-    $missingSize += (queryPathInfo($_, 1))[3] foreach @missing;
+    $missingSize += $infos->{$_}->[3] foreach @missing;
 
     printf STDERR "copying %d missing paths (%.2f MiB) to ‘$sshHost’...\n",
         scalar(@missing), $missingSize / (1024**2);
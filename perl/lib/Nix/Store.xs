@@ -115,6 +115,35 @@ SV * queryPathInfo(char * path, int base32)
         }
 
 
+SV * queryPathInfos(int base32, ...)
+    PPCODE:
+        try {
+            doInit();
+            PathSet paths;
+            for (int n = 1; n < items; ++n)
+                paths.insert(SvPV_nolen(ST(n)));
+            ValidPathInfoMap infos = store->queryPathInfos(paths);
+            HV * res = newHV();
+            for (ValidPathInfoMap::iterator i = infos.begin(); i != infos.end(); ++i) {
+                ValidPathInfo & info(i->second);
+                AV * arr = newAV();
+                av_push(arr, info.deriver == "" ? newSV(0) : newSVpv(info.deriver.c_str(), 0));
+                string s = "sha256:" + (base32 ? printHash32(info.hash) : printHash(info.hash));
+                av_push(arr, newSVpv(s.c_str(), 0));
+                av_push(arr, newSViv(info.registrationTime));
+                av_push(arr, newSViv(info.narSize));
+                AV * refs = newAV();
+                for (PathSet::iterator j = info.references.begin(); j != info.references.end(); ++j)
+                    av_push(refs, newSVpv(j->c_str(), 0));
+                av_push(arr, newRV_noinc((SV *) refs));
+                hv_store(res, i->first.c_str(), i->first.size(), newRV_noinc((SV *) arr), 0);
+            }
+            XPUSHs(sv_2mortal(newRV_noinc((SV *) res)));
+        } catch (Error & e) {
+            croak(e.what());
+        }
+
+
 SV * queryPathFromHashPart(char * hashPart)
     PPCODE:
         try {
@@ -130,9 +159,10 @@ SV * computeFSClosure(int flipDirection, int includeOutputs, ...)
     PPCODE:
         try {
             doInit();
-            PathSet paths;
+            PathSet roots;
             for (int n = 2; n < items; ++n)
-                computeFSClosure(*store, SvPV_nolen(ST(n)), paths, flipDirection, includeOutputs);
+                roots.insert(SvPV_nolen(ST(n)));
+            PathSet paths = store->queryClosure(roots, flipDirection, includeOutputs);
             for (PathSet::iterator i = paths.begin(); i != paths.end(); ++i)
                 XPUSHs(sv_2mortal(newSVpv(i->c_str(), 0)));
         } catch (Error & e) {
@@ -0,0 +1,176 @@
+#include "eval-cache.hh"
+#include "globals.hh"
+#include "store-api.hh"
+#include "serialise.hh"
+#include "util.hh"
+
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace nix {
+
+
+/* Bump this when the format of the cache files changes. */
+static const unsigned int evalCacheVersion = 2;
+
+
+string fingerprintInput(const string & input)
+{
+    size_t colon = input.find(':');
+    if (colon == string::npos)
+        throw Error(format("invalid evaluation input `%1%'") % input);
+    string kind(input, 0, colon);
+    string name(input, colon + 1);
+
+    if (kind == "file")
+        return printHash(hashFile(htSHA256, name));
+
+    else if (kind == "tree")
+        return computeStorePathForPath(name).first;
+
+    else if (kind == "exists")
+        return pathExists(name) ? "1" : "0";
+
+    else if (kind == "expr")
+        return resolveExprPath(name);
+
+    else if (kind == "dir") {
+        /* Directory entries can't contain slashes, so this is
+           unambiguous.  For subdirectories, note whether they contain
+           a default.nix, as that's what nix-env looks at. */
+        Strings names = readDirectory(name);
+        StringSet namesSorted(names.begin(), names.end());
+        string res;
+        foreach (StringSet::iterator, i, namesSorted) {
+            Path path = name + "/" + *i;
+            struct stat st;
+            char type =
+                stat(path.c_str(), &st) == -1 ? '-' :
+                S_ISREG(st.st_mode) ? 'f' :
+                S_ISDIR(st.st_mode) ? (pathExists(path + "/default.nix") ? 'e' : 'd') :
+                'o';
+            res += *i + "=" + type + "/";
+        }
+        return res;
+    }
+
+    else if (kind == "env")
+        return getEnv(name);
+
+    else if (kind == "valid")
+        return store->isValidPath(name) ? "1" : "0";
+
+    else throw Error(format("invalid evaluation input `%1%'") % input);
+}
+
+
+string evalCacheKey(EvalState & state, const Path & path, const string & attrPath)
+{
+    string key = (format("%1%\n%2%\n%3%\n%4%\n%5%\n")
+        % nixVersion % settings.nixStore % settings.thisSystem
+        % absPath(path) % attrPath).str();
+    const SearchPath & searchPath(state.getSearchPath());
+    foreach (SearchPath::const_iterator, i, searchPath)
+        key += i->first + "=" + i->second + "\n";
+    return key;
+}
+
+
+static Path getCacheFile(const string & key)
+{
+    return settings.nixStateDir + "/eval-cache/" + printHash32(hashString(htSHA256, key));
+}
+
+
+bool queryEvalCache(EvalState & state, const string & key, DrvInfos & drvs)
+{
+    Path cacheFile = getCacheFile(key);
+    if (!pathExists(cacheFile)) return false;
+
+    DrvInfos drvs2;
+
+    try {
+        string contents = readFile(cacheFile);
+        StringSource source(contents);
+
+        if (readInt(source) != evalCacheVersion || readString(source) != key)
+            return false;
+
+        unsigned int nrInputs = readInt(source);
+        while (nrInputs--) {
+            string input = readString(source);
+            string fingerprint = readString(source);
+            string current;
+            try {
+                current = fingerprintInput(input);
+            } catch (SysError & e) {
+                current = "";
+            }
+            if (current != fingerprint) {
+                printMsg(lvlDebug, format("evaluation cache entry `%1%' is invalidated by `%2%'")
+                    % cacheFile % input);
+                return false;
+            }
+        }
+
+        unsigned int nrDrvs = readInt(source);
+        while (nrDrvs--)
+            drvs2.push_back(readDrvInfo(state, source));
+
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: ignoring corrupt evaluation cache entry `%1%': %2%")
+            % cacheFile % e.msg());
+        return false;
+    }
+
+    printMsg(lvlDebug, format("using evaluation cache entry `%1%'") % cacheFile);
+    drvs.splice(drvs.end(), drvs2);
+    return true;
+}
+
+
+void writeEvalCache(EvalState & state, const string & key, DrvInfos & drvs)
+{
+    /* Evaluating the fields of the derivations may use more inputs,
+       so do this first. */
+    StringSink drvsSink;
+    writeInt(drvs.size(), drvsSink);
+    foreach (DrvInfos::iterator, i, drvs)
+        writeDrvInfo(state, *i, drvsSink);
+
+    /* An impure evaluation would give a stale result next time. */
+    if (state.impure) {
+        printMsg(lvlDebug, "not caching impure evaluation");
+        return;
+    }
+
+    StringSink sink;
+    writeInt(evalCacheVersion, sink);
+    writeString(key, sink);
+    writeInt(state.inputs.size(), sink);
+    foreach (EvalInputs::iterator, i, state.inputs) {
+        writeString(i->first, sink);
+        writeString(i->second, sink);
+    }
+    sink.s += drvsSink.s;
+
+    /* Write the entry atomically, since other processes may be
+       reading it. */
+    Path cacheFile = getCacheFile(key);
+    Path tmpFile = (format("%1%.tmp-%2%") % cacheFile % getpid()).str();
+    try {
+        createDirs(dirOf(cacheFile));
+        writeFile(tmpFile, sink.s);
+        if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+            throw SysError(format("renaming `%1%' to `%2%'") % tmpFile % cacheFile);
+    } catch (SysError & e) {
+        printMsg(lvlDebug, format("cannot write evaluation cache entry: %1%") % e.msg());
+        unlink(tmpFile.c_str());
+    }
+}
+
+
+}
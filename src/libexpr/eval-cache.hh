@@ -0,0 +1,38 @@
+#pragma once
+
+#include "eval.hh"
+#include "get-drvs.hh"
+
+
+namespace nix {
+
+
+/* Return the current fingerprint of an input recorded by
+   EvalState::recordInput().  Inputs have the form `<kind>:<name>',
+   where <kind> is one of the following:
+
+   file: the contents of the file <name> (as a SHA-256 hash);
+   tree: the path <name> copied to the store (its store path);
+   exists: whether the path <name> exists;
+   expr: the file that the Nix expression <name> resolves to;
+   dir: the entries of the directory <name> and their types;
+   env: the value of the environment variable <name>;
+   valid: whether the store path <name> is valid. */
+string fingerprintInput(const string & input);
+
+/* Return the key identifying the derivations found at attribute
+   path `attrPath' in the Nix expression `path'. */
+string evalCacheKey(EvalState & state, const Path & path, const string & attrPath);
+
+/* If the evaluation cache has an entry for `key' whose inputs haven't
+   changed, add its derivations to `drvs' and return true. */
+bool queryEvalCache(EvalState & state, const string & key, DrvInfos & drvs);
+
+/* Store the derivations `drvs' in the evaluation cache, together with
+   the inputs recorded in `state.inputs', unless the evaluation was
+   impure (see EvalState::impure).  Failure to write to the cache is
+   not an error. */
+void writeEvalCache(EvalState & state, const string & key, DrvInfos & drvs);
+
+
+}
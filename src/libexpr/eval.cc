@@ -5,6 +5,7 @@
 #include "derivations.hh"
 #include "globals.hh"
 #include "eval-inline.hh"
+#include "eval-cache.hh"
 
 #include <algorithm>
 #include <cstring>
@@ -32,18 +33,133 @@
 namespace nix {
 
 
-Bindings::iterator Bindings::find(const Symbol & name)
+/* Sets with at least this many attributes get a hash index. */
+static const Bindings::size_type minIndexedSize = 64;
+
+
+static inline size_t indexSlot(const Symbol & name, size_t mask)
+{
+    return ((name.hash() >> 3) * 2654435761U) & mask;
+}
+
+
+Bindings::iterator Bindings::findOwn(const Symbol & name)
+{
+    size_type n = BindingsBase::size();
+
+    if (n < minIndexedSize) {
+        Attr key(name, 0);
+        iterator i = lower_bound(BindingsBase::begin(), BindingsBase::end(), key);
+        if (i != BindingsBase::end() && i->name == name) return i;
+        return BindingsBase::end();
+    }
+
+    if (indexedSize != n) {
+        size_t slots = 1;
+        while (slots < 2 * n) slots <<= 1;
+        index.assign(slots, 0);
+        for (size_type j = 0; j < n; ++j) {
+            size_t k = indexSlot((*this)[j].name, slots - 1);
+            while (index[k]) k = (k + 1) & (slots - 1);
+            index[k] = j + 1;
+        }
+        indexedSize = n;
+    }
+
+    size_t mask = index.size() - 1;
+    for (size_t k = indexSlot(name, mask); index[k]; k = (k + 1) & mask)
+        if ((*this)[index[k] - 1].name == name)
+            return BindingsBase::begin() + (index[k] - 1);
+    return BindingsBase::end();
+}
+
+
+Attr * Bindings::find(const Symbol & name)
 {
-    Attr key(name, 0);
-    iterator i = lower_bound(begin(), end(), key);
-    if (i != end() && i->name == name) return i;
-    return end();
+    if (!base) {
+        iterator i = findOwn(name);
+        return i == BindingsBase::end() ? 0 : &*i;
+    }
+    Attr * a = overrides->find(name);
+    return a ? a : base->find(name);
 }
 
 
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    indexedSize = 0;
+}
+
+
+/* Merge the sorted attribute ranges [i, iEnd) and [j, jEnd) into
+   `out', preferring attributes from the second range. */
+template<class Out>
+static void mergeBindings(Out & out,
+    Bindings::iterator i, Bindings::iterator iEnd,
+    Bindings::iterator j, Bindings::iterator jEnd)
+{
+    while (i != iEnd && j != jEnd) {
+        if (i->name == j->name) {
+            out.push_back(*j);
+            ++i; ++j;
+        }
+        else if (i->name < j->name)
+            out.push_back(*i++);
+        else
+            out.push_back(*j++);
+    }
+
+    while (i != iEnd) out.push_back(*i++);
+    while (j != jEnd) out.push_back(*j++);
+}
+
+
+void Bindings::flatten()
+{
+    /* Find the bottom layer, and merge the overrides of all layers
+       above it (which are small), from the bottom up so that higher
+       layers take precedence. */
+    std::vector<Bindings *> layers;
+    Bindings * bottom = this;
+    for ( ; bottom->base; bottom = bottom->base)
+        layers.push_back(bottom->overrides);
+
+    BindingsBase merged;
+    for (std::vector<Bindings *>::reverse_iterator l = layers.rbegin(); l != layers.rend(); ++l) {
+        BindingsBase prev;
+        prev.swap(merged);
+        merged.reserve(prev.size() + (*l)->size());
+        iterator j = (*l)->begin();
+        mergeBindings(merged, prev.begin(), prev.end(), j, (*l)->end());
+    }
+
+    reserve(layeredSize);
+    mergeBindings(*this, bottom->BindingsBase::begin(), bottom->BindingsBase::end(),
+        merged.begin(), merged.end());
+    assert(BindingsBase::size() == layeredSize);
+
+    base = overrides = 0;
+    depth = 0;
+}
+
+
+bool Bindings::layer(Bindings * base, Bindings * overrides)
+{
+    assert(!this->base && BindingsBase::empty());
+
+    if (base->depth >= maxDepth) return false;
+
+    /* The overrides are small, so just flatten them. */
+    size_type shadowed = 0;
+    foreach (iterator, i, *overrides)
+        if (base->find(i->name)) shadowed++;
+
+    this->base = base;
+    this->overrides = overrides;
+    depth = base->depth + 1;
+    layeredSize = base->size() + overrides->size() - shadowed;
+    return true;
 }
 
 
@@ -56,9 +172,11 @@ std::ostream & operator << (std::ostream & str, const Value & v)
     case tBool:
         str << (v.boolean ? "true" : "false");
         break;
-    case tString:
+    case tString: {
+        Value v2 = v;
+        flattenString(v2);
         str << "\"";
-        for (const char * i = v.string.s; *i; i++)
+        for (const char * i = v2.string.s; *i; i++)
             if (*i == '\"' || *i == '\\') str << "\\" << *i;
             else if (*i == '\n') str << "\\n";
             else if (*i == '\r') str << "\\r";
@@ -66,6 +184,7 @@ std::ostream & operator << (std::ostream & str, const Value & v)
             else str << *i;
         str << "\"";
         break;
+    }
     case tPath:
         str << v.path; // !!! escaping?
         break;
@@ -83,10 +202,12 @@ std::ostream & operator << (std::ostream & str, const Value & v)
         str << "}";
         break;
     }
-    case tList:
+    case tList1:
+    case tList2:
+    case tListN:
         str << "[ ";
-        for (unsigned int n = 0; n < v.list.length; ++n)
-            str << *v.list.elems[n] << " ";
+        for (unsigned int n = 0; n < v.listSize(); ++n)
+            str << *v.listElems()[n] << " ";
         str << "]";
         break;
     case tThunk:
@@ -118,7 +239,9 @@ string showType(const Value & v)
         case tPath: return "a path";
         case tNull: return "null";
         case tAttrs: return "a set";
-        case tList: return "a list";
+        case tList1:
+        case tList2:
+        case tListN: return "a list";
         case tThunk: return "a thunk";
         case tApp: return "a function application";
         case tLambda: return "a function";
@@ -170,15 +293,20 @@ EvalState::EvalState(const Strings & _searchPath)
     , sLine(symbols.create("line"))
     , sColumn(symbols.create("column"))
     , repair(false)
+    , trackInputs(false)
+    , impure(false)
     , baseEnv(allocEnv(128))
     , staticBaseEnv(false, 0)
     , baseEnvDispl(0)
 {
-    nrEnvs = nrValuesInEnvs = nrValues = nrListElems = 0;
-    nrAttrsets = nrOpUpdates = nrOpUpdateValuesCopied = 0;
-    nrListConcats = nrPrimOpCalls = nrFunctionCalls = 0;
+    nrEnvs = nrValuesInEnvs = nrValues = nrListElems = nrListElemsAllocated = 0;
+    nrAttrsets = nrOpUpdates = nrOpUpdateValuesCopied = nrOpUpdatesLayered = 0;
+    nrListConcats = nrStringRopes = nrPrimOpCalls = nrFunctionCalls = 0;
     countCalls = getEnv("NIX_COUNT_CALLS", "0") != "0";
 
+    profileFile = getEnv("NIX_EVAL_PROFILE");
+    profiler = profileFile.empty() ? 0 : new EvalProfiler;
+
 #if HAVE_BOEHMGC
     static bool gcInitialised = false;
     if (!gcInitialised) {
@@ -230,6 +358,7 @@ EvalState::EvalState(const Strings & _searchPath)
 
 EvalState::~EvalState()
 {
+    delete profiler;
 }
 
 
@@ -370,6 +499,68 @@ void mkString(Value & v, const string & s, const PathSet & context)
 }
 
 
+/* Concatenations that result in strings shorter than this are done
+   right away, since that's cheaper than creating a rope. */
+static const size_t minRopeLength = 1024;
+
+
+/* Set `v' to the concatenation of the string values `parts'. */
+static void concatStrings(const Value * parts, unsigned int nrParts,
+    size_t length, Value & v)
+{
+    string s;
+    s.reserve(length);
+    PathSet context;
+
+    /* Ropes built by repeated appending are very deep, so walk the
+       parts without recursion. */
+    std::vector<const Value *> todo;
+    for (unsigned int n = nrParts; n--; )
+        todo.push_back(&parts[n]);
+
+    while (!todo.empty()) {
+        const Value * part = todo.back();
+        todo.pop_back();
+        const char * s2 = part->string.s;
+        const char * * context2 = part->string.context;
+        if (!s2) {
+            StringRope * rope2 = part->stringRope.rope;
+            if (!rope2->s) {
+                for (unsigned int n = rope2->nrParts; n--; )
+                    todo.push_back(&rope2->parts[n]);
+                continue;
+            }
+            s2 = rope2->s;
+            context2 = rope2->context;
+        }
+        s += s2;
+        if (context2)
+            for (const char * * p = context2; *p; ++p)
+                context.insert(*p);
+    }
+
+    mkString(v, s, context);
+}
+
+
+void flattenString(Value & v)
+{
+    if (v.type != tString || v.string.s) return;
+
+    StringRope * rope = v.stringRope.rope;
+
+    if (!rope->s) {
+        Value vFlat;
+        concatStrings(rope->parts, rope->nrParts, rope->length, vFlat);
+        rope->s = vFlat.string.s;
+        rope->context = vFlat.string.context;
+    }
+
+    v.string.s = rope->s;
+    v.string.context = rope->context;
+}
+
+
 void mkPath(Value & v, const char * s)
 {
     mkPathNoCopy(v, GC_STRDUP(s));
@@ -390,8 +581,8 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
             env->values[0] = v;
             env->haveWithAttrs = true;
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        Attr * j = env->values[0]->attrs->find(var.name);
+        if (j) {
             if (countCalls && j->pos) attrSelects[*j->pos]++;
             return j->value;
         }
@@ -402,10 +593,45 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 }
 
 
+#if !HAVE_BOEHMGC
+
+/* Blocks are this big unless a single allocation needs more. */
+static const size_t arenaBlockSize = 1024 * 1024;
+
+
+void * Arena::allocBlock(size_t size)
+{
+    /* Give large objects a block of their own, so that the rest of
+       the current block isn't wasted. */
+    bool own = size > arenaBlockSize / 4;
+    size_t blockSize = own ? size : arenaBlockSize;
+    char * block = (char *) malloc(blockSize);
+    if (!block) throw std::bad_alloc();
+    blocks.push_back(block);
+    if (own) return block;
+    pos = block + size;
+    left = blockSize - size;
+    return block;
+}
+
+
+Arena::~Arena()
+{
+    foreach (std::vector<char *>::iterator, i, blocks)
+        free(*i);
+}
+
+#endif
+
+
 Value * EvalState::allocValue()
 {
     nrValues++;
+#if HAVE_BOEHMGC
     return (Value *) GC_MALLOC(sizeof(Value));
+#else
+    return (Value *) valueArena.alloc(sizeof(Value));
+#endif
 }
 
 
@@ -413,7 +639,11 @@ Env & EvalState::allocEnv(unsigned int size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
+#if HAVE_BOEHMGC
     Env * env = (Env *) GC_MALLOC(sizeof(Env) + size * sizeof(Value *));
+#else
+    Env * env = (Env *) envArena.alloc(sizeof(Env) + size * sizeof(Value *));
+#endif
 
     /* Clear the values because maybeThunk() and lookupVar fromWith expects this. */
     for (unsigned i = 0; i < size; ++i)
@@ -433,10 +663,22 @@ Value * EvalState::allocAttr(Value & vAttrs, const Symbol & name)
 
 void EvalState::mkList(Value & v, unsigned int length)
 {
-    v.type = tList;
-    v.list.length = length;
-    v.list.elems = length ? (Value * *) GC_MALLOC(length * sizeof(Value *)) : 0;
+    clearValue(v);
     nrListElems += length;
+    if (length == 1)
+        v.type = tList1;
+    else if (length == 2)
+        v.type = tList2;
+    else {
+        v.type = tListN;
+        v.bigList.size = length;
+#if HAVE_BOEHMGC
+        v.bigList.elems = length ? (Value * *) GC_MALLOC(length * sizeof(Value *)) : 0;
+#else
+        v.bigList.elems = length ? (Value * *) envArena.alloc(length * sizeof(Value *)) : 0;
+#endif
+        nrListElemsAllocated += length;
+    }
 }
 
 
@@ -532,6 +774,7 @@ void EvalState::evalFile(const Path & path, Value & v)
     }
 
     Path path2 = resolveExprPath(path);
+    if (trackInputs) recordInput("expr:" + path, path2);
     if ((i = fileEvalCache.find(path2)) != fileEvalCache.end()) {
         v = i->second;
         return;
@@ -557,6 +800,19 @@ void EvalState::resetFileCache()
 }
 
 
+void EvalState::recordInput(const string & input)
+{
+    if (trackInputs && inputs.find(input) == inputs.end())
+        inputs[input] = fingerprintInput(input);
+}
+
+
+void EvalState::recordInput(const string & input, const string & fingerprint)
+{
+    if (trackInputs) inputs[input] = fingerprint;
+}
+
+
 void EvalState::eval(Expr * e, Value & v)
 {
     e->eval(*this, baseEnv, v);
@@ -684,8 +940,8 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
         i->nameExpr->eval(state, *dynamicEnv, nameVal);
         state.forceStringNoCtx(nameVal);
         Symbol nameSym = state.symbols.create(nameVal.string.s);
-        Bindings::iterator j = v.attrs->find(nameSym);
-        if (j != v.attrs->end())
+        Attr * j = v.attrs->find(nameSym);
+        if (j)
             throwEvalError("dynamic attribute `%1%' at %2% already defined at %3%", nameSym, i->pos, *j->pos);
 
         i->valueExpr->setName(nameSym);
@@ -717,8 +973,8 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
 void ExprList::eval(EvalState & state, Env & env, Value & v)
 {
     state.mkList(v, elems.size());
-    for (unsigned int n = 0; n < v.list.length; ++n)
-        v.list.elems[n] = elems[n]->maybeThunk(state, env);
+    for (unsigned int n = 0; n < v.listSize(); ++n)
+        v.listElems()[n] = elems[n]->maybeThunk(state, env);
 }
 
 
@@ -744,19 +1000,19 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 
         foreach (AttrPath::const_iterator, i, attrPath) {
             nrLookups++;
-            Bindings::iterator j;
+            Attr * j;
             Symbol name = getName(*i, state, env);
             if (def) {
                 state.forceValue(*vAttrs);
                 if (vAttrs->type != tAttrs ||
-                    (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                    !(j = vAttrs->attrs->find(name)))
                 {
                     def->eval(state, env, v);
                     return;
                 }
             } else {
                 state.forceAttrs(*vAttrs, pos);
-                if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end()) {
+                if (!(j = vAttrs->attrs->find(name))) {
                     AttrPath staticPath;
                     AttrPath::const_iterator j;
                     for (j = attrPath.begin(); j != i; ++j)
@@ -794,10 +1050,10 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 
     foreach (AttrPath::const_iterator, i, attrPath) {
         state.forceValue(*vAttrs);
-        Bindings::iterator j;
+        Attr * j;
         Symbol name = getName(*i, state, env);
         if (vAttrs->type != tAttrs ||
-            (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+            !(j = vAttrs->attrs->find(name)))
         {
             mkBool(v, false);
             return;
@@ -827,6 +1083,46 @@ void ExprApp::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+EvalCosts EvalState::getCosts()
+{
+    EvalCosts costs;
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    costs.time = (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+    costs.values = nrValues;
+    costs.envs = nrEnvs;
+    costs.listElems = nrListElems;
+    costs.bytes = nrValues * sizeof(Value)
+        + nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *)
+        + nrListElemsAllocated * sizeof(Value *);
+    return costs;
+}
+
+
+/* Records a call of a lambda or primop in the profiler (if enabled)
+   for as long as it's in scope. */
+struct ProfilerFrame
+{
+    EvalState & state;
+    EvalCosts start;
+
+    template<class F> ProfilerFrame(EvalState & state, F & fun) : state(state)
+    {
+        if (!state.profiler) return;
+        start = state.getCosts();
+        state.profiler->enter(fun);
+    }
+
+    ~ProfilerFrame()
+    {
+        if (!state.profiler) return;
+        EvalCosts costs = state.getCosts();
+        costs -= start;
+        state.profiler->leave(costs);
+    }
+};
+
+
 void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
 {
     /* Figure out the number of arguments still needed. */
@@ -853,6 +1149,7 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
         /* And call the primop. */
         nrPrimOpCalls++;
         if (countCalls) primOpCalls[primOp->primOp->name]++;
+        ProfilerFrame frame(*this, *primOp->primOp);
         primOp->primOp->fun(*this, pos, vArgs, v);
     } else {
         Value * fun2 = allocValue();
@@ -898,8 +1195,8 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
            argument has a default, use the default. */
         unsigned int attrsUsed = 0;
         foreach (Formals::Formals_::iterator, i, lambda.formals->formals) {
-            Bindings::iterator j = arg.attrs->find(i->name);
-            if (j == arg.attrs->end()) {
+            Attr * j = arg.attrs->find(i->name);
+            if (!j) {
                 if (!i->def) throwTypeError("%1% called without required argument `%2%', at %3%",
                     lambda, i->name, pos);
                 env2.values[displ++] = i->def->maybeThunk(*this, env2);
@@ -924,16 +1221,19 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     nrFunctionCalls++;
     if (countCalls) incrFunctionCall(&lambda);
 
-    /* Evaluate the body.  This is conditional on showTrace, because
-       catching exceptions makes this function not tail-recursive. */
-    if (settings.showTrace)
+    /* Evaluate the body.  This is conditional on showTrace and
+       profiling, because catching exceptions and leaving the
+       profiler's stack frame make this function not tail-recursive. */
+    if (settings.showTrace || profiler) {
+        ProfilerFrame frame(*this, lambda);
         try {
             lambda.body->eval(*this, env2, v);
         } catch (Error & e) {
-            addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, pos);
+            if (settings.showTrace)
+                addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, pos);
             throw;
         }
-    else
+    } else
         fun.lambda.fun->body->eval(*this, env2, v);
 }
 
@@ -959,8 +1259,8 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
     mkAttrs(*actualArgs, fun.lambda.fun->formals->formals.size());
 
     foreach (Formals::Formals_::iterator, i, fun.lambda.fun->formals->formals) {
-        Bindings::iterator j = args.find(i->name);
-        if (j != args.end())
+        Attr * j = args.find(i->name);
+        if (j)
             actualArgs->attrs->push_back(*j);
         else if (!i->def)
             throwTypeError("cannot auto-call a function that has an argument without a default value (`%1%')", i->name);
@@ -1049,26 +1349,22 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
-    state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
+    state.mkAttrs(v, 0);
+
+    /* If the second set is much smaller than the first, share the
+       first set rather than copying it.  This is the common case of
+       overriding a few attributes of a big set (like Nixpkgs). */
+    if (v2.attrs->size() * 8 <= v1.attrs->size() && v.attrs->layer(v1.attrs, v2.attrs)) {
+        state.nrOpUpdatesLayered++;
+        return;
+    }
 
     /* Merge the sets, preferring values from the second set.  Make
        sure to keep the resulting vector in sorted order. */
+    v.attrs->reserve(v1.attrs->size() + v2.attrs->size());
     Bindings::iterator i = v1.attrs->begin();
     Bindings::iterator j = v2.attrs->begin();
-
-    while (i != v1.attrs->end() && j != v2.attrs->end()) {
-        if (i->name == j->name) {
-            v.attrs->push_back(*j);
-            ++i; ++j;
-        }
-        else if (i->name < j->name)
-            v.attrs->push_back(*i++);
-        else
-            v.attrs->push_back(*j++);
-    }
-
-    while (i != v1.attrs->end()) v.attrs->push_back(*i++);
-    while (j != v2.attrs->end()) v.attrs->push_back(*j++);
+    mergeBindings(*v.attrs, i, v1.attrs->end(), j, v2.attrs->end());
 
     state.nrOpUpdateValuesCopied += v.attrs->size();
 }
@@ -1091,20 +1387,20 @@ void EvalState::concatLists(Value & v, unsigned int nrLists, Value * * lists, co
     unsigned int len = 0;
     for (unsigned int n = 0; n < nrLists; ++n) {
         forceList(*lists[n], pos);
-        unsigned int l = lists[n]->list.length;
+        unsigned int l = lists[n]->listSize();
         len += l;
         if (l) nonEmpty = lists[n];
     }
 
-    if (nonEmpty && len == nonEmpty->list.length) {
+    if (nonEmpty && len == nonEmpty->listSize()) {
         v = *nonEmpty;
         return;
     }
 
     mkList(v, len);
     for (unsigned int n = 0, pos = 0; n < nrLists; ++n) {
-        unsigned int l = lists[n]->list.length;
-        memcpy(v.list.elems + pos, lists[n]->list.elems, l * sizeof(Value *));
+        unsigned int l = lists[n]->listSize();
+        memcpy(v.listElems() + pos, lists[n]->listElems(), l * sizeof(Value *));
         pos += l;
     }
 }
@@ -1119,6 +1415,17 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     bool first = !forceString;
     ValueType firstType = tString;
 
+    /* String operands are kept as values, so that they can become
+       the parts of a rope if the result is long.  They must be
+       visible to the garbage collector in the meantime. */
+#if HAVE_BOEHMGC
+    std::vector<Value, traceable_allocator<Value> > parts;
+#else
+    std::vector<Value> parts;
+#endif
+    parts.reserve(es->size());
+    size_t length = 0;
+
     foreach (vector<Expr *>::iterator, i, *es) {
         Value vTmp;
         (*i)->eval(state, env, vTmp);
@@ -1136,8 +1443,17 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
             if (vTmp.type != tInt)
                 throwEvalError("cannot add %1% to an integer, at %2%", showType(vTmp), pos);
             n += vTmp.integer;
-        } else
-            s << state.coerceToString(pos, vTmp, context, false, firstType == tString);
+        } else if (firstType == tPath)
+            s << state.coerceToString(pos, vTmp, context, false, false);
+        else {
+            if (vTmp.type != tString) {
+                PathSet context2;
+                string s2 = state.coerceToString(pos, vTmp, context2, false, firstType == tString);
+                mkString(vTmp, s2, context2);
+            }
+            parts.push_back(vTmp);
+            length += vTmp.string.s ? strlen(vTmp.string.s) : vTmp.stringRope.rope->length;
+        }
     }
 
     if (firstType == tInt)
@@ -1146,8 +1462,27 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
         if (!context.empty())
             throwEvalError("a string that refers to a store path cannot be appended to a path, at %1%", pos);
         mkPath(v, s.str().c_str());
-    } else
-        mkString(v, s.str(), context);
+    } else if (parts.size() == 1)
+        v = parts[0];
+    else if (length < minRopeLength)
+        concatStrings(parts.data(), parts.size(), length, v);
+    else {
+        size_t size = sizeof(StringRope) + parts.size() * sizeof(Value);
+#if HAVE_BOEHMGC
+        StringRope * rope = (StringRope *) GC_MALLOC(size);
+#else
+        StringRope * rope = (StringRope *) state.envArena.alloc(size);
+#endif
+        rope->length = length;
+        rope->s = 0;
+        rope->context = 0;
+        rope->nrParts = parts.size();
+        std::copy(parts.begin(), parts.end(), rope->parts);
+        v.type = tString;
+        v.stringRope.s = 0;
+        v.stringRope.rope = rope;
+        state.nrStringRopes++;
+    }
 }
 
 
@@ -1166,9 +1501,9 @@ void EvalState::strictForceValue(Value & v)
             strictForceValue(*i->value);
     }
 
-    else if (v.type == tList) {
-        for (unsigned int n = 0; n < v.list.length; ++n)
-            strictForceValue(*v.list.elems[n]);
+    else if (v.isList()) {
+        for (unsigned int n = 0; n < v.listSize(); ++n)
+            strictForceValue(*v.listElems()[n]);
     }
 }
 
@@ -1208,6 +1543,7 @@ string EvalState::forceString(Value & v, const Pos & pos)
         else
             throwTypeError("value is %1% while a string was expected", v);
     }
+    flattenString(v);
     return string(v.string.s);
 }
 
@@ -1246,10 +1582,11 @@ string EvalState::forceStringNoCtx(Value & v, const Pos & pos)
 bool EvalState::isDerivation(Value & v)
 {
     if (v.type != tAttrs) return false;
-    Bindings::iterator i = v.attrs->find(sType);
-    if (i == v.attrs->end()) return false;
+    Attr * i = v.attrs->find(sType);
+    if (!i) return false;
     forceValue(*i->value);
     if (i->value->type != tString) return false;
+    flattenString(*i->value);
     return strcmp(i->value->string.s, "derivation") == 0;
 }
 
@@ -1262,6 +1599,7 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
     string s;
 
     if (v.type == tString) {
+        flattenString(v);
         copyContext(v, context);
         return v.string.s;
     }
@@ -1272,8 +1610,8 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
     }
 
     if (v.type == tAttrs) {
-        Bindings::iterator i = v.attrs->find(sOutPath);
-        if (i == v.attrs->end()) throwTypeError("cannot coerce a set to a string, at %1%", pos);
+        Attr * i = v.attrs->find(sOutPath);
+        if (!i) throwTypeError("cannot coerce a set to a string, at %1%", pos);
         return coerceToString(pos, *i->value, context, coerceMore, copyToStore);
     }
 
@@ -1286,14 +1624,14 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
         if (v.type == tInt) return int2String(v.integer);
         if (v.type == tNull) return "";
 
-        if (v.type == tList) {
+        if (v.isList()) {
             string result;
-            for (unsigned int n = 0; n < v.list.length; ++n) {
-                result += coerceToString(pos, *v.list.elems[n],
+            for (unsigned int n = 0; n < v.listSize(); ++n) {
+                result += coerceToString(pos, *v.listElems()[n],
                     context, coerceMore, copyToStore);
-                if (n < v.list.length - 1
+                if (n < v.listSize() - 1
                     /* !!! not quite correct */
-                    && (v.list.elems[n]->type != tList || v.list.elems[n]->list.length != 0))
+                    && (!v.listElems()[n]->isList() || v.listElems()[n]->listSize() != 0))
                     result += " ";
             }
             return result;
@@ -1321,6 +1659,8 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
             % path % dstPath);
     }
 
+    if (trackInputs) recordInput("tree:" + path, dstPath);
+
     context.insert(dstPath);
     return dstPath;
 }
@@ -1356,6 +1696,8 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             return v1.boolean == v2.boolean;
 
         case tString:
+            flattenString(v1);
+            flattenString(v2);
             return strcmp(v1.string.s, v2.string.s) == 0;
 
         case tPath:
@@ -1364,19 +1706,21 @@ bool EvalState::eqValues(Value & v1, Value & v2)
         case tNull:
             return true;
 
-        case tList:
-            if (v1.list.length != v2.list.length) return false;
-            for (unsigned int n = 0; n < v1.list.length; ++n)
-                if (!eqValues(*v1.list.elems[n], *v2.list.elems[n])) return false;
+        case tList1:
+        case tList2:
+        case tListN:
+            if (v1.listSize() != v2.listSize()) return false;
+            for (unsigned int n = 0; n < v1.listSize(); ++n)
+                if (!eqValues(*v1.listElems()[n], *v2.listElems()[n])) return false;
             return true;
 
         case tAttrs: {
             /* If both sets denote a derivation (type = "derivation"),
                then compare their outPaths. */
             if (isDerivation(v1) && isDerivation(v2)) {
-                Bindings::iterator i = v1.attrs->find(sOutPath);
-                Bindings::iterator j = v2.attrs->find(sOutPath);
-                if (i != v1.attrs->end() && j != v2.attrs->end())
+                Attr * i = v1.attrs->find(sOutPath);
+                Attr * j = v2.attrs->find(sOutPath);
+                if (i && j)
                     return eqValues(*i->value, *j->value);
             }
 
@@ -1417,14 +1761,22 @@ void EvalState::printStats()
     printMsg(v, format("  size of a value: %1%") % sizeof(Value));
     printMsg(v, format("  environments allocated: %1% (%2% bytes)")
         % nrEnvs % (nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *)));
-    printMsg(v, format("  list elements: %1% (%2% bytes)")
-        % nrListElems % (nrListElems * sizeof(Value *)));
+    printMsg(v, format("  list elements: %1% (%2% bytes, %3% stored in values)")
+        % nrListElems % (nrListElemsAllocated * sizeof(Value *))
+        % (nrListElems - nrListElemsAllocated));
     printMsg(v, format("  list concatenations: %1%") % nrListConcats);
+    printMsg(v, format("  string concatenations kept as ropes: %1%") % nrStringRopes);
     printMsg(v, format("  values allocated: %1% (%2% bytes)")
         % nrValues % (nrValues * sizeof(Value)));
     printMsg(v, format("  sets allocated: %1%") % nrAttrsets);
+#if !HAVE_BOEHMGC
+    printMsg(v, format("  arena blocks: %1% (%2% bytes in use)")
+        % (valueArena.getBlocks() + envArena.getBlocks())
+        % (valueArena.getBytesAllocated() + envArena.getBytesAllocated()));
+#endif
     printMsg(v, format("  right-biased unions: %1%") % nrOpUpdates);
     printMsg(v, format("  values copied in right-biased unions: %1%") % nrOpUpdateValuesCopied);
+    printMsg(v, format("  right-biased unions sharing the left set: %1%") % nrOpUpdatesLayered);
     printMsg(v, format("  symbols in symbol table: %1%") % symbols.size());
     printMsg(v, format("  size of symbol table: %1%") % symbols.totalSize());
     printMsg(v, format("  number of thunks: %1%") % nrThunks);
@@ -1433,6 +1785,11 @@ void EvalState::printStats()
     printMsg(v, format("  number of primop calls: %1%") % nrPrimOpCalls);
     printMsg(v, format("  number of function calls: %1%") % nrFunctionCalls);
 
+    if (profiler) {
+        printMsg(lvlInfo, format("writing evaluation profile to `%1%'") % profileFile);
+        profiler->write(profileFile);
+    }
+
     if (countCalls) {
         v = lvlInfo;
 
@@ -4,6 +4,7 @@
 #include "nixexpr.hh"
 #include "symbol-table.hh"
 #include "hash.hh"
+#include "profiler.hh"
 
 #include <map>
 
@@ -23,16 +24,85 @@ struct Attr;
    (i.e. pointer to the attribute name in the symbol table). */
 #if HAVE_BOEHMGC
 typedef std::vector<Attr, gc_allocator<Attr> > BindingsBase;
+typedef std::vector<unsigned int, gc_allocator<unsigned int> > BindingsIndex;
 #else
 typedef std::vector<Attr> BindingsBase;
+typedef std::vector<unsigned int> BindingsIndex;
 #endif
 
 
-class Bindings : public BindingsBase
+/* The vector is a private base so that a layered set (see below)
+   can't be accessed without being flattened first. */
+class Bindings : private BindingsBase
 {
+private:
+
+    /* A set can also be the result of `*base // *overrides' that
+       hasn't been computed yet.  Such a layered set has an empty
+       vector until it's flattened, which happens the first time it's
+       iterated over.  Lookups just go through the layers, so they
+       don't flatten.  This makes a chain of `//' operations that each
+       add a few attributes to a big set linear rather than
+       quadratic. */
+    Bindings * base, * overrides;
+    unsigned int depth; // number of layers below this one
+    size_type layeredSize;
+
+    /* For big sets, lookups use a hash table of positions in the
+       vector (plus one, with 0 denoting an empty slot).  It's built
+       on demand and discarded when the vector changes. */
+    BindingsIndex index;
+    size_type indexedSize;
+
+    iterator findOwn(const Symbol & name);
+    void flatten();
+
 public:
-    iterator find(const Symbol & name);
+
+    using BindingsBase::iterator;
+    using BindingsBase::size_type;
+    using BindingsBase::push_back;
+    using BindingsBase::insert;
+    using BindingsBase::reserve;
+    using BindingsBase::operator [];
+
+    Bindings() : base(0), overrides(0), depth(0), layeredSize(0), indexedSize(0) { }
+
+    /* Maximum number of layers; deeper chains are flattened. */
+    static const unsigned int maxDepth = 16;
+
+    /* Return the attribute `name', or 0 if there is none. */
+    Attr * find(const Symbol & name);
+
     void sort();
+
+    iterator begin()
+    {
+        if (base) flatten();
+        return BindingsBase::begin();
+    }
+
+    iterator end()
+    {
+        if (base) flatten();
+        return BindingsBase::end();
+    }
+
+    size_type size() const
+    {
+        return base ? layeredSize : BindingsBase::size();
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /* Turn this (empty) set into the layered set `*base //
+       *overrides'.  Returns false if the result would have too many
+       layers, in which case the caller should merge the sets
+       instead. */
+    bool layer(Bindings * base, Bindings * overrides);
 };
 
 
@@ -89,6 +159,50 @@ std::ostream & operator << (std::ostream & str, const Value & v);
 typedef list<std::pair<string, Path> > SearchPath;
 
 
+#if !HAVE_BOEHMGC
+/* Without a garbage collector, values, environments and list element
+   arrays are never freed individually.  So they are allocated by
+   bumping a pointer in large blocks, which are freed together when
+   the arena is destroyed. */
+class Arena
+{
+private:
+    std::vector<char *> blocks;
+    char * pos;
+    size_t left;
+    size_t bytesAllocated;
+
+    void * allocBlock(size_t size);
+
+public:
+    Arena() : pos(0), left(0), bytesAllocated(0) { };
+    ~Arena();
+
+    void * alloc(size_t size)
+    {
+        /* Keep everything pointer-aligned. */
+        size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        bytesAllocated += size;
+        if (size > left) return allocBlock(size);
+        void * p = pos;
+        pos += size;
+        left -= size;
+        return p;
+    }
+
+    size_t getBytesAllocated() { return bytesAllocated; };
+    size_t getBlocks() { return blocks.size(); };
+};
+#endif
+
+
+/* The impure inputs of an evaluation (files read, paths tested for
+   existence, environment variables queried, ...), mapped to a
+   fingerprint of their state at the time they were used.  See
+   eval-cache.hh. */
+typedef std::map<string, string> EvalInputs;
+
+
 class EvalState
 {
 public:
@@ -103,6 +217,16 @@ public:
        already exist there. */
     bool repair;
 
+    /* If set, the impure inputs of the evaluation are recorded in
+       `inputs'. */
+    bool trackInputs;
+    EvalInputs inputs;
+
+    /* Set once the evaluation has used something that differs
+       between evaluations, like the current time.  It's never reset,
+       since later evaluations may share the resulting values. */
+    bool impure;
+
 private:
     SrcToStore srcToStore;
 
@@ -116,6 +240,13 @@ private:
 
     SearchPath searchPath;
 
+#if !HAVE_BOEHMGC
+    /* Values are kept separate from environments and list element
+       arrays, so that they are densely packed.  These must be
+       initialised before `baseEnv'. */
+    Arena valueArena, envArena;
+#endif
+
 public:
 
     EvalState(const Strings & _searchPath);
@@ -141,6 +272,14 @@ public:
     Path findFile(const string & path);
     Path findFile(SearchPath & searchPath, const string & path);
 
+    const SearchPath & getSearchPath() { return searchPath; };
+
+    /* Record an impure input of the evaluation if `trackInputs' is
+       set.  If no fingerprint is given, it is computed by
+       fingerprintInput(). */
+    void recordInput(const string & input);
+    void recordInput(const string & input, const string & fingerprint);
+
     /* Evaluate an expression to normal form, storing the result in
        value `v'. */
     void eval(Expr * e, Value & v);
@@ -226,6 +365,10 @@ private:
     Expr * parse(const char * text, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
+    /* Parse without binding variables. */
+    Expr * parse(const char * text, const Path & path,
+        const Path & basePath);
+
 public:
 
     /* Do a deep equality test between two values.  That is, list
@@ -261,15 +404,24 @@ private:
     unsigned long nrValuesInEnvs;
     unsigned long nrValues;
     unsigned long nrListElems;
+    unsigned long nrListElemsAllocated;
     unsigned long nrAttrsets;
     unsigned long nrOpUpdates;
     unsigned long nrOpUpdateValuesCopied;
+    unsigned long nrOpUpdatesLayered;
     unsigned long nrListConcats;
+    unsigned long nrStringRopes;
     unsigned long nrPrimOpCalls;
     unsigned long nrFunctionCalls;
 
     bool countCalls;
 
+    /* The profiler, if NIX_EVAL_PROFILE is set. */
+    EvalProfiler * profiler;
+    Path profileFile;
+
+    EvalCosts getCosts();
+
     typedef std::map<Symbol, unsigned int> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
@@ -283,6 +435,8 @@ private:
 
     friend struct ExprOpUpdate;
     friend struct ExprOpConcatLists;
+    friend struct ExprConcatStrings;
+    friend struct ProfilerFrame;
     friend struct ExprSelect;
     friend void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v);
 };
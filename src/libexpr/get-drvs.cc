@@ -1,19 +1,45 @@
 #include "get-drvs.hh"
 #include "util.hh"
 #include "eval-inline.hh"
+#include "globals.hh"
+#include "store-api.hh"
+#include "serialise.hh"
+#include "value-to-json.hh"
+#include "json-to-value.hh"
 
 #include <cstring>
+#include <climits>
+#include <sstream>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 namespace nix {
 
 
+void DeferredError::rethrow()
+{
+    if (msg.empty()) return;
+    if (assertion) {
+        AssertionError e(msg);
+        e.addPrefix(prefix);
+        throw e;
+    }
+    EvalError e(msg);
+    e.addPrefix(prefix);
+    throw e;
+}
+
+
 string DrvInfo::queryDrvPath()
 {
+    if (drvPath == "" && !attrs) errors.drvPath.rethrow();
     if (drvPath == "" && attrs) {
-        Bindings::iterator i = attrs->find(state->sDrvPath);
+        Attr * i = attrs->find(state->sDrvPath);
         PathSet context;
-        drvPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
+        drvPath = i ? state->coerceToPath(*i->pos, *i->value, context) : "";
     }
     return drvPath;
 }
@@ -21,10 +47,11 @@ string DrvInfo::queryDrvPath()
 
 string DrvInfo::queryOutPath()
 {
+    if (outPath == "" && !attrs) errors.outPath.rethrow();
     if (outPath == "" && attrs) {
-        Bindings::iterator i = attrs->find(state->sOutPath);
+        Attr * i = attrs->find(state->sOutPath);
         PathSet context;
-        outPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
+        outPath = i ? state->coerceToPath(*i->pos, *i->value, context) : "";
     }
     return outPath;
 }
@@ -32,23 +59,24 @@ string DrvInfo::queryOutPath()
 
 DrvInfo::Outputs DrvInfo::queryOutputs()
 {
+    if (outputs.empty() && !attrs) errors.outputs.rethrow();
     if (outputs.empty()) {
         /* Get the ‘outputs’ list. */
-        Bindings::iterator i;
-        if (attrs && (i = attrs->find(state->sOutputs)) != attrs->end()) {
+        Attr * i;
+        if (attrs && (i = attrs->find(state->sOutputs))) {
             state->forceList(*i->value, *i->pos);
 
             /* For each output... */
-            for (unsigned int j = 0; j < i->value->list.length; ++j) {
+            for (unsigned int j = 0; j < i->value->listSize(); ++j) {
                 /* Evaluate the corresponding set. */
-                string name = state->forceStringNoCtx(*i->value->list.elems[j], *i->pos);
-                Bindings::iterator out = attrs->find(state->symbols.create(name));
-                if (out == attrs->end()) continue; // FIXME: throw error?
+                string name = state->forceStringNoCtx(*i->value->listElems()[j], *i->pos);
+                Attr * out = attrs->find(state->symbols.create(name));
+                if (!out) continue; // FIXME: throw error?
                 state->forceAttrs(*out->value);
 
                 /* And evaluate its ‘outPath’ attribute. */
-                Bindings::iterator outPath = out->value->attrs->find(state->sOutPath);
-                if (outPath == out->value->attrs->end()) continue; // FIXME: throw error?
+                Attr * outPath = out->value->attrs->find(state->sOutPath);
+                if (!outPath) continue; // FIXME: throw error?
                 PathSet context;
                 outputs[name] = state->coerceToPath(*outPath->pos, *outPath->value, context);
             }
@@ -61,9 +89,10 @@ DrvInfo::Outputs DrvInfo::queryOutputs()
 
 string DrvInfo::queryOutputName()
 {
+    if (outputName == "" && !attrs) errors.outputName.rethrow();
     if (outputName == "" && attrs) {
-        Bindings::iterator i = attrs->find(state->sOutputName);
-        outputName = i != attrs->end() ? state->forceStringNoCtx(*i->value) : "";
+        Attr * i = attrs->find(state->sOutputName);
+        outputName = i ? state->forceStringNoCtx(*i->value) : "";
     }
     return outputName;
 }
@@ -72,9 +101,12 @@ string DrvInfo::queryOutputName()
 Bindings * DrvInfo::getMeta()
 {
     if (meta) return meta;
-    if (!attrs) return 0;
-    Bindings::iterator a = attrs->find(state->sMeta);
-    if (a == attrs->end()) return 0;
+    if (!attrs) {
+        errors.meta.rethrow();
+        return 0;
+    }
+    Attr * a = attrs->find(state->sMeta);
+    if (!a) return 0;
     state->forceAttrs(*a->value, *a->pos);
     meta = a->value->attrs;
     return meta;
@@ -94,14 +126,14 @@ StringSet DrvInfo::queryMetaNames()
 bool DrvInfo::checkMeta(Value & v)
 {
     state->forceValue(v);
-    if (v.type == tList) {
-        for (unsigned int n = 0; n < v.list.length; ++n)
-            if (!checkMeta(*v.list.elems[n])) return false;
+    if (v.isList()) {
+        for (unsigned int n = 0; n < v.listSize(); ++n)
+            if (!checkMeta(*v.listElems()[n])) return false;
         return true;
     }
     else if (v.type == tAttrs) {
-        Bindings::iterator i = v.attrs->find(state->sOutPath);
-        if (i != v.attrs->end()) return false;
+        Attr * i = v.attrs->find(state->sOutPath);
+        if (i) return false;
         foreach (Bindings::iterator, i, *v.attrs)
             if (!checkMeta(*i->value)) return false;
         return true;
@@ -113,8 +145,8 @@ bool DrvInfo::checkMeta(Value & v)
 Value * DrvInfo::queryMeta(const string & name)
 {
     if (!getMeta()) return 0;
-    Bindings::iterator a = meta->find(state->symbols.create(name));
-    if (a == meta->end() || !checkMeta(*a->value)) return 0;
+    Attr * a = meta->find(state->symbols.create(name));
+    if (!a || !checkMeta(*a->value)) return 0;
     return a->value;
 }
 
@@ -123,6 +155,7 @@ string DrvInfo::queryMetaString(const string & name)
 {
     Value * v = queryMeta(name);
     if (!v || v->type != tString) return "";
+    flattenString(*v);
     return v->string.s;
 }
 
@@ -135,6 +168,7 @@ int DrvInfo::queryMetaInt(const string & name, int def)
     if (v->type == tString) {
         /* Backwards compatibility with before we had support for
            integer meta fields. */
+        flattenString(*v);
         int n;
         if (string2Int(v->string.s, n)) return n;
     }
@@ -150,6 +184,7 @@ bool DrvInfo::queryMetaBool(const string & name, bool def)
     if (v->type == tString) {
         /* Backwards compatibility with before we had support for
            Boolean meta fields. */
+        flattenString(*v);
         if (strcmp(v->string.s, "true") == 0) return true;
         if (strcmp(v->string.s, "false") == 0) return false;
     }
@@ -193,14 +228,14 @@ static bool getDerivation(EvalState & state, Value & v,
         if (done.find(v.attrs) != done.end()) return false;
         done.insert(v.attrs);
 
-        Bindings::iterator i = v.attrs->find(state.sName);
+        Attr * i = v.attrs->find(state.sName);
         /* !!! We really would like to have a decent back trace here. */
-        if (i == v.attrs->end()) throw TypeError("derivation name missing");
+        if (!i) throw TypeError("derivation name missing");
 
-        Bindings::iterator i2 = v.attrs->find(state.sSystem);
+        Attr * i2 = v.attrs->find(state.sSystem);
 
         DrvInfo drv(state, state.forceStringNoCtx(*i->value), attrPath,
-            i2 == v.attrs->end() ? "unknown" : state.forceStringNoCtx(*i2->value, *i2->pos),
+            i2 ? state.forceStringNoCtx(*i2->value, *i2->pos) : "unknown",
             v.attrs);
 
         drvs.push_back(drv);
@@ -234,7 +269,329 @@ static string addToPath(const string & s1, const string & s2)
 static void getDerivations(EvalState & state, Value & vIn,
     const string & pathPrefix, Bindings & autoArgs,
     DrvInfos & drvs, Done & done,
-    bool ignoreAssertionFailures)
+    bool ignoreAssertionFailures, unsigned int fields, bool parallel);
+
+
+/* Find the derivations in the attribute `v2' (at `pathPrefix2') of a
+   set. */
+static void getDerivationsInAttr(EvalState & state, Value & v2,
+    const string & pathPrefix2, bool combineChannels, Bindings & autoArgs,
+    DrvInfos & drvs, Done & done, bool ignoreAssertionFailures,
+    unsigned int fields, bool parallel)
+{
+    if (combineChannels)
+        getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, fields, parallel);
+    else if (getDerivation(state, v2, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
+        /* If the value of this attribute is itself a set,
+           should we recurse into it?  => Only if it has a
+           `recurseForDerivations = true' attribute. */
+        if (v2.type == tAttrs) {
+            Attr * j = v2.attrs->find(state.symbols.create("recurseForDerivations"));
+            if (j && state.forceBool(*j->value))
+                getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, fields, false);
+        }
+    }
+}
+
+
+typedef std::map<string, Symbol> SortedSymbols;
+
+
+static void writeDeferredError(const DeferredError & e, Sink & sink)
+{
+    writeString(e.prefix, sink);
+    writeString(e.msg, sink);
+    writeInt(e.assertion, sink);
+}
+
+
+static DeferredError readDeferredError(Source & source)
+{
+    DeferredError e;
+    e.prefix = readString(source);
+    e.msg = readString(source);
+    e.assertion = readInt(source);
+    return e;
+}
+
+
+static DeferredError deferError(Error & e)
+{
+    DeferredError res;
+    res.prefix = e.prefix();
+    res.msg = e.msg();
+    res.assertion = dynamic_cast<AssertionError *>(&e) != 0;
+    return res;
+}
+
+
+void writeDrvInfo(EvalState & state, DrvInfo & drv, Sink & sink,
+    unsigned int fields)
+{
+    writeString(drv.attrPath, sink);
+    writeString(drv.name, sink);
+    writeString(drv.system, sink);
+    writeInt(fields, sink);
+
+    DrvInfoErrors errors;
+
+    if (fields & drvFieldDrvPath) {
+        string drvPath;
+        try { drvPath = drv.queryDrvPath(); } catch (Error & e) { errors.drvPath = deferError(e); }
+        writeString(drvPath, sink);
+        writeDeferredError(errors.drvPath, sink);
+    }
+
+    if (fields & drvFieldOutPath) {
+        string outPath, outputName;
+        try { outPath = drv.queryOutPath(); } catch (Error & e) { errors.outPath = deferError(e); }
+        try { outputName = drv.queryOutputName(); } catch (Error & e) { errors.outputName = deferError(e); }
+        writeString(outPath, sink);
+        writeDeferredError(errors.outPath, sink);
+        writeString(outputName, sink);
+        writeDeferredError(errors.outputName, sink);
+    }
+
+    if (fields & drvFieldOutputs) {
+        DrvInfo::Outputs outputs;
+        try { outputs = drv.queryOutputs(); } catch (Error & e) { errors.outputs = deferError(e); }
+        writeInt(outputs.size(), sink);
+        foreach (DrvInfo::Outputs::iterator, i, outputs) {
+            writeString(i->first, sink);
+            writeString(i->second, sink);
+        }
+        writeDeferredError(errors.outputs, sink);
+    }
+
+    if (fields & drvFieldMeta) {
+        /* Meta attributes are sent as JSON, which covers every value
+           that queryMeta() accepts. */
+        std::ostringstream meta;
+        try {
+            StringSet names = drv.queryMetaNames();
+            PathSet context;
+            JSONObject json(meta);
+            foreach (StringSet::iterator, i, names) {
+                Value * v = drv.queryMeta(*i);
+                if (!v) continue;
+                json.attr(*i);
+                printValueAsJSON(state, true, *v, meta, context);
+            }
+        } catch (Error & e) {
+            errors.meta = deferError(e);
+        }
+        writeString(errors.meta.msg.empty() ? meta.str() : "", sink);
+        writeDeferredError(errors.meta, sink);
+    }
+}
+
+
+/* Read the fields written by writeDrvInfo() into `drv'.  A field that
+   failed to evaluate is left alone, so if `drv' still has its
+   attributes, querying it evaluates it again and throws the error
+   then; otherwise the recorded error is thrown. */
+static void readDrvInfoFields(EvalState & state, Source & source, DrvInfo & drv)
+{
+    unsigned int fields = readInt(source);
+
+    DrvInfoErrors errors;
+
+    if (fields & drvFieldDrvPath) {
+        string drvPath = readString(source);
+        errors.drvPath = readDeferredError(source);
+        if (errors.drvPath.msg.empty()) drv.setDrvPath(drvPath);
+    }
+
+    if (fields & drvFieldOutPath) {
+        string outPath = readString(source);
+        errors.outPath = readDeferredError(source);
+        if (errors.outPath.msg.empty()) drv.setOutPath(outPath);
+        string outputName = readString(source);
+        errors.outputName = readDeferredError(source);
+        if (errors.outputName.msg.empty()) drv.setOutputName(outputName);
+    }
+
+    if (fields & drvFieldOutputs) {
+        DrvInfo::Outputs outputs;
+        unsigned int nrOutputs = readInt(source);
+        while (nrOutputs--) {
+            string name = readString(source);
+            outputs[name] = readString(source);
+        }
+        errors.outputs = readDeferredError(source);
+        if (errors.outputs.msg.empty()) drv.setOutputs(outputs);
+    }
+
+    if (fields & drvFieldMeta) {
+        string meta = readString(source);
+        errors.meta = readDeferredError(source);
+        if (meta != "") {
+            Value v;
+            parseJSON(state, meta, v);
+            drv.setMetaAttrs(v.attrs);
+        }
+    }
+
+    drv.setErrors(errors);
+}
+
+
+DrvInfo readDrvInfo(EvalState & state, Source & source)
+{
+    string attrPath = readString(source);
+    string name = readString(source);
+    string system = readString(source);
+    DrvInfo drv(state, name, attrPath, system, 0);
+    readDrvInfoFields(state, source, drv);
+    return drv;
+}
+
+
+/* State shared between the worker processes of a parallel
+   getDerivations(). */
+struct WorkQueue
+{
+    unsigned int next; /* next attribute to be evaluated */
+    unsigned int failed; /* lowest attribute that failed to evaluate */
+};
+
+
+/* Evaluate the attributes of the set `v' in `settings.evalJobs'
+   forked worker processes.  Each worker takes the next unevaluated
+   attribute from a shared counter, so expensive attributes don't hold
+   up the others, and evaluates the `fields' of the derivations it
+   finds.  The workers share the parent's heap copy-on-write and
+   allocate independently.
+
+   Meanwhile, the parent finds the derivations itself, without
+   evaluating their fields, which is cheap.  This way, which
+   derivations are found (and which are skipped as duplicates) is
+   exactly the same as in a sequential evaluation.  The fields
+   computed by the workers are then filled in by attribute path. */
+static void getDerivationsParallel(EvalState & state, Value & v,
+    const string & pathPrefix, Bindings & autoArgs,
+    const SortedSymbols & attrs, DrvInfos & drvs, Done & done,
+    bool ignoreAssertionFailures, unsigned int fields, unsigned int jobs)
+{
+    vector<SortedSymbols::const_iterator> todo;
+    foreach (SortedSymbols::const_iterator, i, attrs) todo.push_back(i);
+
+    void * p = mmap(0, sizeof(WorkQueue), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw SysError("allocating shared memory");
+    std::shared_ptr<WorkQueue> queue((WorkQueue *) p,
+        [](WorkQueue * p) { munmap(p, sizeof(WorkQueue)); });
+    queue->next = 0;
+    queue->failed = UINT_MAX;
+
+    Path tmpDir = createTempDir();
+    AutoDelete tmpDirDel(tmpDir, true);
+
+    printMsg(lvlDebug, format("evaluating %1% attributes using %2% workers") % todo.size() % jobs);
+
+    list<Pid> pids;
+    for (unsigned int n = 0; n < jobs; ++n) {
+        Path resultFile = (format("%1%/%2%") % tmpDir % n).str();
+        pids.push_back(Pid());
+        pids.back() = startProcess([&]() {
+            AutoCloseFD fd = open(resultFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (fd == -1) throw SysError(format("creating `%1%'") % resultFile);
+            FdSink sink(fd);
+
+            /* Don't share the parent's connection to the store.  The
+               parent's store object is leaked on purpose, since its
+               destructor shouldn't run here. */
+            new std::shared_ptr<StoreAPI>(store);
+            store = openStore(false);
+
+            unsigned int i;
+            while ((i = __sync_fetch_and_add(&queue->next, 1)) < todo.size() && i < queue->failed) {
+                checkInterrupt();
+                DrvInfos drvs2;
+                try {
+                    Value & v2(*v.attrs->find(todo[i]->second)->value);
+                    getDerivationsInAttr(state, v2, addToPath(pathPrefix, todo[i]->first),
+                        false, autoArgs, drvs2, done, ignoreAssertionFailures, 0, false);
+                } catch (Error & e) {
+                    /* The parent will throw this error when it gets
+                       here, so tell the other workers not to bother
+                       with later attributes. */
+                    unsigned int failed;
+                    while (i < (failed = queue->failed) &&
+                        !__sync_bool_compare_and_swap(&queue->failed, failed, i)) ;
+                    break;
+                }
+                foreach (DrvInfos::iterator, j, drvs2) {
+                    writeInt(1, sink);
+                    writeDrvInfo(state, *j, sink, fields);
+                }
+            }
+
+            writeInt(0, sink);
+
+            /* Send the inputs used by this worker, for the evaluation
+               cache. */
+            writeInt(state.impure, sink);
+            writeInt(state.inputs.size(), sink);
+            foreach (EvalInputs::iterator, i, state.inputs) {
+                writeString(i->first, sink);
+                writeString(i->second, sink);
+            }
+
+            sink.flush();
+            _exit(0);
+        });
+    }
+
+    /* Find the derivations while the workers evaluate them.  If this
+       throws, the workers are killed. */
+    DrvInfos found;
+    foreach (SortedSymbols::const_iterator, i, attrs) {
+        startNest(nest, lvlDebug, format("evaluating attribute `%1%'") % i->first);
+        Value & v2(*v.attrs->find(i->second)->value);
+        getDerivationsInAttr(state, v2, addToPath(pathPrefix, i->first),
+            false, autoArgs, found, done, ignoreAssertionFailures, 0, false);
+    }
+
+    std::map<string, DrvInfo *> byAttrPath;
+    foreach (DrvInfos::iterator, i, found)
+        byAttrPath[i->attrPath] = &*i;
+
+    foreach (list<Pid>::iterator, i, pids) {
+        int status = i->wait(true);
+        if (!statusOk(status))
+            throw Error(format("evaluation worker %1%") % statusToString(status));
+    }
+
+    for (unsigned int n = 0; n < jobs; ++n) {
+        Path resultFile = (format("%1%/%2%") % tmpDir % n).str();
+        AutoCloseFD fd = open(resultFile.c_str(), O_RDONLY);
+        if (fd == -1) throw SysError(format("opening `%1%'") % resultFile);
+        FdSource source(fd);
+        while (readInt(source) != 0) {
+            string attrPath = readString(source);
+            string name = readString(source);
+            string system = readString(source);
+            std::map<string, DrvInfo *>::iterator i = byAttrPath.find(attrPath);
+            DrvInfo dummy(state);
+            readDrvInfoFields(state, source, i == byAttrPath.end() ? dummy : *i->second);
+        }
+        if (readInt(source)) state.impure = true;
+        unsigned int nrInputs = readInt(source);
+        while (nrInputs--) {
+            string input = readString(source);
+            string fingerprint = readString(source);
+            state.recordInput(input, fingerprint);
+        }
+    }
+
+    drvs.splice(drvs.end(), found);
+}
+
+
+static void getDerivations(EvalState & state, Value & vIn,
+    const string & pathPrefix, Bindings & autoArgs,
+    DrvInfos & drvs, Done & done,
+    bool ignoreAssertionFailures, unsigned int fields, bool parallel)
 {
     Value v;
     state.autoCallFunction(autoArgs, vIn, v);
@@ -246,44 +603,42 @@ static void getDerivations(EvalState & state, Value & vIn,
 
         /* !!! undocumented hackery to support combining channels in
            nix-env.cc. */
-        bool combineChannels = v.attrs->find(state.symbols.create("_combineChannels")) != v.attrs->end();
+        bool combineChannels = v.attrs->find(state.symbols.create("_combineChannels")) != 0;
 
         /* Consider the attributes in sorted order to get more
            deterministic behaviour in nix-env operations (e.g. when
            there are names clashes between derivations, the derivation
            bound to the attribute with the "lower" name should take
            precedence). */
-        typedef std::map<string, Symbol> SortedSymbols;
         SortedSymbols attrs;
         foreach (Bindings::iterator, i, *v.attrs)
             attrs.insert(std::pair<string, Symbol>(i->name, i->name));
 
+        /* Worker processes can't use the store for writing, so only
+           do this in read-only mode.  If no fields will be queried,
+           finding the derivations is all the work there is. */
+        unsigned int jobs = std::min(settings.evalJobs, (unsigned int) attrs.size());
+        if (parallel && !combineChannels && settings.readOnlyMode && jobs > 1 && fields) {
+            getDerivationsParallel(state, v, pathPrefix, autoArgs,
+                attrs, drvs, done, ignoreAssertionFailures, fields, jobs);
+            return;
+        }
+
         foreach (SortedSymbols::iterator, i, attrs) {
             startNest(nest, lvlDebug, format("evaluating attribute `%1%'") % i->first);
-            string pathPrefix2 = addToPath(pathPrefix, i->first);
             Value & v2(*v.attrs->find(i->second)->value);
-            if (combineChannels)
-                getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-            else if (getDerivation(state, v2, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
-                /* If the value of this attribute is itself a set,
-                   should we recurse into it?  => Only if it has a
-                   `recurseForDerivations = true' attribute. */
-                if (v2.type == tAttrs) {
-                    Bindings::iterator j = v2.attrs->find(state.symbols.create("recurseForDerivations"));
-                    if (j != v2.attrs->end() && state.forceBool(*j->value))
-                        getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-                }
-            }
+            getDerivationsInAttr(state, v2, addToPath(pathPrefix, i->first),
+                combineChannels, autoArgs, drvs, done, ignoreAssertionFailures, fields, parallel);
         }
     }
 
-    else if (v.type == tList) {
-        for (unsigned int n = 0; n < v.list.length; ++n) {
+    else if (v.isList()) {
+        for (unsigned int n = 0; n < v.listSize(); ++n) {
             startNest(nest, lvlDebug,
                 format("evaluating list element"));
             string pathPrefix2 = addToPath(pathPrefix, (format("%1%") % n).str());
-            if (getDerivation(state, *v.list.elems[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
-                getDerivations(state, *v.list.elems[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+            if (getDerivation(state, *v.listElems()[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
+                getDerivations(state, *v.listElems()[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, fields, false);
         }
     }
 
@@ -292,10 +647,11 @@ static void getDerivations(EvalState & state, Value & vIn,
 
 
 void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
-    Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures)
+    Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures,
+    unsigned int fields)
 {
     Done done;
-    getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures);
+    getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures, fields, true);
 }
 
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "eval.hh"
+#include "serialise.hh"
 
 #include <string>
 #include <map>
@@ -9,6 +10,36 @@
 namespace nix {
 
 
+/* An evaluation error that is recorded now and thrown later. */
+struct DeferredError
+{
+    string prefix, msg;
+    bool assertion;
+
+    DeferredError() : assertion(false) { };
+    void rethrow();
+};
+
+
+/* The fields of a derivation that are evaluated lazily, for
+   getDerivations() and writeDrvInfo(). */
+enum {
+    drvFieldDrvPath = 1,
+    drvFieldOutPath = 2, /* and the output name */
+    drvFieldOutputs = 4,
+    drvFieldMeta = 8,
+    drvFieldAll = 15
+};
+
+
+/* Errors that occurred while evaluating the fields of a derivation
+   serialised by writeDrvInfo(). */
+struct DrvInfoErrors
+{
+    DeferredError drvPath, outPath, outputName, outputs, meta;
+};
+
+
 struct DrvInfo
 {
 public:
@@ -26,6 +57,10 @@ private:
 
     Bindings * attrs, * meta;
 
+    /* Used if this derivation was read by readDrvInfo(), in which
+       case `attrs' is null. */
+    DrvInfoErrors errors;
+
     Bindings * getMeta();
 
     bool checkMeta(Value & v);
@@ -66,6 +101,23 @@ public:
         outPath = s;
     }
 
+    void setOutputName(const string & s)
+    {
+        outputName = s;
+    }
+
+    void setOutputs(const Outputs & outputs)
+    {
+        this->outputs = outputs;
+    }
+
+    void setMetaAttrs(Bindings * meta)
+    {
+        this->meta = meta;
+    }
+
+    void setErrors(const DrvInfoErrors & e) { errors = e; };
+
     void setFailed() { failed = true; };
     bool hasFailed() { return failed; };
 };
@@ -83,9 +135,23 @@ typedef list<DrvInfo> DrvInfos;
 bool getDerivation(EvalState & state, Value & v, DrvInfo & drv,
     bool ignoreAssertionFailures);
 
+/* Find all derivations in `v'.  If the `eval-jobs' option is set and
+   we're in read-only mode, the `fields' of the derivations in a
+   top-level set are evaluated by several worker processes in
+   parallel. */
 void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs,
-    bool ignoreAssertionFailures);
+    bool ignoreAssertionFailures, unsigned int fields = drvFieldAll);
+
+/* Evaluate the `fields' of `drv' and serialise them.  Evaluation
+   errors are serialised as well, to be thrown when the corresponding
+   field is queried. */
+void writeDrvInfo(EvalState & state, DrvInfo & drv, Sink & sink,
+    unsigned int fields = drvFieldAll);
+
+/* Read a derivation written by writeDrvInfo().  The result doesn't
+   refer to any derivation attributes. */
+DrvInfo readDrvInfo(EvalState & state, Source & source);
 
 
 }
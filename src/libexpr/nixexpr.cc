@@ -371,11 +371,76 @@ string ExprLambda::showNamePos() const
 
 /* Symbol table. */
 
+SymbolTable::SymbolTable()
+{
+    Table * t = new Table;
+    t->mask = 1023;
+    t->slots = new std::atomic<Entry *>[t->mask + 1]();
+    tables.push_back(t);
+    table.store(t);
+}
+
+
+SymbolTable::~SymbolTable()
+{
+    foreach (std::vector<Table *>::iterator, i, tables) {
+        delete[] (*i)->slots;
+        delete *i;
+    }
+}
+
+
+Symbol SymbolTable::insert(const char * s, size_t len, size_t hash)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    /* Another thread may have added the symbol in the meantime. */
+    Table * t = table.load(std::memory_order_relaxed);
+    size_t i;
+    for (i = hash & t->mask; ; i = (i + 1) & t->mask) {
+        Entry * e = t->slots[i].load(std::memory_order_relaxed);
+        if (!e) break;
+        if (e->hash == hash && e->s.size() == len && memcmp(e->s.data(), s, len) == 0)
+            return Symbol(&e->s);
+    }
+
+    entries.emplace_back(s, len, hash);
+    Entry * entry = &entries.back();
+
+    /* Keep the table at most half full.  Readers of the old table
+       that don't find a symbol end up here, so they'll find it in
+       the new one. */
+    if (entries.size() * 2 > t->mask + 1) {
+        Table * t2 = new Table;
+        t2->mask = t->mask * 2 + 1;
+        t2->slots = new std::atomic<Entry *>[t2->mask + 1]();
+        foreach (std::deque<Entry>::iterator, j, entries) {
+            size_t k = j->hash & t2->mask;
+            while (t2->slots[k].load(std::memory_order_relaxed)) k = (k + 1) & t2->mask;
+            t2->slots[k].store(&*j, std::memory_order_relaxed);
+        }
+        tables.push_back(t2);
+        table.store(t2, std::memory_order_release);
+    } else
+        t->slots[i].store(entry, std::memory_order_release);
+
+    return Symbol(&entry->s);
+}
+
+
+unsigned int SymbolTable::size() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+}
+
+
 size_t SymbolTable::totalSize() const
 {
+    std::lock_guard<std::mutex> guard(lock);
     size_t n = 0;
-    foreach (Symbols::const_iterator, i, symbols)
-        n += i->size();
+    foreach (std::deque<Entry>::const_iterator, i, entries)
+        n += i->s.size();
     return n;
 }
 
@@ -0,0 +1,618 @@
+#include "parse-cache.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+
+namespace nix {
+
+
+/* Bump this when the serialisation format or the way the parser
+   desugars expressions changes. */
+static const unsigned int parseCacheVersion = 1;
+
+
+typedef enum {
+    tagNull = 0,
+    tagInt, tagString, tagPath, tagVar, tagSelect, tagOpHasAttr,
+    tagAttrs, tagList, tagLambda, tagLet, tagWith, tagIf, tagAssert,
+    tagOpNot, tagApp, tagOpEq, tagOpNEq, tagOpAnd, tagOpOr, tagOpImpl,
+    tagOpUpdate, tagOpConcatLists, tagConcatStrings, tagPos
+} ExprTag;
+
+
+/* Signed numbers are mapped to unsigned ones by zig-zag encoding, so
+   that small negative numbers are small as well. */
+static unsigned long long zigZag(long long n)
+{
+    return n < 0 ? ((unsigned long long) ~n << 1) | 1 : (unsigned long long) n << 1;
+}
+
+
+static long long unZigZag(unsigned long long n)
+{
+    return n & 1 ? ~(long long) (n >> 1) : (long long) (n >> 1);
+}
+
+
+/* Numbers are written as variable-length integers (7 bits per byte),
+   since most of them (tags, symbol indices, line and column numbers)
+   are small. */
+struct ExprWriter
+{
+    string s;
+
+    /* Symbols are numbered in order of first occurrence.  The first
+       occurrence is followed by the symbol itself. */
+    std::map<Symbol, unsigned int> symbols;
+
+    /* Positions are written relative to the previous one. */
+    Symbol lastFile;
+    unsigned int lastLine;
+
+    ExprWriter() : lastLine(0) { }
+
+    void writeNat(unsigned long long n)
+    {
+        while (n >= 0x80) {
+            s += (char) (n | 0x80);
+            n >>= 7;
+        }
+        s += (char) n;
+    }
+
+    void writeString(const string & str)
+    {
+        writeNat(str.size());
+        s += str;
+    }
+
+    void writeSymbol(const Symbol & sym)
+    {
+        if (!sym.set()) { writeNat(0); return; }
+        std::map<Symbol, unsigned int>::iterator i = symbols.find(sym);
+        if (i != symbols.end()) { writeNat(i->second); return; }
+        unsigned int n = symbols.size() + 1;
+        symbols[sym] = n;
+        writeNat(n);
+        writeString(sym);
+    }
+
+    /* 0 denotes an unknown position.  Otherwise, the low bit says
+       whether the file differs from the previous position. */
+    void writePos(const Pos & pos)
+    {
+        if (!pos) { writeNat(0); return; }
+        bool newFile = pos.file != lastFile;
+        long long delta = (long long) pos.line - lastLine;
+        writeNat(1 + (zigZag(delta) << 1 | newFile));
+        if (newFile) writeSymbol(pos.file);
+        writeNat(pos.column);
+        lastFile = pos.file;
+        lastLine = pos.line;
+    }
+
+    void writeAttrPath(const AttrPath & attrPath)
+    {
+        writeNat(attrPath.size());
+        foreach (AttrPath::const_iterator, i, attrPath) {
+            writeNat(i->symbol.set());
+            if (i->symbol.set()) writeSymbol(i->symbol); else writeExpr(i->expr);
+        }
+    }
+
+    void writeExpr(Expr * e);
+};
+
+
+#define WRITE_BINOP(name) \
+    else if (Expr##name * e2 = dynamic_cast<Expr##name *>(e)) { \
+        writeNat(tag##name); \
+        writePos(e2->pos); \
+        writeExpr(e2->e1); \
+        writeExpr(e2->e2); \
+    }
+
+
+void ExprWriter::writeExpr(Expr * e)
+{
+    if (!e)
+        writeNat(tagNull);
+
+    else if (ExprInt * e2 = dynamic_cast<ExprInt *>(e)) {
+        writeNat(tagInt);
+        writeNat(zigZag(e2->n));
+    }
+
+    else if (ExprString * e2 = dynamic_cast<ExprString *>(e)) {
+        writeNat(tagString);
+        writeSymbol(e2->s);
+    }
+
+    else if (ExprPath * e2 = dynamic_cast<ExprPath *>(e)) {
+        writeNat(tagPath);
+        writeString(e2->s);
+    }
+
+    else if (ExprVar * e2 = dynamic_cast<ExprVar *>(e)) {
+        writeNat(tagVar);
+        writePos(e2->pos);
+        writeSymbol(e2->name);
+    }
+
+    else if (ExprSelect * e2 = dynamic_cast<ExprSelect *>(e)) {
+        writeNat(tagSelect);
+        writePos(e2->pos);
+        writeExpr(e2->e);
+        writeAttrPath(e2->attrPath);
+        writeExpr(e2->def);
+    }
+
+    else if (ExprOpHasAttr * e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+        writeNat(tagOpHasAttr);
+        writeExpr(e2->e);
+        writeAttrPath(e2->attrPath);
+    }
+
+    else if (ExprAttrs * e2 = dynamic_cast<ExprAttrs *>(e)) {
+        writeNat(tagAttrs);
+        writeNat(e2->recursive);
+        writeNat(e2->attrs.size());
+        foreach (ExprAttrs::AttrDefs::iterator, i, e2->attrs) {
+            writeSymbol(i->first);
+            writeNat(i->second.inherited);
+            writeExpr(i->second.e);
+            writePos(i->second.pos);
+        }
+        writeNat(e2->dynamicAttrs.size());
+        foreach (ExprAttrs::DynamicAttrDefs::iterator, i, e2->dynamicAttrs) {
+            writeExpr(i->nameExpr);
+            writeExpr(i->valueExpr);
+            writePos(i->pos);
+        }
+    }
+
+    else if (ExprList * e2 = dynamic_cast<ExprList *>(e)) {
+        writeNat(tagList);
+        writeNat(e2->elems.size());
+        foreach (vector<Expr *>::iterator, i, e2->elems)
+            writeExpr(*i);
+    }
+
+    else if (ExprLambda * e2 = dynamic_cast<ExprLambda *>(e)) {
+        writeNat(tagLambda);
+        writePos(e2->pos);
+        writeSymbol(e2->name);
+        writeSymbol(e2->arg);
+        writeNat(e2->matchAttrs);
+        writeNat(e2->formals != 0);
+        if (e2->formals) {
+            writeNat(e2->formals->formals.size());
+            foreach (Formals::Formals_::iterator, i, e2->formals->formals) {
+                writeSymbol(i->name);
+                writeExpr(i->def);
+            }
+            writeNat(e2->formals->ellipsis);
+        }
+        writeExpr(e2->body);
+    }
+
+    else if (ExprLet * e2 = dynamic_cast<ExprLet *>(e)) {
+        writeNat(tagLet);
+        writeExpr(e2->attrs);
+        writeExpr(e2->body);
+    }
+
+    else if (ExprWith * e2 = dynamic_cast<ExprWith *>(e)) {
+        writeNat(tagWith);
+        writePos(e2->pos);
+        writeExpr(e2->attrs);
+        writeExpr(e2->body);
+    }
+
+    else if (ExprIf * e2 = dynamic_cast<ExprIf *>(e)) {
+        writeNat(tagIf);
+        writeExpr(e2->cond);
+        writeExpr(e2->then);
+        writeExpr(e2->else_);
+    }
+
+    else if (ExprAssert * e2 = dynamic_cast<ExprAssert *>(e)) {
+        writeNat(tagAssert);
+        writePos(e2->pos);
+        writeExpr(e2->cond);
+        writeExpr(e2->body);
+    }
+
+    else if (ExprOpNot * e2 = dynamic_cast<ExprOpNot *>(e)) {
+        writeNat(tagOpNot);
+        writeExpr(e2->e);
+    }
+
+    WRITE_BINOP(App)
+    WRITE_BINOP(OpEq)
+    WRITE_BINOP(OpNEq)
+    WRITE_BINOP(OpAnd)
+    WRITE_BINOP(OpOr)
+    WRITE_BINOP(OpImpl)
+    WRITE_BINOP(OpUpdate)
+    WRITE_BINOP(OpConcatLists)
+
+    else if (ExprConcatStrings * e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        writeNat(tagConcatStrings);
+        writePos(e2->pos);
+        writeNat(e2->forceString);
+        writeNat(e2->es->size());
+        foreach (vector<Expr *>::iterator, i, *e2->es)
+            writeExpr(*i);
+    }
+
+    else if (ExprPos * e2 = dynamic_cast<ExprPos *>(e)) {
+        writeNat(tagPos);
+        writePos(e2->pos);
+    }
+
+    else throw Error("cannot serialise unknown kind of expression");
+}
+
+
+struct ExprReader
+{
+    SymbolTable & symbolTable;
+    const string & s;
+    size_t pos;
+    vector<Symbol> symbols;
+    Symbol lastFile;
+    unsigned int lastLine;
+
+    ExprReader(SymbolTable & symbolTable, const string & s)
+        : symbolTable(symbolTable), s(s), pos(0), lastLine(0) { }
+
+    void corrupt()
+    {
+        throw Error("invalid serialised expression");
+    }
+
+    unsigned long long readNat()
+    {
+        unsigned long long n = 0;
+        for (unsigned int shift = 0; ; shift += 7) {
+            if (pos == s.size() || shift > 63) corrupt();
+            unsigned char c = s[pos++];
+            n |= (unsigned long long) (c & 0x7f) << shift;
+            if (!(c & 0x80)) return n;
+        }
+    }
+
+    string readString()
+    {
+        unsigned long long len = readNat();
+        if (len > s.size() - pos) corrupt();
+        string res(s, pos, len);
+        pos += len;
+        return res;
+    }
+
+    Symbol readSymbol()
+    {
+        unsigned long long n = readNat();
+        if (n == 0) return Symbol();
+        if (n <= symbols.size()) return symbols[n - 1];
+        if (n != symbols.size() + 1) corrupt();
+        symbols.push_back(symbolTable.create(readString()));
+        return symbols.back();
+    }
+
+    Pos readPos()
+    {
+        unsigned long long n = readNat();
+        if (n == 0) return noPos;
+        n--;
+        if (n & 1) lastFile = readSymbol();
+        lastLine += unZigZag(n >> 1);
+        unsigned int column = readNat();
+        return Pos(lastFile, lastLine, column);
+    }
+
+    ExprConcatStrings * readConcatStrings()
+    {
+        ExprConcatStrings * e = dynamic_cast<ExprConcatStrings *>(readExpr());
+        if (!e) corrupt();
+        return e;
+    }
+
+    AttrPath readAttrPath()
+    {
+        AttrPath attrPath;
+        unsigned long long n = readNat();
+        while (n--)
+            if (readNat())
+                attrPath.push_back(AttrName(readSymbol()));
+            else
+                attrPath.push_back(AttrName(readConcatStrings()));
+        return attrPath;
+    }
+
+    template<class T> Expr * readBinOp()
+    {
+        Pos pos = readPos();
+        Expr * e1 = readExpr();
+        Expr * e2 = readExpr();
+        return new T(pos, e1, e2);
+    }
+
+    Expr * readExpr();
+};
+
+
+Expr * ExprReader::readExpr()
+{
+    /* Note that the order in which function arguments are evaluated
+       is unspecified, so every field is read in a separate
+       statement. */
+    switch (readNat()) {
+
+        case tagNull:
+            return 0;
+
+        case tagInt: {
+            return new ExprInt(unZigZag(readNat()));
+        }
+
+        case tagString:
+            return new ExprString(readSymbol());
+
+        case tagPath:
+            return new ExprPath(readString());
+
+        case tagVar: {
+            Pos pos = readPos();
+            Symbol name = readSymbol();
+            return new ExprVar(pos, name);
+        }
+
+        case tagSelect: {
+            Pos pos = readPos();
+            Expr * e = readExpr();
+            AttrPath attrPath = readAttrPath();
+            Expr * def = readExpr();
+            return new ExprSelect(pos, e, attrPath, def);
+        }
+
+        case tagOpHasAttr: {
+            Expr * e = readExpr();
+            AttrPath attrPath = readAttrPath();
+            return new ExprOpHasAttr(e, attrPath);
+        }
+
+        case tagAttrs: {
+            ExprAttrs * e = new ExprAttrs;
+            e->recursive = readNat();
+            unsigned long long n = readNat();
+            while (n--) {
+                Symbol name = readSymbol();
+                bool inherited = readNat();
+                Expr * e2 = readExpr();
+                Pos pos = readPos();
+                e->attrs[name] = ExprAttrs::AttrDef(e2, pos, inherited);
+            }
+            n = readNat();
+            while (n--) {
+                ExprConcatStrings * nameExpr = readConcatStrings();
+                Expr * valueExpr = readExpr();
+                Pos pos = readPos();
+                e->dynamicAttrs.push_back(ExprAttrs::DynamicAttrDef(nameExpr, valueExpr, pos));
+            }
+            return e;
+        }
+
+        case tagList: {
+            ExprList * e = new ExprList;
+            unsigned long long n = readNat();
+            while (n--) e->elems.push_back(readExpr());
+            return e;
+        }
+
+        case tagLambda: {
+            Pos pos = readPos();
+            Symbol name = readSymbol();
+            Symbol arg = readSymbol();
+            bool matchAttrs = readNat();
+            Formals * formals = 0;
+            if (readNat()) {
+                formals = new Formals;
+                unsigned long long n = readNat();
+                while (n--) {
+                    Symbol name = readSymbol();
+                    Expr * def = readExpr();
+                    formals->formals.push_back(Formal(name, def));
+                    formals->argNames.insert(name);
+                }
+                formals->ellipsis = readNat();
+            }
+            Expr * body = readExpr();
+            ExprLambda * e = new ExprLambda(pos, arg, matchAttrs, formals, body);
+            if (name.set()) e->setName(name);
+            return e;
+        }
+
+        case tagLet: {
+            ExprAttrs * attrs = dynamic_cast<ExprAttrs *>(readExpr());
+            if (!attrs) corrupt();
+            Expr * body = readExpr();
+            return new ExprLet(attrs, body);
+        }
+
+        case tagWith: {
+            Pos pos = readPos();
+            Expr * attrs = readExpr();
+            Expr * body = readExpr();
+            return new ExprWith(pos, attrs, body);
+        }
+
+        case tagIf: {
+            Expr * cond = readExpr();
+            Expr * then = readExpr();
+            Expr * else_ = readExpr();
+            return new ExprIf(cond, then, else_);
+        }
+
+        case tagAssert: {
+            Pos pos = readPos();
+            Expr * cond = readExpr();
+            Expr * body = readExpr();
+            return new ExprAssert(pos, cond, body);
+        }
+
+        case tagOpNot:
+            return new ExprOpNot(readExpr());
+
+        case tagApp: return readBinOp<ExprApp>();
+        case tagOpEq: return readBinOp<ExprOpEq>();
+        case tagOpNEq: return readBinOp<ExprOpNEq>();
+        case tagOpAnd: return readBinOp<ExprOpAnd>();
+        case tagOpOr: return readBinOp<ExprOpOr>();
+        case tagOpImpl: return readBinOp<ExprOpImpl>();
+        case tagOpUpdate: return readBinOp<ExprOpUpdate>();
+        case tagOpConcatLists: return readBinOp<ExprOpConcatLists>();
+
+        case tagConcatStrings: {
+            Pos pos = readPos();
+            bool forceString = readNat();
+            vector<Expr *> * es = new vector<Expr *>;
+            unsigned long long n = readNat();
+            while (n--) es->push_back(readExpr());
+            return new ExprConcatStrings(pos, forceString, es);
+        }
+
+        case tagPos:
+            return new ExprPos(readPos());
+
+        default:
+            corrupt();
+            abort();
+    }
+}
+
+
+string serialiseExpr(Expr * e)
+{
+    ExprWriter writer;
+    writer.writeExpr(e);
+    return writer.s;
+}
+
+
+Expr * deserialiseExpr(SymbolTable & symbols, const string & s)
+{
+    ExprReader reader(symbols, s);
+    Expr * e = reader.readExpr();
+    if (!e || reader.pos != s.size()) reader.corrupt();
+    return e;
+}
+
+
+/* Entries are touched when they're used, but at most this often, so
+   that their modification time tells how long ago they were used. */
+static const time_t touchInterval = 24 * 3600;
+
+
+static Path getCacheDir()
+{
+    return settings.nixStateDir + "/parse-cache";
+}
+
+
+/* The cache is content-addressed: the name of a cache entry is
+   determined by the path (which ends up in positions and path
+   literals) and the contents of the file.  So every change to a file
+   adds a new entry, and entries that aren't used anymore are removed
+   by pruneParseCache(). */
+static Path getCacheFile(const Path & path, const Hash & hash)
+{
+    string key = (format("%1% %2% %3% %4%")
+        % parseCacheVersion % nixVersion % printHash(hash) % path).str();
+    return getCacheDir() + "/" + printHash32(hashString(htSHA256, key));
+}
+
+
+/* Remove the entries that haven't been used for `parse-cache-max-age'
+   seconds.  This is done at most once per `touchInterval', as
+   recorded by the modification time of a stamp file. */
+static void pruneParseCache()
+{
+    Path cacheDir = getCacheDir();
+    Path stampFile = cacheDir + "/.pruned";
+    time_t now = time(0);
+
+    struct stat st;
+    if (lstat(stampFile.c_str(), &st) == 0 && st.st_mtime > now - touchInterval) return;
+    writeFile(stampFile, "");
+
+    printMsg(lvlDebug, "pruning the parse cache");
+
+    Strings names = readDirectory(cacheDir);
+    foreach (Strings::iterator, i, names) {
+        if ((*i)[0] == '.') continue;
+        Path entry = cacheDir + "/" + *i;
+        if (lstat(entry.c_str(), &st) == -1) continue;
+        if (st.st_mtime > now - settings.parseCacheMaxAge) continue;
+        printMsg(lvlDebug, format("removing unused parse cache entry `%1%'") % entry);
+        if (unlink(entry.c_str()) == -1 && errno != ENOENT)
+            throw SysError(format("removing `%1%'") % entry);
+    }
+}
+
+
+Expr * queryParseCache(SymbolTable & symbols, const Path & path, const Hash & hash)
+{
+    Path cacheFile = getCacheFile(path, hash);
+    struct stat st;
+    if (lstat(cacheFile.c_str(), &st) == -1) return 0;
+
+    printMsg(lvlDebug, format("using parse cache entry `%1%' for `%2%'") % cacheFile % path);
+
+    /* Record that the entry is still in use.  This may fail if the
+       cache is shared and not writable, which is fine. */
+    if (st.st_mtime < time(0) - touchInterval)
+        utime(cacheFile.c_str(), 0);
+
+    try {
+        return deserialiseExpr(symbols, readFile(cacheFile));
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: ignoring corrupt parse cache entry `%1%' for `%2%': %3%")
+            % cacheFile % path % e.msg());
+        return 0;
+    }
+}
+
+
+void writeParseCache(const Path & path, const Hash & hash, Expr * e)
+{
+    Path cacheFile = getCacheFile(path, hash);
+    Path tmpFile = (format("%1%.tmp-%2%") % cacheFile % getpid()).str();
+    try {
+        createDirs(dirOf(cacheFile));
+        writeFile(tmpFile, serialiseExpr(e));
+        if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+            throw SysError(format("renaming `%1%' to `%2%'") % tmpFile % cacheFile);
+    } catch (SysError & e) {
+        printMsg(lvlDebug, format("cannot write parse cache entry: %1%") % e.msg());
+        unlink(tmpFile.c_str());
+        return;
+    }
+
+    try {
+        pruneParseCache();
+    } catch (SysError & e) {
+        printMsg(lvlDebug, format("cannot prune the parse cache: %1%") % e.msg());
+    }
+}
+
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "nixexpr.hh"
+#include "hash.hh"
+
+
+namespace nix {
+
+
+/* Return a compact binary representation of the expression `e'.
+   Symbols are stored only once, and variables must not have been
+   bound by bindVars() yet, since that depends on the static
+   environment. */
+string serialiseExpr(Expr * e);
+
+/* The inverse of serialiseExpr().  Throws an Error if `s' is not a
+   valid serialisation. */
+Expr * deserialiseExpr(SymbolTable & symbols, const string & s);
+
+/* Return the parsed (unbound) form of the file `path' with contents
+   hash `hash' from the parse cache, or 0 if it's not in the cache. */
+Expr * queryParseCache(SymbolTable & symbols, const Path & path, const Hash & hash);
+
+/* Add the parsed form of the file `path' to the parse cache.  Failure
+   to write to the cache is not an error. */
+void writeParseCache(const Path & path, const Hash & hash, Expr * e);
+
+
+}
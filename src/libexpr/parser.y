@@ -252,7 +252,7 @@ void yyerror(YYLTYPE * loc, yyscan_t scanner, ParseData * data, const char * err
   nix::Formals * formals;
   nix::Formal * formal;
   nix::NixInt n;
-  const char * id; // !!! -> Symbol
+  const char * id; // string in the symbol table
   char * path;
   char * uri;
   std::vector<nix::AttrName> * attrNames;
@@ -535,13 +535,15 @@ formal
 #include <unistd.h>
 
 #include <eval.hh>
+#include <parse-cache.hh>
+#include <globals.hh>
 
 
 namespace nix {
 
 
 Expr * EvalState::parse(const char * text,
-    const Path & path, const Path & basePath, StaticEnv & staticEnv)
+    const Path & path, const Path & basePath)
 {
     yyscan_t scanner;
     ParseData data(*this);
@@ -555,12 +557,19 @@ Expr * EvalState::parse(const char * text,
 
     if (res) throw ParseError(data.error);
 
-    data.result->bindVars(staticEnv);
-
     return data.result;
 }
 
 
+Expr * EvalState::parse(const char * text,
+    const Path & path, const Path & basePath, StaticEnv & staticEnv)
+{
+    Expr * e = parse(text, path, basePath);
+    e->bindVars(staticEnv);
+    return e;
+}
+
+
 Path resolveExprPath(Path path)
 {
     assert(path[0] == '/');
@@ -591,7 +600,24 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), path, dirOf(path), staticEnv);
+    string s = readFile(path);
+
+    Hash hash;
+    if (trackInputs || settings.parseCache) hash = hashString(htSHA256, s);
+    if (trackInputs) recordInput("file:" + path, printHash(hash));
+
+    if (!settings.parseCache)
+        return parse(s.c_str(), path, dirOf(path), staticEnv);
+
+    /* The cache holds expressions whose variables haven't been bound
+       yet, since that depends on `staticEnv'. */
+    Expr * e = queryParseCache(symbols, path, hash);
+    if (!e) {
+        e = parse(s.c_str(), path, dirOf(path));
+        writeParseCache(path, hash, e);
+    }
+    e->bindVars(staticEnv);
+    return e;
 }
 
 
@@ -647,7 +673,9 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path)
             res = i->second +
                 (path.size() == i->first.size() ? "" : "/" + string(path, i->first.size()));
         }
-        if (pathExists(res)) return canonPath(res);
+        bool exists = pathExists(res);
+        if (trackInputs) recordInput("exists:" + res, exists ? "1" : "0");
+        if (exists) return canonPath(res);
     }
     throw ThrownError(format("file `%1%' was not found in the Nix search path (add it using $NIX_PATH or -I)") % path);
 }
@@ -98,7 +98,7 @@ static void prim_scopedImport(EvalState & state, const Pos & pos, Value * * args
         foreach (DerivationOutputs::iterator, i, drv.outputs) {
             mkString(*state.allocAttr(w, state.symbols.create(i->first)),
                 i->second.path, singleton<PathSet>("!" + i->first + "!" + path));
-            mkString(*(outputsVal->list.elems[outputs_index++] = state.allocValue()),
+            mkString(*(outputsVal->listElems()[outputs_index++] = state.allocValue()),
                 i->first);
         }
         w.attrs->sort();
@@ -184,7 +184,9 @@ static void prim_typeOf(EvalState & state, const Pos & pos, Value * * args, Valu
         case tPath: t = "path"; break;
         case tNull: t = "null"; break;
         case tAttrs: t = "set"; break;
-        case tList: t = "list"; break;
+        case tList1:
+        case tList2:
+        case tListN: t = "list"; break;
         case tLambda:
         case tPrimOp:
         case tPrimOpApp:
@@ -238,7 +240,7 @@ static void prim_isBool(EvalState & state, const Pos & pos, Value * * args, Valu
 
 struct CompareValues
 {
-    bool operator () (const Value * v1, const Value * v2) const
+    bool operator () (Value * v1, Value * v2) const
     {
         if (v1->type != v2->type)
             throw EvalError("cannot compare values of different types");
@@ -246,6 +248,8 @@ struct CompareValues
             case tInt:
                 return v1->integer < v2->integer;
             case tString:
+                flattenString(*v1);
+                flattenString(*v2);
                 return strcmp(v1->string.s, v2->string.s) < 0;
             case tPath:
                 return strcmp(v1->path, v2->path) < 0;
@@ -270,20 +274,20 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     state.forceAttrs(*args[0], pos);
 
     /* Get the start set. */
-    Bindings::iterator startSet =
+    Attr * startSet =
         args[0]->attrs->find(state.symbols.create("startSet"));
-    if (startSet == args[0]->attrs->end())
+    if (!startSet)
         throw EvalError(format("attribute `startSet' required, at %1%") % pos);
     state.forceList(*startSet->value, pos);
 
     ValueList workSet;
-    for (unsigned int n = 0; n < startSet->value->list.length; ++n)
-        workSet.push_back(startSet->value->list.elems[n]);
+    for (unsigned int n = 0; n < startSet->value->listSize(); ++n)
+        workSet.push_back(startSet->value->listElems()[n]);
 
     /* Get the operator. */
-    Bindings::iterator op =
+    Attr * op =
         args[0]->attrs->find(state.symbols.create("operator"));
-    if (op == args[0]->attrs->end())
+    if (!op)
         throw EvalError(format("attribute `operator' required, at %1%") % pos);
     state.forceValue(*op->value);
 
@@ -300,9 +304,9 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
 
         state.forceAttrs(*e, pos);
 
-        Bindings::iterator key =
+        Attr * key =
             e->attrs->find(state.symbols.create("key"));
-        if (key == e->attrs->end())
+        if (!key)
             throw EvalError(format("attribute `key' required, at %1%") % pos);
         state.forceValue(*key->value);
 
@@ -316,9 +320,9 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
         state.forceList(call, pos);
 
         /* Add the values returned by the operator to the work set. */
-        for (unsigned int n = 0; n < call.list.length; ++n) {
-            state.forceValue(*call.list.elems[n]);
-            workSet.push_back(call.list.elems[n]);
+        for (unsigned int n = 0; n < call.listSize(); ++n) {
+            state.forceValue(*call.listElems()[n]);
+            workSet.push_back(call.listElems()[n]);
         }
     }
 
@@ -326,7 +330,7 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     state.mkList(v, res.size());
     unsigned int n = 0;
     foreach (ValueList::iterator, i, res)
-        v.list.elems[n++] = *i;
+        v.listElems()[n++] = *i;
 }
 
 
@@ -379,7 +383,9 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_getEnv(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0], pos);
-    mkString(v, getEnv(name));
+    string value = getEnv(name);
+    if (state.trackInputs) state.recordInput("env:" + name, value);
+    mkString(v, value);
 }
 
 
@@ -388,9 +394,10 @@ static void prim_getEnv(EvalState & state, const Pos & pos, Value * * args, Valu
 static void prim_trace(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    if (args[0]->type == tString)
+    if (args[0]->type == tString) {
+        flattenString(*args[0]);
         printMsg(lvlError, format("trace: %1%") % args[0]->string.s);
-    else
+    } else
         printMsg(lvlError, format("trace: %1%") % *args[0]);
     state.forceValue(*args[1]);
     v = *args[1];
@@ -416,8 +423,8 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     state.forceAttrs(*args[0], pos);
 
     /* Figure out the name first (for stack backtraces). */
-    Bindings::iterator attr = args[0]->attrs->find(state.sName);
-    if (attr == args[0]->attrs->end())
+    Attr * attr = args[0]->attrs->find(state.sName);
+    if (!attr)
         throw EvalError(format("required attribute `name' missing, at %1%") % pos);
     string drvName;
     Pos & posDrvName(*attr->pos);
@@ -431,7 +438,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     /* Check whether null attributes should be ignored. */
     bool ignoreNulls = false;
     attr = args[0]->attrs->find(state.sIgnoreNulls);
-    if (attr != args[0]->attrs->end())
+    if (attr)
         ignoreNulls = state.forceBool(*attr->value);
 
     /* Build the derivation expression by processing the attributes. */
@@ -461,8 +468,8 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
                command-line arguments to the builder. */
             if (key == "args") {
                 state.forceList(*i->value, pos);
-                for (unsigned int n = 0; n < i->value->list.length; ++n) {
-                    string s = state.coerceToString(posDrvName, *i->value->list.elems[n], context, true);
+                for (unsigned int n = 0; n < i->value->listSize(); ++n) {
+                    string s = state.coerceToString(posDrvName, *i->value->listElems()[n], context, true);
                     drv.args.push_back(s);
                 }
             }
@@ -661,6 +668,7 @@ static void prim_storePath(EvalState & state, const Pos & pos, Value * * args, V
     if (!isInStore(path))
         throw EvalError(format("path `%1%' is not in the Nix store, at %2%") % path % pos);
     Path path2 = toStorePath(path);
+    if (state.trackInputs) state.recordInput("valid:" + path2);
     if (!settings.readOnlyMode)
         store->ensurePath(path2);
     context.insert(path2);
@@ -668,13 +676,24 @@ static void prim_storePath(EvalState & state, const Pos & pos, Value * * args, V
 }
 
 
+/* Return the time at which evaluation started, which is passed as
+   the argument, and mark the evaluation as impure. */
+static void prim_currentTime(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.impure = true;
+    v = *args[0];
+}
+
+
 static void prim_pathExists(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     PathSet context;
     Path path = state.coerceToPath(pos, *args[0], context);
     if (!context.empty())
         throw EvalError(format("string `%1%' cannot refer to other paths, at %2%") % path % pos);
-    mkBool(v, pathExists(path));
+    bool exists = pathExists(path);
+    if (state.trackInputs) state.recordInput("exists:" + path, exists ? "1" : "0");
+    mkBool(v, exists);
 }
 
 
@@ -705,7 +724,9 @@ static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Va
     Path path = state.coerceToPath(pos, *args[0], context);
     if (!context.empty())
         throw EvalError(format("string `%1%' cannot refer to other paths, at %2%") % path % pos);
-    mkString(v, readFile(path).c_str());
+    string s = readFile(path);
+    if (state.trackInputs) state.recordInput("file:" + path, printHash(hashString(htSHA256, s)));
+    mkString(v, s.c_str());
 }
 
 
@@ -718,17 +739,17 @@ static void prim_findFile(EvalState & state, const Pos & pos, Value * * args, Va
     SearchPath searchPath;
 
     PathSet context;
-    for (unsigned int n = 0; n < args[0]->list.length; ++n) {
-        Value & v2(*args[0]->list.elems[n]);
+    for (unsigned int n = 0; n < args[0]->listSize(); ++n) {
+        Value & v2(*args[0]->listElems()[n]);
         state.forceAttrs(v2, pos);
 
         string prefix;
-        Bindings::iterator i = v2.attrs->find(state.symbols.create("prefix"));
-        if (i != v2.attrs->end())
+        Attr * i = v2.attrs->find(state.symbols.create("prefix"));
+        if (i)
             prefix = state.forceStringNoCtx(*i->value, pos);
 
         i = v2.attrs->find(state.symbols.create("path"));
-        if (i == v2.attrs->end())
+        if (!i)
             throw EvalError(format("attribute `path' missing, at %1%") % pos);
         string path = state.coerceToPath(pos, *i->value, context);
 
@@ -871,6 +892,10 @@ static void prim_filterSource(EvalState & state, const Pos & pos, Value * * args
         ? computeStorePathForPath(path, true, htSHA256, filter).first
         : store->addToStore(path, true, htSHA256, filter, state.repair);
 
+    /* The result depends on the filter function, so record the
+       unfiltered tree. */
+    if (state.trackInputs) state.recordInput("tree:" + path);
+
     mkString(v, dstPath, singleton<PathSet>(dstPath));
 }
 
@@ -894,7 +919,7 @@ static void prim_attrNames(EvalState & state, const Pos & pos, Value * * args, V
 
     unsigned int n = 0;
     foreach (StringSet::iterator, i, names)
-        mkString(*(v.list.elems[n++] = state.allocValue()), *i);
+        mkString(*(v.listElems()[n++] = state.allocValue()), *i);
 }
 
 
@@ -904,8 +929,8 @@ void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
     // !!! Should we create a symbol here or just do a lookup?
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    Attr * i = args[1]->attrs->find(state.symbols.create(attr));
+    if (!i)
         throw EvalError(format("attribute `%1%' missing, at %2%") % attr % pos);
     // !!! add to stack trace?
     if (state.countCalls && i->pos) state.attrSelects[*i->pos]++;
@@ -919,8 +944,8 @@ void prim_unsafeGetAttrPos(EvalState & state, const Pos & pos, Value * * args, V
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    Attr * i = args[1]->attrs->find(state.symbols.create(attr));
+    if (!i)
         mkNull(v);
     else
         state.mkPos(v, i->pos);
@@ -932,7 +957,7 @@ static void prim_hasAttr(EvalState & state, const Pos & pos, Value * * args, Val
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    mkBool(v, args[1]->attrs->find(state.symbols.create(attr)) != args[1]->attrs->end());
+    mkBool(v, args[1]->attrs->find(state.symbols.create(attr)) != 0);
 }
 
 
@@ -951,9 +976,9 @@ static void prim_removeAttrs(EvalState & state, const Pos & pos, Value * * args,
 
     /* Get the attribute names to be removed. */
     std::set<Symbol> names;
-    for (unsigned int i = 0; i < args[1]->list.length; ++i) {
-        state.forceStringNoCtx(*args[1]->list.elems[i], pos);
-        names.insert(state.symbols.create(args[1]->list.elems[i]->string.s));
+    for (unsigned int i = 0; i < args[1]->listSize(); ++i) {
+        state.forceStringNoCtx(*args[1]->listElems()[i], pos);
+        names.insert(state.symbols.create(args[1]->listElems()[i]->string.s));
     }
 
     /* Copy all attributes not in that set.  Note that we don't need
@@ -976,23 +1001,23 @@ static void prim_listToAttrs(EvalState & state, const Pos & pos, Value * * args,
 {
     state.forceList(*args[0], pos);
 
-    state.mkAttrs(v, args[0]->list.length);
+    state.mkAttrs(v, args[0]->listSize());
 
     std::set<Symbol> seen;
 
-    for (unsigned int i = 0; i < args[0]->list.length; ++i) {
-        Value & v2(*args[0]->list.elems[i]);
+    for (unsigned int i = 0; i < args[0]->listSize(); ++i) {
+        Value & v2(*args[0]->listElems()[i]);
         state.forceAttrs(v2, pos);
 
-        Bindings::iterator j = v2.attrs->find(state.sName);
-        if (j == v2.attrs->end())
+        Attr * j = v2.attrs->find(state.sName);
+        if (!j)
             throw TypeError(format("`name' attribute missing in a call to `listToAttrs', at %1%") % pos);
         string name = state.forceStringNoCtx(*j->value, pos);
 
         Symbol sym = state.symbols.create(name);
         if (seen.find(sym) == seen.end()) {
-            Bindings::iterator j2 = v2.attrs->find(state.symbols.create(state.sValue));
-            if (j2 == v2.attrs->end())
+            Attr * j2 = v2.attrs->find(state.symbols.create(state.sValue));
+            if (!j2)
                 throw TypeError(format("`value' attribute missing in a call to `listToAttrs', at %1%") % pos);
 
             v.attrs->push_back(Attr(sym, j2->value, j2->pos));
@@ -1015,8 +1040,8 @@ static void prim_intersectAttrs(EvalState & state, const Pos & pos, Value * * ar
     state.mkAttrs(v, std::min(args[0]->attrs->size(), args[1]->attrs->size()));
 
     foreach (Bindings::iterator, i, *args[0]->attrs) {
-        Bindings::iterator j = args[1]->attrs->find(i->name);
-        if (j != args[1]->attrs->end())
+        Attr * j = args[1]->attrs->find(i->name);
+        if (j)
             v.attrs->push_back(*j);
     }
 }
@@ -1063,17 +1088,17 @@ static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args
 static void prim_isList(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tList);
+    mkBool(v, args[0]->isList());
 }
 
 
 static void elemAt(EvalState & state, const Pos & pos, Value & list, int n, Value & v)
 {
     state.forceList(list, pos);
-    if (n < 0 || (unsigned int) n >= list.list.length)
+    if (n < 0 || (unsigned int) n >= list.listSize())
         throw Error(format("list index %1% is out of bounds, at %2%") % n % pos);
-    state.forceValue(*list.list.elems[n]);
-    v = *list.list.elems[n];
+    state.forceValue(*list.listElems()[n]);
+    v = *list.listElems()[n];
 }
 
 
@@ -1097,11 +1122,11 @@ static void prim_head(EvalState & state, const Pos & pos, Value * * args, Value
 static void prim_tail(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
-    if (args[0]->list.length == 0)
+    if (args[0]->listSize() == 0)
         throw Error(format("`tail' called on an empty list, at %1%") % pos);
-    state.mkList(v, args[0]->list.length - 1);
-    for (unsigned int n = 0; n < v.list.length; ++n)
-        v.list.elems[n] = args[0]->list.elems[n + 1];
+    state.mkList(v, args[0]->listSize() - 1);
+    for (unsigned int n = 0; n < v.listSize(); ++n)
+        v.listElems()[n] = args[0]->listElems()[n + 1];
 }
 
 
@@ -1111,11 +1136,11 @@ static void prim_map(EvalState & state, const Pos & pos, Value * * args, Value &
     state.forceFunction(*args[0], pos);
     state.forceList(*args[1], pos);
 
-    state.mkList(v, args[1]->list.length);
+    state.mkList(v, args[1]->listSize());
 
-    for (unsigned int n = 0; n < v.list.length; ++n)
-        mkApp(*(v.list.elems[n] = state.allocValue()),
-            *args[0], *args[1]->list.elems[n]);
+    for (unsigned int n = 0; n < v.listSize(); ++n)
+        mkApp(*(v.listElems()[n] = state.allocValue()),
+            *args[0], *args[1]->listElems()[n]);
 }
 
 
@@ -1128,15 +1153,15 @@ static void prim_filter(EvalState & state, const Pos & pos, Value * * args, Valu
     state.forceList(*args[1], pos);
 
     // FIXME: putting this on the stack is risky.
-    Value * vs[args[1]->list.length];
+    Value * vs[args[1]->listSize()];
     unsigned int k = 0;
 
     bool same = true;
-    for (unsigned int n = 0; n < args[1]->list.length; ++n) {
+    for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
         Value res;
-        state.callFunction(*args[0], *args[1]->list.elems[n], res, noPos);
+        state.callFunction(*args[0], *args[1]->listElems()[n], res, noPos);
         if (state.forceBool(res))
-            vs[k++] = args[1]->list.elems[n];
+            vs[k++] = args[1]->listElems()[n];
         else
             same = false;
     }
@@ -1145,7 +1170,7 @@ static void prim_filter(EvalState & state, const Pos & pos, Value * * args, Valu
         v = *args[1];
     else {
         state.mkList(v, k);
-        for (unsigned int n = 0; n < k; ++n) v.list.elems[n] = vs[n];
+        for (unsigned int n = 0; n < k; ++n) v.listElems()[n] = vs[n];
     }
 }
 
@@ -1155,8 +1180,8 @@ static void prim_elem(EvalState & state, const Pos & pos, Value * * args, Value
 {
     bool res = false;
     state.forceList(*args[1], pos);
-    for (unsigned int n = 0; n < args[1]->list.length; ++n)
-        if (state.eqValues(*args[0], *args[1]->list.elems[n])) {
+    for (unsigned int n = 0; n < args[1]->listSize(); ++n)
+        if (state.eqValues(*args[0], *args[1]->listElems()[n])) {
             res = true;
             break;
         }
@@ -1168,7 +1193,7 @@ static void prim_elem(EvalState & state, const Pos & pos, Value * * args, Value
 static void prim_concatLists(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
-    state.concatLists(v, args[0]->list.length, args[0]->list.elems, pos);
+    state.concatLists(v, args[0]->listSize(), args[0]->listElems(), pos);
 }
 
 
@@ -1176,7 +1201,7 @@ static void prim_concatLists(EvalState & state, const Pos & pos, Value * * args,
 static void prim_length(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos);
-    mkInt(v, args[0]->list.length);
+    mkInt(v, args[0]->listSize());
 }
 
 
@@ -1355,7 +1380,14 @@ void EvalState::createBaseEnv()
     mkNull(v);
     addConstant("null", v);
 
-    mkInt(v, time(0));
+    /* `currentTime' is a thunk, so that using it can be recorded by
+       prim_currentTime(). */
+    Value * vTimeFun = allocValue();
+    vTimeFun->type = tPrimOp;
+    vTimeFun->primOp = new PrimOp(prim_currentTime, 1, symbols.create("currentTime"));
+    Value * vTime = allocValue();
+    mkInt(*vTime, time(0));
+    mkApp(v, *vTimeFun, *vTime);
     addConstant("__currentTime", v);
 
     mkString(v, settings.thisSystem.c_str());
@@ -1466,7 +1498,7 @@ void EvalState::createBaseEnv()
     mkList(v, searchPath.size());
     int n = 0;
     for (auto & i : searchPath) {
-        v2 = v.list.elems[n++] = allocValue();
+        v2 = v.listElems()[n++] = allocValue();
         mkAttrs(*v2, 2);
         mkString(*allocAttr(*v2, symbols.create("path")), i.second);
         mkString(*allocAttr(*v2, symbols.create("prefix")), i.first);
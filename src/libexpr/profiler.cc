@@ -0,0 +1,225 @@
+#include "profiler.hh"
+#include "eval.hh"
+#include "value-to-json.hh"
+#include "util.hh"
+
+#include <fstream>
+#include <algorithm>
+
+
+namespace nix {
+
+
+EvalCosts & EvalCosts::operator += (const EvalCosts & c)
+{
+    time += c.time;
+    values += c.values;
+    envs += c.envs;
+    listElems += c.listElems;
+    bytes += c.bytes;
+    return *this;
+}
+
+
+EvalCosts & EvalCosts::operator -= (const EvalCosts & c)
+{
+    time -= c.time;
+    values -= c.values;
+    envs -= c.envs;
+    listElems -= c.listElems;
+    bytes -= c.bytes;
+    return *this;
+}
+
+
+EvalProfiler::Node::~Node()
+{
+    foreach (Node::Children::iterator, i, children)
+        delete i->second;
+}
+
+
+void EvalProfiler::enter(const void * fun)
+{
+    Node * & child(current->children[fun]);
+    if (!child) child = new Node(current, fun);
+    current = child;
+    current->calls++;
+}
+
+
+void EvalProfiler::enter(ExprLambda & lambda)
+{
+    enter((const void *) &lambda);
+    if (current->calls == 1 && functions.find(&lambda) == functions.end()) {
+        Function & f(functions[&lambda]);
+        f.name = (format("%1% at %2%")
+            % (lambda.name.set() ? (string) lambda.name : "anonymous function") % lambda.pos).str();
+        f.file = lambda.pos.file.set() ? (string) lambda.pos.file : "(unknown)";
+    }
+}
+
+
+void EvalProfiler::enter(PrimOp & primOp)
+{
+    enter((const void *) &primOp);
+    if (current->calls == 1 && functions.find(&primOp) == functions.end()) {
+        Function & f(functions[&primOp]);
+        f.name = "primop " + (string) primOp.name;
+        f.file = "(primops)";
+    }
+}
+
+
+void EvalProfiler::leave(const EvalCosts & costs)
+{
+    assert(current != &root);
+    current->costs += costs;
+    current = current->parent;
+}
+
+
+/* Directly recursive calls are shown as a single frame, since
+   otherwise the size of the output would be quadratic in the depth of
+   the recursion. */
+void EvalProfiler::getStacks(Stacks & stacks, const Node & node, const string & stack)
+{
+    EvalCosts own = node.costs;
+    foreach (Node::Children::const_iterator, i, node.children) {
+        own -= i->second->costs;
+        if (i->second->fun == node.fun) {
+            getStacks(stacks, *i->second, stack);
+            continue;
+        }
+        string name = functions[i->second->fun].name;
+        std::replace(name.begin(), name.end(), ';', ',');
+        getStacks(stacks, *i->second, stack.empty() ? name : stack + ";" + name);
+    }
+    if (&node != &root) stacks[stack] += own.time;
+}
+
+
+struct FunctionCosts
+{
+    string name, file;
+    unsigned long calls;
+    EvalCosts own, total;
+    FunctionCosts() : calls(0) { }
+};
+
+
+static bool byOwnTime(const FunctionCosts & a, const FunctionCosts & b)
+{
+    return a.own.time > b.own.time;
+}
+
+
+static void writeCosts(std::ostream & str, const EvalCosts & costs)
+{
+    JSONObject res(str);
+    res.attr("time"); str << costs.time;
+    res.attr("values"); str << costs.values;
+    res.attr("envs"); str << costs.envs;
+    res.attr("listElems"); str << costs.listElems;
+    res.attr("bytes"); str << costs.bytes;
+}
+
+
+void EvalProfiler::write(const Path & path)
+{
+    /* Write the call stacks. */
+    {
+        Stacks stacks;
+        getStacks(stacks, root, "");
+        std::ofstream str(path.c_str());
+        foreach (Stacks::iterator, i, stacks)
+            if (i->second) str << i->first << " " << i->second << std::endl;
+        if (!str) throw SysError(format("writing profile `%1%'") % path);
+    }
+
+    /* Compute the costs per function and per file by walking the
+       tree.  The total costs of recursive calls are only counted
+       once, for the outermost call. */
+    typedef std::map<const void *, FunctionCosts> FunctionCostsMap;
+    FunctionCostsMap funCosts;
+    std::map<const void *, unsigned int> active;
+    std::vector<std::pair<const Node *, bool> > todo;
+    foreach (Node::Children::const_iterator, i, root.children)
+        todo.push_back(std::pair<const Node *, bool>(i->second, true));
+    while (!todo.empty()) {
+        const Node * node = todo.back().first;
+        bool entering = todo.back().second;
+        todo.pop_back();
+        if (!entering) {
+            active[node->fun]--;
+            continue;
+        }
+        FunctionCosts & c(funCosts[node->fun]);
+        c.calls += node->calls;
+        if (!active[node->fun]) c.total += node->costs;
+        EvalCosts own = node->costs;
+        foreach (Node::Children::const_iterator, i, node->children)
+            own -= i->second->costs;
+        c.own += own;
+        active[node->fun]++;
+        todo.push_back(std::pair<const Node *, bool>(node, false));
+        foreach (Node::Children::const_iterator, i, node->children)
+            todo.push_back(std::pair<const Node *, bool>(i->second, true));
+    }
+
+    std::vector<FunctionCosts> funs;
+    typedef std::map<string, FunctionCosts> FileCostsMap;
+    FileCostsMap files;
+    foreach (FunctionCostsMap::iterator, i, funCosts) {
+        Function & f(functions[i->first]);
+        i->second.name = f.name;
+        i->second.file = f.file;
+        funs.push_back(i->second);
+        FunctionCosts & c(files[f.file]);
+        c.file = f.file;
+        c.calls += i->second.calls;
+        c.own += i->second.own;
+    }
+    std::sort(funs.begin(), funs.end(), byOwnTime);
+    std::vector<FunctionCosts> files2;
+    foreach (FileCostsMap::iterator, i, files)
+        files2.push_back(i->second);
+    std::sort(files2.begin(), files2.end(), byOwnTime);
+
+    Path jsonPath = path + ".json";
+    std::ofstream str(jsonPath.c_str());
+    {
+        JSONObject top(str);
+
+        top.attr("functions");
+        {
+            JSONList list(str);
+            foreach (std::vector<FunctionCosts>::iterator, i, funs) {
+                list.elem();
+                JSONObject fun(str);
+                fun.attr("name", i->name);
+                fun.attr("file", i->file);
+                fun.attr("calls"); str << i->calls;
+                fun.attr("self"); writeCosts(str, i->own);
+                fun.attr("total"); writeCosts(str, i->total);
+            }
+        }
+
+        top.attr("files");
+        {
+            JSONList list(str);
+            foreach (std::vector<FunctionCosts>::iterator, i, files2) {
+                list.elem();
+                JSONObject file(str);
+                file.attr("file", i->file);
+                file.attr("calls"); str << i->calls;
+                file.attr("self"); writeCosts(str, i->own);
+            }
+        }
+    }
+    str << std::endl;
+    if (!str) throw SysError(format("writing profile `%1%'") % jsonPath);
+}
+
+
+}
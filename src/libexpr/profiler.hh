@@ -0,0 +1,89 @@
+#pragma once
+
+#include "nixexpr.hh"
+
+#include <map>
+
+
+namespace nix {
+
+
+struct PrimOp;
+
+
+/* The resources used by (part of) an evaluation. */
+struct EvalCosts
+{
+    unsigned long long time; // wall time in microseconds
+    unsigned long values;
+    unsigned long envs;
+    unsigned long listElems;
+    unsigned long long bytes;
+
+    EvalCosts() : time(0), values(0), envs(0), listElems(0), bytes(0) { }
+
+    EvalCosts & operator += (const EvalCosts & c);
+    EvalCosts & operator -= (const EvalCosts & c);
+};
+
+
+/* The evaluation profiler records the costs of every distinct stack
+   of function and primop calls.  Note that because evaluation is
+   lazy, the cost of forcing a thunk is attributed to the function
+   that forced it, not the one that created it. */
+class EvalProfiler
+{
+private:
+
+    /* A function (lambda or primop) that has been called. */
+    struct Function
+    {
+        string name;
+        string file;
+    };
+
+    std::map<const void *, Function> functions;
+
+    /* A node in the tree of call stacks.  `costs' includes the costs
+       of the children. */
+    struct Node
+    {
+        Node * parent;
+        const void * fun;
+        unsigned long calls;
+        EvalCosts costs;
+        typedef std::map<const void *, Node *> Children;
+        Children children;
+        Node(Node * parent, const void * fun) : parent(parent), fun(fun), calls(0) { }
+        ~Node();
+    };
+
+    Node root;
+    Node * current;
+
+    void enter(const void * fun);
+
+    /* The own time of every distinct call stack. */
+    typedef std::map<string, unsigned long long> Stacks;
+
+    void getStacks(Stacks & stacks, const Node & node, const string & stack);
+
+public:
+
+    EvalProfiler() : root(0, 0), current(&root) { }
+
+    void enter(ExprLambda & lambda);
+    void enter(PrimOp & primOp);
+
+    /* Leave the current function, which used `costs'. */
+    void leave(const EvalCosts & costs);
+
+    /* Write the profile to `path' in the `collapsed stack' format
+       understood by flame graph tools, with each stack's own time in
+       microseconds, and to `path.json' with the costs per function
+       and per file. */
+    void write(const Path & path);
+};
+
+
+}
@@ -3,7 +3,11 @@
 #include "config.h"
 
 #include <map>
-#include <unordered_set>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <cstring>
 
 #include "types.hh"
 
@@ -50,6 +54,12 @@ public:
         return s;
     }
 
+    /* Symbols are unique, so their address is a good enough hash. */
+    size_t hash() const
+    {
+        return (size_t) s;
+    }
+
     bool empty() const
     {
         return s->empty();
@@ -64,24 +74,82 @@ inline std::ostream & operator << (std::ostream & str, const Symbol & sym)
     return str;
 }
 
+/* The symbol table is safe to use from multiple threads.  Looking up
+   an existing symbol doesn't take a lock or allocate memory; only
+   adding a new symbol does. */
 class SymbolTable
 {
 private:
-    typedef std::unordered_set<string> Symbols;
-    Symbols symbols;
+
+    /* Symbols are stored together with their hash in a deque, so that
+       they never move. */
+    struct Entry
+    {
+        string s;
+        size_t hash;
+        Entry(const char * s, size_t len, size_t hash) : s(s, len), hash(hash) { }
+    };
+
+    std::deque<Entry> entries;
+
+    /* An open-addressing hash table of pointers to entries.  When
+       it's replaced by a bigger one, the old one is kept around
+       because other threads may still be reading it. */
+    struct Table
+    {
+        size_t mask;
+        std::atomic<Entry *> * slots;
+    };
+
+    std::atomic<Table *> table;
+    std::vector<Table *> tables;
+
+    /* Protects `entries' and `tables', and changes to the table. */
+    mutable std::mutex lock;
+
+    static size_t hashString(const char * s, size_t len)
+    {
+        /* FNV-1a. */
+        size_t h = 14695981039346656037ULL;
+        while (len--) h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+        return h;
+    }
+
+    Symbol insert(const char * s, size_t len, size_t hash);
+
+    SymbolTable(const SymbolTable &);
+    SymbolTable & operator = (const SymbolTable &);
 
 public:
-    Symbol create(const string & s)
+
+    SymbolTable();
+    ~SymbolTable();
+
+    Symbol create(const char * s, size_t len)
     {
-        std::pair<Symbols::iterator, bool> res = symbols.insert(s);
-        return Symbol(&*res.first);
+        size_t hash = hashString(s, len);
+        Table * t = table.load(std::memory_order_acquire);
+        for (size_t i = hash & t->mask; ; i = (i + 1) & t->mask) {
+            Entry * e = t->slots[i].load(std::memory_order_acquire);
+            if (!e) break;
+            if (e->hash == hash && e->s.size() == len && memcmp(e->s.data(), s, len) == 0)
+                return Symbol(&e->s);
+        }
+        return insert(s, len, hash);
     }
 
-    unsigned int size() const
+    Symbol create(const char * s)
     {
-        return symbols.size();
+        return create(s, strlen(s));
     }
 
+    Symbol create(const string & s)
+    {
+        return create(s.data(), s.size());
+    }
+
+    unsigned int size() const;
+
     size_t totalSize() const;
 };
 
@@ -39,6 +39,7 @@ void printValueAsJSON(EvalState & state, bool strict,
             break;
 
         case tString:
+            flattenString(v);
             copyContext(v, context);
             escapeJSON(str, v.string.s);
             break;
@@ -52,8 +53,8 @@ void printValueAsJSON(EvalState & state, bool strict,
             break;
 
         case tAttrs: {
-            Bindings::iterator i = v.attrs->find(state.sOutPath);
-            if (i == v.attrs->end()) {
+            Attr * i = v.attrs->find(state.sOutPath);
+            if (!i) {
                 JSONObject json(str);
                 StringSet names;
                 foreach (Bindings::iterator, i, *v.attrs)
@@ -68,11 +69,13 @@ void printValueAsJSON(EvalState & state, bool strict,
             break;
         }
 
-        case tList: {
+        case tList1:
+        case tList2:
+        case tListN: {
             JSONList json(str);
-            for (unsigned int n = 0; n < v.list.length; ++n) {
+            for (unsigned int n = 0; n < v.listSize(); ++n) {
                 json.elem();
-                printValueAsJSON(state, strict, *v.list.elems[n], str, context);
+                printValueAsJSON(state, strict, *v.listElems()[n], str, context);
             }
             break;
         }
@@ -70,6 +70,7 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
 
         case tString:
             /* !!! show the context? */
+            flattenString(v);
             copyContext(v, context);
             doc.writeEmptyElement("string", singletonAttrs("value", v.string.s));
             break;
@@ -86,21 +87,25 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
             if (state.isDerivation(v)) {
                 XMLAttrs xmlAttrs;
             
-                Bindings::iterator a = v.attrs->find(state.symbols.create("derivation"));
+                Attr * a = v.attrs->find(state.symbols.create("derivation"));
 
                 Path drvPath;
                 a = v.attrs->find(state.sDrvPath);
-                if (a != v.attrs->end()) {
+                if (a) {
                     if (strict) state.forceValue(*a->value);
-                    if (a->value->type == tString)
+                    if (a->value->type == tString) {
+                        flattenString(*a->value);
                         xmlAttrs["drvPath"] = drvPath = a->value->string.s;
+                    }
                 }
         
                 a = v.attrs->find(state.sOutPath);
-                if (a != v.attrs->end()) {
+                if (a) {
                     if (strict) state.forceValue(*a->value);
-                    if (a->value->type == tString)
+                    if (a->value->type == tString) {
+                        flattenString(*a->value);
                         xmlAttrs["outPath"] = a->value->string.s;
+                    }
                 }
 
                 XMLOpenElement _(doc, "derivation", xmlAttrs);
@@ -119,10 +124,12 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
             
             break;
 
-        case tList: {
+        case tList1:
+        case tList2:
+        case tListN: {
             XMLOpenElement _(doc, "list");
-            for (unsigned int n = 0; n < v.list.length; ++n)
-                printValueAsXML(state, strict, location, *v.list.elems[n], doc, context, drvsSeen);
+            for (unsigned int n = 0; n < v.listSize(); ++n)
+                printValueAsXML(state, strict, location, *v.listElems()[n], doc, context, drvsSeen);
             break;
         }
 
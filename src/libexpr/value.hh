@@ -12,7 +12,9 @@ typedef enum {
     tPath,
     tNull,
     tAttrs,
-    tList,
+    tList1,
+    tList2,
+    tListN,
     tThunk,
     tApp,
     tLambda,
@@ -29,6 +31,7 @@ struct ExprLambda;
 struct PrimOp;
 struct PrimOp;
 class Symbol;
+struct StringRope;
 
 
 typedef long NixInt;
@@ -61,18 +64,34 @@ struct Value
            derivation, and the other store paths in C will be added to
            the inputSrcs of the derivations.
 
-           For canonicity, the store paths should be in sorted order. */
+           For canonicity, the store paths should be in sorted order.
+
+           A long string produced by concatenation is represented as
+           a rope (see StringRope) that refers to the concatenated
+           strings, in which case `s' is 0.  Ropes are flattened by
+           flattenString() when their contents are needed. */
         struct {
             const char * s;
             const char * * context; // must be in sorted order
         } string;
+        struct {
+            const char * s; // always 0
+            StringRope * rope;
+        } stringRope;
 
         const char * path;
         Bindings * attrs;
+
+        /* Lists of one or two elements, which are very common, are
+           stored in the value itself (tList1 and tList2), saving an
+           allocation.  Other lists (tListN) point to an array of
+           elements.  Use listElems() and listSize() to access
+           either. */
         struct {
-            unsigned int length;
+            unsigned int size;
             Value * * elems;
-        } list;
+        } bigList;
+        Value * smallList[2];
         struct {
             Env * env;
             Expr * expr;
@@ -89,6 +108,26 @@ struct Value
             Value * left, * right;
         } primOpApp;
     };
+
+    bool isList() const
+    {
+        return type == tList1 || type == tList2 || type == tListN;
+    }
+
+    Value * * listElems()
+    {
+        return type == tList1 || type == tList2 ? smallList : bigList.elems;
+    }
+
+    Value * const * listElems() const
+    {
+        return type == tList1 || type == tList2 ? smallList : bigList.elems;
+    }
+
+    unsigned int listSize() const
+    {
+        return type == tList1 ? 1 : type == tList2 ? 2 : bigList.size;
+    }
 };
 
 
@@ -148,6 +187,26 @@ static inline void mkString(Value & v, const Symbol & s)
 void mkString(Value & v, const char * s);
 
 
+/* A string that is the concatenation of `parts' (which are string
+   values), not computed until it's needed.  This makes repeatedly
+   appending to a long string linear rather than quadratic.  The
+   contents and the union of the contexts are computed (once) by
+   flattenString(). */
+struct StringRope
+{
+    size_t length;
+    const char * s;
+    const char * * context;
+    unsigned int nrParts;
+    Value parts[0];
+};
+
+
+/* If `v' is a string that is still a rope, compute its contents and
+   context. */
+void flattenString(Value & v);
+
+
 static inline void mkPathNoCopy(Value & v, const char * s)
 {
     clearValue(v);
@@ -66,6 +66,15 @@
 #include <sys/statvfs.h>
 #endif
 
+/* Use epoll() and a timerfd to wait for child output if available,
+   rather than rebuilding an fd_set for select() on every iteration. */
+#define EPOLL_ENABLED HAVE_SYS_EPOLL_H && HAVE_SYS_TIMERFD_H
+
+#if EPOLL_ENABLED
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
 
 namespace nix {
 
@@ -178,6 +187,11 @@ protected:
 };
 
 
+/* The children that are subject to a timeout, ordered by the time
+   at which they time out. */
+typedef std::multimap<time_t, pid_t> Deadlines;
+
+
 /* A mapping used to remember for each child process to what goal it
    belongs, and file descriptors for receiving log data and output
    path creation commands. */
@@ -189,10 +203,16 @@ struct Child
     bool inBuildSlot;
     time_t lastOutput; /* time we last got output on stdout/stderr */
     time_t timeStarted;
+    bool hasDeadline;
+    Deadlines::iterator deadline; /* entry in `Worker::deadlines' */
 };
 
 typedef map<pid_t, Child> Children;
 
+/* Maps the file descriptors of running children back to their
+   process. */
+typedef map<int, pid_t> ChildFDs;
+
 
 /* The worker class. */
 class Worker
@@ -214,6 +234,26 @@ private:
     /* Child processes currently running. */
     Children children;
 
+    /* The nearest deadline of each child that respects timeouts. */
+    Deadlines deadlines;
+
+    /* The child to which each monitored file descriptor belongs. */
+    ChildFDs childFDs;
+
+#if EPOLL_ENABLED
+    /* Persistent registration of the file descriptors in `childFDs',
+       plus `timerFD' for waking up at the nearest deadline. */
+    AutoCloseFD epollFD;
+    AutoCloseFD timerFD;
+
+    /* The time at which `timerFD' expires, or 0 if it's disarmed. */
+    time_t timerExpiry;
+#endif
+
+    /* Buffers reused by waitForInput() for reading child output. */
+    vector<unsigned char> readBuffer;
+    string readData;
+
     /* Number of build slots occupied.  This includes local builds and
        substitutions but not remote builds via the build hook. */
     unsigned int nrLocalBuilds;
@@ -271,6 +311,13 @@ public:
        or the hook would still say `postpone'). */
     void childTerminated(pid_t pid, bool wakeSleepers = true);
 
+private:
+
+    /* Recompute the entry of `child' in `deadlines'. */
+    void updateDeadline(pid_t pid, Child & child);
+
+public:
+
     /* Put `goal' to sleep until a build slot becomes available (which
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
@@ -292,6 +339,12 @@ public:
     void waitForInput();
 
     unsigned int exitStatus();
+
+private:
+
+    /* Start / stop monitoring a file descriptor of a child. */
+    void addChildFD(int fd, pid_t pid);
+    void removeChildFD(int fd, pid_t pid);
 };
 
 
@@ -1063,9 +1116,10 @@ void DerivationGoal::repairClosure()
        that produced those outputs. */
 
     /* Get the output closure. */
-    PathSet outputClosure;
+    PathSet outputs;
     foreach (DerivationOutputs::iterator, i, drv.outputs)
-        computeFSClosure(worker.store, i->second.path, outputClosure);
+        outputs.insert(i->second.path);
+    PathSet outputClosure = worker.store.queryClosure(outputs);
 
     /* Filter out our own outputs (which we have already checked). */
     foreach (DerivationOutputs::iterator, i, drv.outputs)
@@ -1151,7 +1205,7 @@ void DerivationGoal::inputsRealised()
         Derivation inDrv = derivationFromPath(worker.store, i->first);
         foreach (StringSet::iterator, j, i->second)
             if (inDrv.outputs.find(*j) != inDrv.outputs.end())
-                computeFSClosure(worker.store, inDrv.outputs[*j].path, inputPaths);
+                inputPaths.insert(inDrv.outputs[*j].path);
             else
                 throw Error(
                     format("derivation `%1%' requires non-existent output `%2%' from input derivation `%3%'")
@@ -1159,8 +1213,9 @@ void DerivationGoal::inputsRealised()
     }
 
     /* Second, the input sources. */
-    foreach (PathSet::iterator, i, drv.inputSrcs)
-        computeFSClosure(worker.store, *i, inputPaths);
+    inputPaths.insert(drv.inputSrcs.begin(), drv.inputSrcs.end());
+
+    inputPaths = worker.store.queryClosure(inputPaths);
 
     debug(format("added input paths %1%") % showPaths(inputPaths));
 
@@ -1708,18 +1763,20 @@ void DerivationGoal::startBuilder()
            outputs as well.  This is useful if you want to do things
            like passing all build-time dependencies of some path to a
            derivation that builds a NixOS DVD image. */
-        PathSet paths, paths2;
-        computeFSClosure(worker.store, storePath, paths);
-        paths2 = paths;
+        PathSet paths = worker.store.queryClosure(singleton<PathSet>(storePath));
+        PathSet outputs;
 
-        foreach (PathSet::iterator, j, paths2) {
+        foreach (PathSet::iterator, j, paths) {
             if (isDerivation(*j)) {
                 Derivation drv = derivationFromPath(worker.store, *j);
                 foreach (DerivationOutputs::iterator, k, drv.outputs)
-                    computeFSClosure(worker.store, k->second.path, paths);
+                    outputs.insert(k->second.path);
             }
         }
 
+        PathSet outputClosure = worker.store.queryClosure(outputs);
+        paths.insert(outputClosure.begin(), outputClosure.end());
+
         /* Write closure info to `fileName'. */
         writeFile(tmpDir + "/" + fileName,
             worker.store.makeValidityRegistration(paths, false, false));
@@ -2197,6 +2254,18 @@ PathSet parseReferenceSpecifiers(const Derivation & drv, string attr)
 }
 
 
+/* Check that a fixed output has the hash that the derivation
+   specified. */
+static void checkOutputHash(const Path & path, const DerivationOutput & output,
+    const Hash & expected, const Hash & actual)
+{
+    if (expected != actual)
+        throw BuildError(
+            format("output path `%1%' should have %2% hash `%3%', instead has `%4%'")
+            % path % output.hashAlgo % printHash16or32(expected) % printHash16or32(actual));
+}
+
+
 void DerivationGoal::registerOutputs()
 {
     /* When using a build hook, the build hook can register the output
@@ -2285,10 +2354,11 @@ void DerivationGoal::registerOutputs()
 
         /* Check that fixed-output derivations produced the right
            outputs (i.e., the content hash should match the specified
-           hash). */
+           hash).  For recursive hashes, this is done below while
+           scanning for references. */
+        bool recursive = false; HashType ht = htUnknown; Hash h;
         if (i->second.hash != "") {
 
-            bool recursive; HashType ht; Hash h;
             i->second.parseHashInfo(recursive, ht, h);
 
             if (!recursive) {
@@ -2297,14 +2367,9 @@ void DerivationGoal::registerOutputs()
                 if (!S_ISREG(st.st_mode) || (st.st_mode & S_IXUSR) != 0)
                     throw BuildError(
                         format("output path `%1% should be a non-executable regular file") % path);
-            }
 
-            /* Check the hash. */
-            Hash h2 = recursive ? hashPath(ht, actualPath).first : hashFile(ht, actualPath);
-            if (h != h2)
-                throw BuildError(
-                    format("output path `%1%' should have %2% hash `%3%', instead has `%4%'")
-                    % path % i->second.hashAlgo % printHash16or32(h) % printHash16or32(h2));
+                checkOutputHash(path, i->second, h, hashFile(ht, actualPath));
+            }
         }
 
         /* Get rid of all weird permissions.  This also checks that
@@ -2315,9 +2380,22 @@ void DerivationGoal::registerOutputs()
         /* For this output path, find the references to other paths
            contained in it.  Compute the SHA-256 NAR hash at the same
            time.  The hash is stored in the database so that we can
-           verify later on whether nobody has messed with the store. */
+           verify later on whether nobody has messed with the store.
+           Also compute the hash of a recursive fixed output and the
+           hashes of the files to optimise, so that the output is
+           read only once. */
+        bool hashOutput = recursive && ht != htSHA256;
+        HashSink outputHashSink(hashOutput ? ht : htSHA256);
+        bool optimise = settings.autoOptimiseStore && buildMode != bmCheck;
+        FileHashes files;
+
         HashResult hash;
-        PathSet references = scanForReferences(actualPath, allPaths, hash);
+        PathSet references = scanForReferences(actualPath, allPaths, hash,
+            hashOutput ? &outputHashSink : 0, optimise ? &files : 0);
+
+        if (recursive)
+            checkOutputHash(path, i->second, h,
+                hashOutput ? outputHashSink.finish().first : hash.first);
 
         if (buildMode == bmCheck) {
             ValidPathInfo info = worker.store.queryPathInfo(path);
@@ -2347,7 +2425,7 @@ void DerivationGoal::registerOutputs()
                     throw BuildError(format("output is not allowed to refer to path `%1%'") % *i);
         }
 
-        worker.store.optimisePath(path); // FIXME: combine with scanForReferences()
+        worker.store.optimisePath(path, files);
 
         worker.store.markContentsGood(path);
 
@@ -2919,6 +2997,22 @@ Worker::Worker(LocalStore & store)
     nrLocalBuilds = 0;
     lastWokenUp = 0;
     permanentFailure = false;
+    readBuffer.resize(65536);
+
+#if EPOLL_ENABLED
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFD == -1) throw SysError("creating epoll instance");
+
+    timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timerFD == -1) throw SysError("creating timer");
+    timerExpiry = 0;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = timerFD;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, timerFD, &event) == -1)
+        throw SysError("registering timer");
+#endif
 }
 
 
@@ -3018,8 +3112,10 @@ void Worker::childStarted(GoalPtr goal,
     child.timeStarted = child.lastOutput = time(0);
     child.inBuildSlot = inBuildSlot;
     child.respectTimeouts = respectTimeouts;
-    children[pid] = child;
+    child.hasDeadline = false;
+    updateDeadline(pid, children[pid] = child);
     if (inBuildSlot) nrLocalBuilds++;
+    foreach (set<int>::const_iterator, i, fds) addChildFD(*i, pid);
 }
 
 
@@ -3035,6 +3131,10 @@ void Worker::childTerminated(pid_t pid, bool wakeSleepers)
         nrLocalBuilds--;
     }
 
+    foreach (set<int>::iterator, j, i->second.fds) removeChildFD(*j, pid);
+
+    if (i->second.hasDeadline) deadlines.erase(i->second.deadline);
+
     children.erase(pid);
 
     if (wakeSleepers) {
@@ -3050,6 +3150,58 @@ void Worker::childTerminated(pid_t pid, bool wakeSleepers)
 }
 
 
+void Worker::updateDeadline(pid_t pid, Child & child)
+{
+    if (child.hasDeadline) deadlines.erase(child.deadline);
+    child.hasDeadline = false;
+
+    if (!child.respectTimeouts) return;
+
+    assert(sizeof(time_t) >= sizeof(long));
+    time_t nearest = LONG_MAX;
+    if (settings.maxSilentTime != 0)
+        nearest = std::min(nearest, child.lastOutput + (time_t) settings.maxSilentTime);
+    if (settings.buildTimeout != 0)
+        nearest = std::min(nearest, child.timeStarted + (time_t) settings.buildTimeout);
+    if (nearest == LONG_MAX) return;
+
+    child.deadline = deadlines.insert(std::make_pair(nearest, pid));
+    child.hasDeadline = true;
+}
+
+
+void Worker::addChildFD(int fd, pid_t pid)
+{
+    childFDs[fd] = pid;
+#if EPOLL_ENABLED
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) == -1) {
+        /* A descriptor that is kept open across builds (like the
+           build hook's) may still be registered. */
+        if (errno != EEXIST || epoll_ctl(epollFD, EPOLL_CTL_MOD, fd, &event) == -1)
+            throw SysError(format("monitoring file descriptor %1%") % fd);
+    }
+#endif
+}
+
+
+void Worker::removeChildFD(int fd, pid_t pid)
+{
+    /* The descriptor may have been closed and reused by another child
+       in the meantime. */
+    ChildFDs::iterator i = childFDs.find(fd);
+    if (i == childFDs.end() || i->second != pid) return;
+    childFDs.erase(i);
+#if EPOLL_ENABLED
+    /* This fails harmlessly if the descriptor was already closed,
+       since that removes it from the epoll set automatically. */
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, 0);
+#endif
+}
+
+
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
@@ -3136,15 +3288,7 @@ void Worker::waitForInput()
     /* If we're monitoring for silence on stdout/stderr, or if there
        is a build timeout, then wait for input until the first
        deadline for any child. */
-    assert(sizeof(time_t) >= sizeof(long));
-    time_t nearest = LONG_MAX; // nearest deadline
-    foreach (Children::iterator, i, children) {
-        if (!i->second.respectTimeouts) continue;
-        if (settings.maxSilentTime != 0)
-            nearest = std::min(nearest, i->second.lastOutput + settings.maxSilentTime);
-        if (settings.buildTimeout != 0)
-            nearest = std::min(nearest, i->second.timeStarted + settings.buildTimeout);
-    }
+    time_t nearest = deadlines.empty() ? LONG_MAX : deadlines.begin()->first;
     if (nearest != LONG_MAX) {
         timeout.tv_sec = std::max((time_t) 1, nearest - before);
         useTimeout = true;
@@ -3161,18 +3305,51 @@ void Worker::waitForInput()
         timeout.tv_sec = std::max((time_t) 1, (time_t) (lastWokenUp + settings.pollInterval - before));
     } else lastWokenUp = 0;
 
-    using namespace std;
+    /* The file descriptors that have input available.  Note that
+       `available' (i.e., non-blocking) includes EOF. */
+    vector<int> ready;
+
+#if EPOLL_ENABLED
+
+    /* Arm the timer for the nearest deadline, or disarm it, unless
+       it's already set correctly. */
+    time_t expiry = useTimeout ? before + timeout.tv_sec : 0;
+    if (expiry != timerExpiry) {
+        struct itimerspec deadline;
+        memset(&deadline, 0, sizeof(deadline));
+        if (useTimeout) deadline.it_value.tv_sec = timeout.tv_sec;
+        if (timerfd_settime(timerFD, 0, &deadline, 0) == -1)
+            throw SysError("setting timer");
+        timerExpiry = expiry;
+    }
+
+    /* Only the descriptors that are actually ready are returned. */
+    struct epoll_event events[64];
+    int n = epoll_wait(epollFD, events, sizeof(events) / sizeof(events[0]), -1);
+    if (n == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
+    }
+
+    for (int i = 0; i < n; ++i)
+        if (events[i].data.fd == timerFD) {
+            uint64_t expirations;
+            if (read(timerFD, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+                throw SysError("reading timer");
+            timerExpiry = 0;
+        } else
+            ready.push_back(events[i].data.fd);
+
+#else
+
     /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
-       includes EOF. */
+       become `available'. */
     fd_set fds;
     FD_ZERO(&fds);
     int fdMax = 0;
-    foreach (Children::iterator, i, children) {
-        foreach (set<int>::iterator, j, i->second.fds) {
-            FD_SET(*j, &fds);
-            if (*j >= fdMax) fdMax = *j + 1;
-        }
+    foreach (ChildFDs::iterator, i, childFDs) {
+        FD_SET(i->first, &fds);
+        if (i->first >= fdMax) fdMax = i->first + 1;
     }
 
     if (select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0) == -1) {
@@ -3180,67 +3357,92 @@ void Worker::waitForInput()
         throw SysError("waiting for input");
     }
 
-    time_t after = time(0);
+    foreach (ChildFDs::iterator, i, childFDs)
+        if (FD_ISSET(i->first, &fds)) ready.push_back(i->first);
 
-    /* Process all available file descriptors. */
+#endif
 
-    /* Since goals may be canceled from inside the loop below (causing
-       them go be erased from the `children' map), we have to be
-       careful that we don't keep iterators alive across calls to
-       cancel(). */
-    set<pid_t> pids;
-    foreach (Children::iterator, i, children) pids.insert(i->first);
+    time_t after = time(0);
 
-    foreach (set<pid_t>::iterator, i, pids) {
+    /* Process all available file descriptors.  Since goals may be
+       canceled or finish from inside the loop below (causing them to
+       be erased from the `children' map), we have to look up the
+       child again for every descriptor. */
+    foreach (vector<int>::iterator, k, ready) {
         checkInterrupt();
-        Children::iterator j = children.find(*i);
-        if (j == children.end()) continue; // child destroyed
+        ChildFDs::iterator i = childFDs.find(*k);
+        if (i == childFDs.end()) continue; // child destroyed
+        Children::iterator j = children.find(i->second);
+        if (j == children.end() || j->second.fds.find(*k) == j->second.fds.end()) continue;
         GoalPtr goal = j->second.goal.lock();
         assert(goal);
 
-        set<int> fds2(j->second.fds);
-        foreach (set<int>::iterator, k, fds2) {
-            if (FD_ISSET(*k, &fds)) {
-                unsigned char buffer[4096];
-                ssize_t rd = read(*k, buffer, sizeof(buffer));
-                if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError(format("reading from %1%")
-                            % goal->getName());
-                } else if (rd == 0) {
-                    debug(format("%1%: got EOF") % goal->getName());
-                    goal->handleEOF(*k);
-                    j->second.fds.erase(*k);
-                } else {
-                    printMsg(lvlVomit, format("%1%: read %2% bytes")
-                        % goal->getName() % rd);
-                    string data((char *) buffer, rd);
-                    j->second.lastOutput = after;
-                    goal->handleChildOutput(*k, data);
-                }
+        ssize_t rd = read(*k, &readBuffer[0], readBuffer.size());
+        if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError(format("reading from %1%")
+                    % goal->getName());
+        } else if (rd == 0) {
+            debug(format("%1%: got EOF") % goal->getName());
+            removeChildFD(*k, j->first);
+            j->second.fds.erase(*k);
+            goal->handleEOF(*k);
+        } else {
+            printMsg(lvlVomit, format("%1%: read %2% bytes")
+                % goal->getName() % rd);
+            readData.assign((char *) &readBuffer[0], rd);
+            if (j->second.lastOutput != after) {
+                j->second.lastOutput = after;
+                if (settings.maxSilentTime != 0) updateDeadline(j->first, j->second);
             }
+            goal->handleChildOutput(*k, readData);
         }
+    }
 
-        if (goal->getExitCode() == Goal::ecBusy &&
-            settings.maxSilentTime != 0 &&
-            j->second.respectTimeouts &&
-            after - j->second.lastOutput >= (time_t) settings.maxSilentTime)
-        {
-            printMsg(lvlError,
-                format("%1% timed out after %2% seconds of silence")
-                % goal->getName() % settings.maxSilentTime);
-            goal->cancel(true);
-        }
+    /* Kill the children that exceeded their deadline.  Only the
+       expired entries of `deadlines' need to be looked at. */
+    if (!deadlines.empty() && deadlines.begin()->first <= after) {
+        vector<pid_t> pids;
+        for (Deadlines::iterator i = deadlines.begin();
+             i != deadlines.end() && i->first <= after; ++i)
+            pids.push_back(i->second);
+
+        foreach (vector<pid_t>::iterator, i, pids) {
+            checkInterrupt();
+            Children::iterator j = children.find(*i);
+            if (j == children.end()) continue; // child destroyed
+            GoalPtr goal = j->second.goal.lock();
+            assert(goal);
+
+            if (goal->getExitCode() == Goal::ecBusy &&
+                settings.maxSilentTime != 0 &&
+                j->second.respectTimeouts &&
+                after - j->second.lastOutput >= (time_t) settings.maxSilentTime)
+            {
+                printMsg(lvlError,
+                    format("%1% timed out after %2% seconds of silence")
+                    % goal->getName() % settings.maxSilentTime);
+                goal->cancel(true);
+            }
 
-        else if (goal->getExitCode() == Goal::ecBusy &&
-            settings.buildTimeout != 0 &&
-            j->second.respectTimeouts &&
-            after - j->second.timeStarted >= (time_t) settings.buildTimeout)
-        {
-            printMsg(lvlError,
-                format("%1% timed out after %2% seconds")
-                % goal->getName() % settings.buildTimeout);
-            goal->cancel(true);
+            else if (goal->getExitCode() == Goal::ecBusy &&
+                settings.buildTimeout != 0 &&
+                j->second.respectTimeouts &&
+                after - j->second.timeStarted >= (time_t) settings.buildTimeout)
+            {
+                printMsg(lvlError,
+                    format("%1% timed out after %2% seconds")
+                    % goal->getName() % settings.buildTimeout);
+                goal->cancel(true);
+            }
+
+            /* Don't wake up for this child again if it's still
+               around (e.g. because its goal is no longer busy). */
+            j = children.find(*i);
+            if (j != children.end() && j->second.hasDeadline) {
+                deadlines.erase(j->second.deadline);
+                j->second.hasDeadline = false;
+            }
         }
     }
 
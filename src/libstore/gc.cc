@@ -3,8 +3,15 @@
 #include "local-store.hh"
 
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 #include <queue>
 #include <algorithm>
+#include <sstream>
+#include <climits>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -198,6 +205,12 @@ void LocalStore::addTempRoot(const Path & path)
     /* Downgrade to a read lock. */
     debug(format("downgrading to read lock on `%1%'") % fnTempRoots);
     lockFile(fdTempRoots, ltRead, true);
+
+    /* The path may have been deleted by another process's garbage
+       collector since we cached it as valid.  Now that it can no
+       longer disappear, make the next validity check ask the
+       database. */
+    pathInfoCache.erase(path);
 }
 
 
@@ -381,19 +394,137 @@ static void addAdditionalRoots(StoreAPI & store, PathSet & roots)
 struct GCLimitReached { };
 
 
+/* Deletes paths in the trash directory on a pool of threads, so that
+   the garbage collector doesn't have to wait for the file system. */
+class TrashDeleter
+{
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::deque<Path> queue;
+    bool done;
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+
+    std::atomic<unsigned long long> bytesFreed;
+
+    void run();
+
+public:
+
+    TrashDeleter(unsigned int nrThreads);
+
+    ~TrashDeleter();
+
+    void enqueue(const Path & path);
+
+    /* Wait until all queued paths have been deleted, and rethrow the
+       first error encountered by a thread, if any. */
+    void finish();
+
+    /* The number of bytes freed so far. */
+    unsigned long long getBytesFreed()
+    {
+        return bytesFreed;
+    }
+};
+
+
+TrashDeleter::TrashDeleter(unsigned int nrThreads)
+    : done(false), bytesFreed(0)
+{
+    for (unsigned int n = 0; n < std::max(nrThreads, 1U); ++n)
+        threads.push_back(std::thread(&TrashDeleter::run, this));
+}
+
+
+TrashDeleter::~TrashDeleter()
+{
+    /* We get here without finish() if the garbage collector failed.
+       Leave the remaining paths to the next run. */
+    try {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            queue.clear();
+        }
+        finish();
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void TrashDeleter::run()
+{
+    while (true) {
+        Path path;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (queue.empty() && !done) wakeup.wait(guard);
+            if (queue.empty() || error) return;
+            path = queue.front();
+            queue.pop_front();
+        }
+
+        try {
+            unsigned long long bytes = 0;
+            deletePathUnlogged(path, bytes);
+            bytesFreed += bytes;
+        } catch (Interrupted &) {
+            std::unique_lock<std::mutex> guard(lock);
+            if (!error) error = std::current_exception();
+            /* Make sure the main thread sees the user interrupt as
+               well. */
+            _isInterrupted = 1;
+            return;
+        } catch (...) {
+            /* Other errors are rethrown by enqueue() or finish(). */
+            std::unique_lock<std::mutex> guard(lock);
+            if (!error) error = std::current_exception();
+            return;
+        }
+    }
+}
+
+
+void TrashDeleter::enqueue(const Path & path)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (error) std::rethrow_exception(error);
+    queue.push_back(path);
+    wakeup.notify_one();
+}
+
+
+void TrashDeleter::finish()
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done = true;
+        wakeup.notify_all();
+    }
+    foreach (std::vector<std::thread>::iterator, i, threads)
+        if (i->joinable()) i->join();
+    if (error) std::rethrow_exception(error);
+}
+
+
 struct LocalStore::GCState
 {
     GCOptions options;
     GCResults & results;
-    PathSet roots;
+    /* Paths are interned in `ids' so that the sets below are
+       bitsets rather than sets of strings. */
+    PathIds ids;
+    PathIdSet roots;
     PathSet tempRoots;
-    PathSet dead;
-    PathSet alive;
+    PathIdSet dead;
+    PathIdSet alive;
     bool gcKeepOutputs;
     bool gcKeepDerivations;
     unsigned long long bytesInvalidated;
     Path trashDir;
     bool shouldDelete;
+    std::shared_ptr<TrashDeleter> deleter;
     GCState(GCResults & results_) : results(results_), bytesInvalidated(0) { }
 };
 
@@ -455,6 +586,7 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
         Path tmp = state.trashDir + "/" + baseNameOf(path);
         if (rename(path.c_str(), tmp.c_str()))
             throw SysError(format("unable to rename `%1%' to `%2%'") % path % tmp);
+        state.deleter->enqueue(tmp);
     } else
         deleteGarbage(state, path);
 
@@ -465,25 +597,27 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 }
 
 
-bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & path)
+bool LocalStore::canReachRoot(GCState & state, std::unordered_set<PathId> & visited, PathId id)
 {
-    if (visited.find(path) != visited.end()) return false;
+    if (visited.find(id) != visited.end()) return false;
 
-    if (state.alive.find(path) != state.alive.end()) {
+    if (state.alive.contains(id)) {
         return true;
     }
 
-    if (state.dead.find(path) != state.dead.end()) {
+    if (state.dead.contains(id)) {
         return false;
     }
 
-    if (state.roots.find(path) != state.roots.end()) {
+    const Path & path(state.ids[id]);
+
+    if (state.roots.contains(id)) {
         printMsg(lvlDebug, format("cannot delete `%1%' because it's a root") % path);
-        state.alive.insert(path);
+        state.alive.insert(id);
         return true;
     }
 
-    visited.insert(path);
+    visited.insert(id);
 
     if (!isValidPath(path)) return false;
 
@@ -511,8 +645,8 @@ bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & p
 
     foreach (PathSet::iterator, i, incoming)
         if (*i != path)
-            if (canReachRoot(state, visited, *i)) {
-                state.alive.insert(path);
+            if (canReachRoot(state, visited, state.ids.intern(*i))) {
+                state.alive.insert(id);
                 return true;
             }
 
@@ -520,6 +654,152 @@ bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & p
 }
 
 
+/* Determine the live and dead valid paths in one go, by loading the
+   whole reference graph and marking everything reachable from the
+   roots.  Afterwards canReachRoot() only has to walk the referrers of
+   paths that became valid in the meantime. */
+void LocalStore::markLivePaths(GCState & state, const PathSet & roots)
+{
+    printMsg(lvlError, format("marking live paths..."));
+
+    PathGraph graph;
+    std::vector<PathId> valid;
+    queryReferenceGraph(state.ids, graph, valid,
+        state.gcKeepOutputs, state.gcKeepDerivations);
+
+    std::vector<PathId> rootIds;
+    foreach (PathSet::const_iterator, i, roots)
+        rootIds.push_back(state.ids.intern(*i));
+
+    unsigned int threads = std::thread::hardware_concurrency();
+    PathIdSet live = markReachable(graph, rootIds, threads ? threads : 1);
+
+    foreach (std::vector<PathId>::iterator, i, valid)
+        if (live.contains(*i))
+            state.alive.insert(*i);
+        else
+            state.dead.insert(*i);
+
+    printMsg(lvlInfo, format("%1% valid paths, %2% live")
+        % valid.size() % state.alive.size());
+}
+
+
+/* Order the entries of the store so that the dead paths that are
+   most worth deleting come first: those not accessed for the longest
+   time (to the day), and among those the largest.  Entries that the
+   marking phase didn't see as dead (e.g. because they were registered
+   since) go last, in random order.  Access times are those of the
+   top-level entries, so they are only approximate on file systems
+   mounted with `noatime' or `relatime'. */
+void LocalStore::rankGarbage(GCState & state, vector<Path> & entries)
+{
+    PathSet dead;
+    vector<Path> rest;
+    foreach (vector<Path>::iterator, i, entries)
+        if (state.dead.contains(state.ids.lookup(*i)))
+            dead.insert(*i);
+        else
+            rest.push_back(*i);
+
+    ValidPathInfoMap infos = queryPathInfos(dead);
+
+    struct Candidate
+    {
+        Path path;
+        time_t day;
+        unsigned long long narSize;
+        bool operator < (const Candidate & c) const
+        {
+            return day != c.day ? day < c.day : narSize > c.narSize;
+        }
+    };
+
+    vector<Candidate> candidates;
+    foreach (ValidPathInfoMap::iterator, i, infos) {
+        checkInterrupt();
+        struct stat st;
+        if (lstat(i->first.c_str(), &st) == -1) continue;
+        Candidate c;
+        c.path = i->first;
+        c.day = st.st_atime / 86400;
+        c.narSize = i->second.narSize;
+        candidates.push_back(c);
+    }
+
+    sort(candidates.begin(), candidates.end());
+    random_shuffle(rest.begin(), rest.end());
+
+    entries.clear();
+    foreach (vector<Candidate>::iterator, i, candidates)
+        entries.push_back(i->path);
+    entries.insert(entries.end(), rest.begin(), rest.end());
+}
+
+
+/* Try to delete valid paths in order of registration, starting after
+   the last path considered by the previous run, until the limit on
+   the bytes freed is reached or every path has been considered once.
+   The position is kept in a file, so that a series of small
+   collections eventually considers every path. */
+void LocalStore::tryToDeleteOldest(GCState & state)
+{
+    Path cursorFile = settings.nixDBPath + "/gc-cursor";
+
+    /* Start before the oldest path, unless there is a cursor. */
+    time_t startTime = -1;
+    unsigned long long startId = 0;
+    bool haveCursor = false;
+    if (pathExists(cursorFile)) {
+        std::istringstream str(readFile(cursorFile));
+        haveCursor = (bool) (str >> startTime >> startId);
+        if (!haveCursor) { startTime = -1; startId = 0; }
+    }
+
+    time_t time = startTime;
+    unsigned long long id = startId;
+    bool wrapped = !haveCursor;
+    bool done = false;
+
+    try {
+
+        while (!done) {
+            ValidPathInfos infos = queryValidPathsByAge(time, id, 1000);
+
+            if (infos.empty()) {
+                if (wrapped) break;
+                wrapped = true;
+                time = -1; id = 0;
+                continue;
+            }
+
+            foreach (ValidPathInfos::iterator, i, infos) {
+                if (wrapped && haveCursor &&
+                    (i->registrationTime > startTime ||
+                     (i->registrationTime == startTime && i->id > startId)))
+                {
+                    done = true;
+                    break;
+                }
+                tryToDelete(state, i->path);
+                time = i->registrationTime;
+                id = i->id;
+            }
+        }
+
+    } catch (...) {
+        if (state.shouldDelete)
+            writeFile(cursorFile, (format("%1% %2%") % time % id).str());
+        throw;
+    }
+
+    /* Every path has been considered, so the next run can start from
+       the beginning. */
+    if (state.shouldDelete && pathExists(cursorFile))
+        deletePath(cursorFile);
+}
+
+
 void LocalStore::tryToDelete(GCState & state, const Path & path)
 {
     checkInterrupt();
@@ -538,16 +818,17 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
         if (isActiveTempFile(state, path, ".chroot")) return;
     }
 
-    PathSet visited;
+    std::unordered_set<PathId> visited;
 
-    if (canReachRoot(state, visited, path)) {
+    if (canReachRoot(state, visited, state.ids.intern(path))) {
         printMsg(lvlDebug, format("cannot delete `%1%' because it's still reachable") % path);
     } else {
         /* No path we visited was a root, so everything is garbage.
            But we only delete ‘path’ and its referrers here so that
            ‘nix-store --delete’ doesn't have the unexpected effect of
            recursing into derivations and outputs. */
-        state.dead.insert(visited.begin(), visited.end());
+        foreach (std::unordered_set<PathId>::iterator, i, visited)
+            state.dead.insert(*i);
         if (state.shouldDelete)
             deletePathRecursive(state, path);
     }
@@ -584,6 +865,15 @@ void LocalStore::removeUnusedLinks(const GCState & state)
             continue;
         }
 
+        /* With reflinks, files may share the data blocks of a link
+           without linking to it.  Keep those links, since they're
+           needed to deduplicate new copies against the old ones. */
+        if (settings.optimiseStoreMethod == "reflink" && S_ISREG(st.st_mode)) {
+            AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) throw SysError(format("opening `%1%'") % path);
+            if (getSharedBytes(fd) > 0) continue;
+        }
+
         printMsg(lvlTalkative, format("deleting unused link `%1%'") % path);
 
         if (unlink(path.c_str()) == -1)
@@ -621,6 +911,18 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     state.shouldDelete = options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific;
 
+    /* If there is a free space goal, free only as much as needed to
+       reach it. */
+    if (options.minFree && options.action != GCOptions::gcDeleteSpecific) {
+        unsigned long long avail = getStoreFreeSpace();
+        if (avail >= options.minFree) {
+            printMsg(lvlInfo, format("%1% bytes free, which is more than %2%; nothing to do")
+                % avail % options.minFree);
+            state.options.maxFreed = 0;
+        } else
+            state.options.maxFreed = std::min(state.options.maxFreed, options.minFree - avail);
+    }
+
     /* Acquire the global GC root.  This prevents
        a) New roots from being added.
        b) Processes from creating new temporary root files. */
@@ -631,21 +933,25 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     printMsg(lvlError, format("finding garbage collector roots..."));
     Roots rootMap = options.ignoreLiveness ? Roots() : findRoots();
 
-    foreach (Roots::iterator, i, rootMap) state.roots.insert(i->second);
+    PathSet roots;
+    foreach (Roots::iterator, i, rootMap) roots.insert(i->second);
 
     /* Add additional roots returned by the program specified by the
        NIX_ROOT_FINDER environment variable.  This is typically used
        to add running programs to the set of roots (to prevent them
        from being garbage collected). */
     if (!options.ignoreLiveness)
-        addAdditionalRoots(*this, state.roots);
+        addAdditionalRoots(*this, roots);
 
     /* Read the temporary roots.  This acquires read locks on all
        per-process temporary root files.  So after this point no paths
        can be added to the set of temporary roots. */
     FDs fds;
     readTempRoots(state.tempRoots, fds);
-    state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
+    roots.insert(state.tempRoots.begin(), state.tempRoots.end());
+
+    foreach (PathSet::iterator, i, roots)
+        state.roots.insert(state.ids.intern(*i));
 
     /* After this point the set of roots or temporary roots cannot
        increase, since we hold locks on everything.  So everything
@@ -654,6 +960,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     if (state.shouldDelete) {
         if (pathExists(state.trashDir)) deleteGarbage(state, state.trashDir);
         createDirs(state.trashDir);
+        state.deleter = std::shared_ptr<TrashDeleter>(new TrashDeleter(settings.gcDeleteJobs));
     }
 
     /* Now either delete all garbage paths, or just the specified
@@ -664,11 +971,25 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         foreach (PathSet::iterator, i, options.pathsToDelete) {
             assertStorePath(*i);
             tryToDelete(state, *i);
-            if (state.dead.find(*i) == state.dead.end())
+            if (!state.dead.contains(state.ids.lookup(*i)))
                 throw Error(format("cannot delete path `%1%' since it is still alive") % *i);
         }
 
-    } else if (options.maxFreed > 0) {
+    } else if (state.options.maxFreed > 0 && options.incremental && options.action != GCOptions::gcReturnLive) {
+
+        if (state.shouldDelete)
+            printMsg(lvlError, format("deleting garbage incrementally..."));
+        else
+            printMsg(lvlError, format("determining dead paths incrementally..."));
+
+        try {
+            tryToDeleteOldest(state);
+        } catch (GCLimitReached & e) {
+        }
+
+    } else if (state.options.maxFreed > 0) {
+
+        markLivePaths(state, roots);
 
         if (state.shouldDelete)
             printMsg(lvlError, format("deleting garbage..."));
@@ -693,7 +1014,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                 string name = dirent->d_name;
                 if (name == "." || name == "..") continue;
                 Path path = settings.nixStore + "/" + name;
-                if (isValidPath(path))
+                PathId id = state.ids.lookup(path);
+                if (state.alive.contains(id) || state.dead.contains(id) || isValidPath(path))
                     entries.push_back(path);
                 else
                     tryToDelete(state, path);
@@ -701,13 +1023,18 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
             dir.close();
 
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
+            /* Now delete the unreachable valid paths.  If only part
+               of the garbage is to be deleted (--max-freed etc.),
+               delete the least recently used paths first.  Otherwise
+               the order doesn't matter much, but randomise it anyway
+               to make the collector less biased towards deleting
+               paths that come alphabetically first
+               (e.g. /nix/store/000...). */
             vector<Path> entries_(entries.begin(), entries.end());
-            random_shuffle(entries_.begin(), entries_.end());
+            if (state.options.maxFreed != ULLONG_MAX)
+                rankGarbage(state, entries_);
+            else
+                random_shuffle(entries_.begin(), entries_.end());
 
             foreach (vector<Path>::iterator, i, entries_)
                 tryToDelete(state, *i);
@@ -717,12 +1044,12 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     }
 
     if (state.options.action == GCOptions::gcReturnLive) {
-        state.results.paths = state.alive;
+        state.results.paths = state.alive.toPathSet(state.ids);
         return;
     }
 
     if (state.options.action == GCOptions::gcReturnDead) {
-        state.results.paths = state.dead;
+        state.results.paths = state.dead.toPathSet(state.ids);
         return;
     }
 
@@ -730,18 +1057,24 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     fdGCLock.close();
     fds.clear();
 
-    /* Delete the trash directory. */
+    /* Wait for the paths in the trash directory to be deleted, then
+       delete the trash directory itself. */
     printMsg(lvlInfo, format("deleting `%1%'") % state.trashDir);
+    if (state.deleter) {
+        state.deleter->finish();
+        state.results.bytesFreed += state.deleter->getBytesFreed();
+    }
     deleteGarbage(state, state.trashDir);
 
-    /* Clean up the links directory. */
-    if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
+    /* Clean up the links directory.  An incremental collection skips
+       this, since it has to read the whole directory. */
+    if ((options.action == GCOptions::gcDeleteDead && !options.incremental) || options.action == GCOptions::gcDeleteSpecific) {
         printMsg(lvlError, format("deleting unused links..."));
         removeUnusedLinks(state);
     }
 
     /* While we're at it, vacuum the database. */
-    if (options.action == GCOptions::gcDeleteDead) vacuumDB();
+    if (options.action == GCOptions::gcDeleteDead && !options.incremental) vacuumDB();
 }
 
 
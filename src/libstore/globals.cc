@@ -58,10 +58,20 @@ Settings::Settings()
     checkRootReachability = false;
     gcKeepOutputs = false;
     gcKeepDerivations = true;
+    gcDeleteJobs = 4;
+    gcMinFree = 0;
+    gcMaxFree = 0;
     autoOptimiseStore = false;
+    optimiseStoreMethod = "hardlink";
+    optimiseStoreJobs = 0;
     envKeepDerivations = false;
     lockCPU = getEnv("NIX_AFFINITY_HACK", "1") == "1";
     showTrace = false;
+    evalJobs = 1;
+    evalCache = false;
+    parseCache = false;
+    parseCacheMaxAge = 30 * 24 * 3600;
+    pathInfoCacheSize = 16384;
     enableImportNative = false;
     trustedUsers = Strings({"root"});
     allowedUsers = Strings({"*"});
@@ -147,12 +157,22 @@ void Settings::update()
     get(checkRootReachability, "gc-check-reachability");
     get(gcKeepOutputs, "gc-keep-outputs");
     get(gcKeepDerivations, "gc-keep-derivations");
+    get(gcDeleteJobs, "gc-delete-jobs");
+    get(gcMinFree, "gc-min-free");
+    get(gcMaxFree, "gc-max-free");
     get(autoOptimiseStore, "auto-optimise-store");
+    get(optimiseStoreMethod, "optimise-store-method");
+    get(optimiseStoreJobs, "optimise-store-jobs");
     get(envKeepDerivations, "env-keep-derivations");
     get(sshSubstituterHosts, "ssh-substituter-hosts");
     get(useSshSubstituter, "use-ssh-substituter");
     get(logServers, "log-servers");
     get(enableImportNative, "allow-unsafe-native-code-during-evaluation");
+    get(evalJobs, "eval-jobs");
+    get(evalCache, "eval-cache");
+    get(parseCache, "parse-cache");
+    get(parseCacheMaxAge, "parse-cache-max-age");
+    get(pathInfoCacheSize, "path-info-cache-size");
     get(useCaseHack, "use-case-hack");
     get(trustedUsers, "trusted-users");
     get(allowedUsers, "allowed-users");
@@ -183,10 +183,31 @@ struct Settings {
        paths. */
     bool gcKeepDerivations;
 
+    /* The number of threads that the garbage collector uses to delete
+       dead paths from the trash directory. */
+    unsigned int gcDeleteJobs;
+
+    /* If the free space on the file system containing the store drops
+       below `gcMinFree' bytes, the Nix daemon starts a garbage
+       collection in the background that stops once `gcMaxFree' bytes
+       are free.  0 disables this. */
+    unsigned long long gcMinFree;
+    unsigned long long gcMaxFree;
+
     /* Whether to automatically replace files with identical contents
        with hard links. */
     bool autoOptimiseStore;
 
+    /* How identical files are shared: `hardlink' replaces them with
+       hard links to a single copy, `reflink' makes them share their
+       data blocks (on file systems that support it, such as Btrfs and
+       XFS) but keeps them as separate files. */
+    string optimiseStoreMethod;
+
+    /* The number of threads that `nix-store --optimise' uses to hash
+       and link files.  0 means the number of CPU cores. */
+    unsigned int optimiseStoreJobs;
+
     /* Whether to add derivations as a dependency of user environments
        (to prevent them from being GCed). */
     bool envKeepDerivations;
@@ -197,6 +218,28 @@ struct Settings {
     /* Whether to show a stack trace if Nix evaluation fails. */
     bool showTrace;
 
+    /* Number of worker processes used to evaluate the attributes of a
+       package set in parallel in read-only mode (e.g. `nix-env -qa').
+       1 means no parallelism. */
+    unsigned int evalJobs;
+
+    /* Whether nix-env keeps the derivations found in a Nix expression
+       in a persistent cache in read-only mode, to avoid re-evaluating
+       unchanged expressions. */
+    bool evalCache;
+
+    /* Whether to keep the parsed form of Nix expression files in a
+       persistent cache, to skip the parser for unchanged files. */
+    bool parseCache;
+
+    /* Entries of the parse cache that haven't been used for this many
+       seconds are removed. */
+    time_t parseCacheMaxAge;
+
+    /* The maximum number of valid paths whose info LocalStore keeps
+       in memory.  0 disables the cache. */
+    unsigned int pathInfoCacheSize;
+
     /* A list of URL prefixes that can return Nix build logs. */
     Strings logServers;
 
@@ -10,6 +10,9 @@
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <climits>
+#include <thread>
+#include <exception>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -28,6 +31,10 @@
 #include <sys/mount.h>
 #endif
 
+#if HAVE_STATVFS
+#include <sys/statvfs.h>
+#endif
+
 #if HAVE_LINUX_FS_H
 #include <linux/fs.h>
 #include <sys/ioctl.h>
@@ -152,6 +159,54 @@ void SQLiteStmt::bind()
 }
 
 
+PathInfoCache::Entry * PathInfoCache::lookup(const Path & path, bool needInfo)
+{
+    Entries::iterator i = entries.find(path);
+    if (i == entries.end() || (needInfo && !i->second.haveInfo)) {
+        misses++;
+        return 0;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, i->second.lru);
+    return &i->second;
+}
+
+
+void PathInfoCache::insert(const ValidPathInfo & info, bool haveInfo)
+{
+    if (maxSize == 0) return;
+
+    Entries::iterator i = entries.find(info.path);
+    if (i != entries.end()) {
+        if (!haveInfo) return;
+        i->second.info = info;
+        i->second.haveInfo = true;
+        lru.splice(lru.begin(), lru, i->second.lru);
+        return;
+    }
+
+    if (entries.size() >= maxSize) {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+
+    lru.push_front(info.path);
+    Entry & entry(entries[info.path]);
+    entry.info = info;
+    entry.haveInfo = haveInfo;
+    entry.lru = lru.begin();
+}
+
+
+void PathInfoCache::erase(const Path & path)
+{
+    Entries::iterator i = entries.find(path);
+    if (i == entries.end()) return;
+    lru.erase(i->second.lru);
+    entries.erase(i);
+}
+
+
 /* Helper class to ensure that prepared statements are reset when
    leaving the scope that uses them.  Unfinished prepared statements
    prevent transactions from being aborted, and can cause locks to be
@@ -228,6 +283,8 @@ LocalStore::LocalStore(bool reserveSpace)
 {
     schemaPath = settings.nixDBPath + "/schema";
 
+    pathInfoCache.maxSize = settings.pathInfoCacheSize;
+
     if (settings.readOnlyMode) {
         openDB(false);
         return;
@@ -340,6 +397,9 @@ LocalStore::LocalStore(bool reserveSpace)
 
         if (curSchema < 6) upgradeStore6();
         else if (curSchema < 7) { upgradeStore7(); openDB(true); }
+        /* Schema 8 only adds tables and indices, which are created
+           from schema.sql. */
+        else openDB(true);
 
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
@@ -353,6 +413,13 @@ LocalStore::LocalStore(bool reserveSpace)
 LocalStore::~LocalStore()
 {
     try {
+        if (pathInfoCache.hits + pathInfoCache.misses) {
+            bool showStats = getEnv("NIX_SHOW_STATS", "0") != "0";
+            printMsg(showStats ? lvlInfo : lvlDebug,
+                format("path info cache: %1% hits, %2% misses, %3% entries")
+                % pathInfoCache.hits % pathInfoCache.misses % pathInfoCache.entries.size());
+        }
+
         foreach (RunningSubstituters::iterator, i, runningSubstituters) {
             if (i->second.disabled) continue;
             i->second.to.close();
@@ -471,6 +538,15 @@ void LocalStore::openDB(bool create)
     // ensure efficient lookup.
     stmtQueryPathFromHashPart.create(db,
         "select path from ValidPaths where path >= ? limit 1;");
+    stmtQueryPathsByAge[0].create(db,
+        "select id, path, registrationTime from ValidPaths where registrationTime = ? and id > ? order by id limit ?;");
+    stmtQueryPathsByAge[1].create(db,
+        "select id, path, registrationTime from ValidPaths where registrationTime > ? order by registrationTime, id limit ?;");
+    /* In read-only mode, the store may not have been upgraded to
+       schema 8 yet, but it isn't optimised either. */
+    if (!settings.readOnlyMode)
+        stmtMarkOptimised.create(db,
+            "insert or ignore into OptimisedPaths (id) select id from ValidPaths where path = ?;");
 }
 
 
@@ -496,6 +572,19 @@ void LocalStore::makeStoreWritable()
 }
 
 
+unsigned long long getStoreFreeSpace()
+{
+#if HAVE_STATVFS
+    struct statvfs st;
+    if (statvfs(settings.nixStore.c_str(), &st) == -1)
+        throw SysError(format("getting info about the file system containing `%1%'") % settings.nixStore);
+    return (unsigned long long) st.f_bavail * st.f_bsize;
+#else
+    return ULLONG_MAX;
+#endif
+}
+
+
 const time_t mtimeStore = 1; /* 1 second into the epoch */
 
 
@@ -798,61 +887,108 @@ Hash parseHashField(const Path & path, const string & s)
 }
 
 
-ValidPathInfo LocalStore::queryPathInfo(const Path & path)
+/* Fill in `info' for `path', or return false if `path' is not
+   valid. */
+bool LocalStore::queryPathInfo_(const Path & path, ValidPathInfo & info)
 {
-    ValidPathInfo info;
     info.path = path;
 
-    assertStorePath(path);
+    /* Get the path info. */
+    SQLiteStmtUse use1(stmtQueryPathInfo);
 
-    retry_sqlite {
+    stmtQueryPathInfo.bind(path);
 
-        /* Get the path info. */
-        SQLiteStmtUse use1(stmtQueryPathInfo);
+    int r = sqlite3_step(stmtQueryPathInfo);
+    if (r == SQLITE_DONE) return false;
+    if (r != SQLITE_ROW) throwSQLiteError(db, "querying path in database");
 
-        stmtQueryPathInfo.bind(path);
+    info.id = sqlite3_column_int(stmtQueryPathInfo, 0);
 
-        int r = sqlite3_step(stmtQueryPathInfo);
-        if (r == SQLITE_DONE) throw Error(format("path `%1%' is not valid") % path);
-        if (r != SQLITE_ROW) throwSQLiteError(db, "querying path in database");
+    const char * s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 1);
+    assert(s);
+    info.hash = parseHashField(path, s);
 
-        info.id = sqlite3_column_int(stmtQueryPathInfo, 0);
+    info.registrationTime = sqlite3_column_int(stmtQueryPathInfo, 2);
 
-        const char * s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 1);
-        assert(s);
-        info.hash = parseHashField(path, s);
+    s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 3);
+    if (s) info.deriver = s;
 
-        info.registrationTime = sqlite3_column_int(stmtQueryPathInfo, 2);
+    /* Note that narSize = NULL yields 0. */
+    info.narSize = sqlite3_column_int64(stmtQueryPathInfo, 4);
 
-        s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 3);
-        if (s) info.deriver = s;
+    /* Get the references. */
+    SQLiteStmtUse use2(stmtQueryReferences);
 
-        /* Note that narSize = NULL yields 0. */
-        info.narSize = sqlite3_column_int64(stmtQueryPathInfo, 4);
+    stmtQueryReferences.bind(info.id);
 
-        /* Get the references. */
-        SQLiteStmtUse use2(stmtQueryReferences);
+    while ((r = sqlite3_step(stmtQueryReferences)) == SQLITE_ROW) {
+        s = (const char *) sqlite3_column_text(stmtQueryReferences, 0);
+        assert(s);
+        info.references.insert(s);
+    }
 
-        stmtQueryReferences.bind(info.id);
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, format("error getting references of `%1%'") % path);
 
-        while ((r = sqlite3_step(stmtQueryReferences)) == SQLITE_ROW) {
-            s = (const char *) sqlite3_column_text(stmtQueryReferences, 0);
-            assert(s);
-            info.references.insert(s);
-        }
+    return true;
+}
 
-        if (r != SQLITE_DONE)
-            throwSQLiteError(db, format("error getting references of `%1%'") % path);
 
+ValidPathInfo LocalStore::queryPathInfo(const Path & path)
+{
+    assertStorePath(path);
+
+    PathInfoCache::Entry * entry = pathInfoCache.lookup(path, true);
+    if (entry) return entry->info;
+
+    retry_sqlite {
+        ValidPathInfo info;
+        if (!queryPathInfo_(path, info))
+            throw Error(format("path `%1%' is not valid") % path);
+        pathInfoCache.insert(info);
         return info;
     } end_retry_sqlite;
 }
 
 
+/* Query all paths in a single read transaction, so that SQLite
+   doesn't have to acquire and release the database lock for every
+   statement. */
+ValidPathInfoMap LocalStore::queryPathInfos(const PathSet & paths)
+{
+    ValidPathInfoMap infos;
+    PathSet missing;
+
+    foreach (PathSet::const_iterator, i, paths) {
+        assertStorePath(*i);
+        PathInfoCache::Entry * entry = pathInfoCache.lookup(*i, true);
+        if (entry) infos[*i] = entry->info; else missing.insert(*i);
+    }
+
+    if (missing.empty()) return infos;
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+        ValidPathInfoMap infos2(infos);
+        foreach (PathSet::const_iterator, i, missing) {
+            ValidPathInfo info;
+            if (queryPathInfo_(*i, info)) infos2[*i] = info;
+        }
+        txn.commit();
+        foreach (PathSet::const_iterator, i, missing) {
+            ValidPathInfoMap::iterator j = infos2.find(*i);
+            if (j != infos2.end()) pathInfoCache.insert(j->second);
+        }
+        return infos2;
+    } end_retry_sqlite;
+}
+
+
 /* Update path info in the database.  Currently only updates the
    narSize field. */
 void LocalStore::updatePathInfo(const ValidPathInfo & info)
 {
+    pathInfoCache.erase(info.path);
     SQLiteStmtUse use(stmtUpdatePathInfo);
     if (info.narSize != 0)
         stmtUpdatePathInfo.bind64(info.narSize);
@@ -889,8 +1025,13 @@ bool LocalStore::isValidPath_(const Path & path)
 
 bool LocalStore::isValidPath(const Path & path)
 {
+    if (pathInfoCache.lookup(path, false)) return true;
     retry_sqlite {
-        return isValidPath_(path);
+        if (!isValidPath_(path)) return false;
+        ValidPathInfo info;
+        info.path = path;
+        pathInfoCache.insert(info, false);
+        return true;
     } end_retry_sqlite;
 }
 
@@ -899,8 +1040,16 @@ PathSet LocalStore::queryValidPaths(const PathSet & paths)
 {
     retry_sqlite {
         PathSet res;
-        foreach (PathSet::const_iterator, i, paths)
-            if (isValidPath_(*i)) res.insert(*i);
+        foreach (PathSet::const_iterator, i, paths) {
+            if (pathInfoCache.lookup(*i, false))
+                res.insert(*i);
+            else if (isValidPath_(*i)) {
+                ValidPathInfo info;
+                info.path = *i;
+                pathInfoCache.insert(info, false);
+                res.insert(*i);
+            }
+        }
         return res;
     } end_retry_sqlite;
 }
@@ -928,6 +1077,43 @@ PathSet LocalStore::queryAllValidPaths()
 }
 
 
+Paths LocalStore::queryUnoptimisedPaths()
+{
+    retry_sqlite {
+        SQLiteStmt stmt;
+        stmt.create(db, "select path from ValidPaths where id not in (select id from OptimisedPaths);");
+
+        Paths res;
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char * s = (const char *) sqlite3_column_text(stmt, 0);
+            assert(s);
+            res.push_back(s);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "querying unoptimised paths");
+
+        return res;
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::markOptimised(const std::vector<Path> & paths)
+{
+    retry_sqlite {
+        SQLiteTxn txn(db);
+        foreach (std::vector<Path>::const_iterator, i, paths) {
+            SQLiteStmtUse use(stmtMarkOptimised);
+            stmtMarkOptimised.bind(*i);
+            if (sqlite3_step(stmtMarkOptimised) != SQLITE_DONE)
+                throwSQLiteError(db, format("marking path `%1%' as optimised") % *i);
+        }
+        txn.commit();
+    } end_retry_sqlite;
+}
+
+
 void LocalStore::queryReferences(const Path & path,
     PathSet & references)
 {
@@ -963,6 +1149,199 @@ void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 }
 
 
+/* Return the SQL query that computes the closure of the paths in
+   ClosureRoots.  Every kind of edge is a separate recursive select,
+   so that SQLite can use the indices on Refs and DerivationOutputs
+   rather than materialising all edges. */
+static string closureQuery(bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    string q = "with recursive Closure(id) as (select id from temp.ClosureRoots";
+
+    if (flipDirection) {
+        q += " union select referrer from Refs join Closure on reference = Closure.id";
+        if (includeOutputs)
+            q += " union select d.drv from Closure join ValidPaths p on p.id = Closure.id "
+                "join DerivationOutputs d on d.path = p.path";
+        if (includeDerivers)
+            q += " union select v.id from Closure join ValidPaths p on p.id = Closure.id "
+                "join DerivationOutputs d on d.drv = p.id join ValidPaths v on v.path = d.path "
+                "where v.deriver = p.path";
+    } else {
+        q += " union select reference from Refs join Closure on referrer = Closure.id";
+        if (includeOutputs)
+            q += " union select v.id from Closure join DerivationOutputs d on d.drv = Closure.id "
+                "join ValidPaths v on v.path = d.path";
+        if (includeDerivers)
+            q += " union select v.id from Closure join ValidPaths p on p.id = Closure.id "
+                "join ValidPaths v on v.path = p.deriver";
+    }
+
+    return q + ") select path from ValidPaths where id in (select id from Closure);";
+}
+
+
+PathSet LocalStore::queryClosure(const PathSet & paths,
+    bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* Recursive common table expressions require SQLite 3.8.3, and
+       more than one recursive select requires SQLite 3.34.0.  With
+       older versions, query the edges of every path separately. */
+    if (sqlite3_libversion_number() < (includeOutputs || includeDerivers ? 3034000 : 3008003))
+        return StoreAPI::queryClosure(paths, flipDirection, includeOutputs, includeDerivers);
+
+    if (paths.empty()) return PathSet();
+
+    foreach (PathSet::const_iterator, i, paths) assertStorePath(*i);
+
+    if (!stmtAddClosureRoot.stmt) {
+        if (sqlite3_exec(db, "create temp table if not exists ClosureRoots (id integer primary key not null);", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "creating closure roots table");
+        stmtAddClosureRoot.create(db,
+            "insert or ignore into temp.ClosureRoots (id) values (?);");
+    }
+
+    SQLiteStmt & stmtQueryClosure(this->stmtQueryClosure[
+        (flipDirection ? 4 : 0) | (includeOutputs ? 2 : 0) | (includeDerivers ? 1 : 0)]);
+    if (!stmtQueryClosure.stmt)
+        stmtQueryClosure.create(db, closureQuery(flipDirection, includeOutputs, includeDerivers));
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+
+        if (sqlite3_exec(db, "delete from temp.ClosureRoots;", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "clearing closure roots table");
+
+        foreach (PathSet::const_iterator, i, paths) {
+            SQLiteStmtUse use(stmtAddClosureRoot);
+            stmtAddClosureRoot.bind64(queryValidPathId(*i));
+            if (sqlite3_step(stmtAddClosureRoot) != SQLITE_DONE)
+                throwSQLiteError(db, "adding closure root");
+        }
+
+        PathSet closure;
+        {
+            SQLiteStmtUse use(stmtQueryClosure);
+            int r;
+            while ((r = sqlite3_step(stmtQueryClosure)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(stmtQueryClosure, 0);
+                assert(s);
+                closure.insert(s);
+            }
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "querying closure");
+        }
+
+        txn.commit();
+        return closure;
+    } end_retry_sqlite;
+}
+
+
+/* Add the edges returned by `query' (pairs of ValidPaths ids) to
+   `edges'. */
+static void queryEdges(sqlite3 * db, const string & query,
+    const std::unordered_map<long long, PathId> & ids, PathGraph::Edges & edges)
+{
+    SQLiteStmt stmt;
+    stmt.create(db, query);
+
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        std::unordered_map<long long, PathId>::const_iterator
+            from = ids.find(sqlite3_column_int64(stmt, 0)),
+            to = ids.find(sqlite3_column_int64(stmt, 1));
+        assert(from != ids.end() && to != ids.end());
+        if (from->second != to->second)
+            edges.push_back(std::pair<PathId, PathId>(from->second, to->second));
+    }
+
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "querying the reference graph");
+}
+
+
+ValidPathInfos LocalStore::queryValidPathsByAge(time_t time,
+    unsigned long long id, unsigned int limit)
+{
+    retry_sqlite {
+        ValidPathInfos infos;
+
+        /* First the remaining paths with the same registration time,
+           then the paths registered later. */
+        for (int n = 0; n < 2 && infos.size() < limit; ++n) {
+            SQLiteStmt & stmt(stmtQueryPathsByAge[n]);
+            SQLiteStmtUse use(stmt);
+            stmt.bind64(time);
+            if (n == 0) stmt.bind64(id);
+            stmt.bind64(limit - infos.size());
+
+            int r;
+            while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+                ValidPathInfo info;
+                info.id = sqlite3_column_int64(stmt, 0);
+                const char * s = (const char *) sqlite3_column_text(stmt, 1);
+                assert(s);
+                info.path = s;
+                info.registrationTime = sqlite3_column_int64(stmt, 2);
+                infos.push_back(info);
+            }
+
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "querying valid paths by registration time");
+        }
+
+        return infos;
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::queryReferenceGraph(PathIds & ids, PathGraph & graph,
+    std::vector<PathId> & valid, bool keepOutputs, bool keepDerivations)
+{
+    retry_sqlite {
+        SQLiteTxn txn(db);
+
+        std::unordered_map<long long, PathId> dbIds;
+        valid.clear();
+
+        {
+            SQLiteStmt stmt;
+            stmt.create(db, "select id, path from ValidPaths;");
+            int r;
+            while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(stmt, 1);
+                assert(s);
+                PathId id = ids.intern(s);
+                dbIds[sqlite3_column_int64(stmt, 0)] = id;
+                valid.push_back(id);
+            }
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "querying valid paths");
+        }
+
+        PathGraph::Edges edges;
+
+        queryEdges(db, "select referrer, reference from Refs;", dbIds, edges);
+
+        /* A derivation keeps its valid outputs alive. */
+        if (keepOutputs)
+            queryEdges(db, "select d.drv, v.id from DerivationOutputs d "
+                "join ValidPaths v on v.path = d.path;", dbIds, edges);
+
+        /* An output keeps the derivation that produced it alive. */
+        if (keepDerivations)
+            queryEdges(db, "select v.id, d.drv from DerivationOutputs d "
+                "join ValidPaths v on v.path = d.path "
+                "join ValidPaths w on w.id = d.drv where v.deriver = w.path;", dbIds, edges);
+
+        txn.commit();
+
+        graph.setEdges(ids.size(), edges);
+        return;
+    } end_retry_sqlite;
+}
+
+
 Path LocalStore::queryDeriver(const Path & path)
 {
     return queryPathInfo(path).deriver;
@@ -1276,44 +1655,53 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
      * expense of some speed of the path registering operation. */
     if (settings.syncBeforeRegistering) sync();
 
-    retry_sqlite {
-        SQLiteTxn txn(db);
-        PathSet paths;
-
-        foreach (ValidPathInfos::const_iterator, i, infos) {
-            assert(i->hash.type == htSHA256);
-            if (isValidPath_(i->path))
-                updatePathInfo(*i);
-            else
-                addValidPath(*i, false);
-            paths.insert(i->path);
-        }
-
-        foreach (ValidPathInfos::const_iterator, i, infos) {
-            unsigned long long referrer = queryValidPathId(i->path);
-            foreach (PathSet::iterator, j, i->references)
-                addReference(referrer, queryValidPathId(*j));
-        }
+    try {
+        retry_sqlite {
+            SQLiteTxn txn(db);
+            PathSet paths;
+
+            foreach (ValidPathInfos::const_iterator, i, infos) {
+                assert(i->hash.type == htSHA256);
+                if (isValidPath_(i->path))
+                    updatePathInfo(*i);
+                else
+                    addValidPath(*i, false);
+                paths.insert(i->path);
+            }
 
-        /* Check that the derivation outputs are correct.  We can't do
-           this in addValidPath() above, because the references might
-           not be valid yet. */
-        foreach (ValidPathInfos::const_iterator, i, infos)
-            if (isDerivation(i->path)) {
-                // FIXME: inefficient; we already loaded the
-                // derivation in addValidPath().
-                Derivation drv = readDerivation(i->path);
-                checkDerivationOutputs(i->path, drv);
+            foreach (ValidPathInfos::const_iterator, i, infos) {
+                unsigned long long referrer = queryValidPathId(i->path);
+                foreach (PathSet::iterator, j, i->references)
+                    addReference(referrer, queryValidPathId(*j));
             }
 
-        /* Do a topological sort of the paths.  This will throw an
-           error if a cycle is detected and roll back the
-           transaction.  Cycles can only occur when a derivation
-           has multiple outputs. */
-        topoSortPaths(*this, paths);
+            /* Check that the derivation outputs are correct.  We can't do
+               this in addValidPath() above, because the references might
+               not be valid yet. */
+            foreach (ValidPathInfos::const_iterator, i, infos)
+                if (isDerivation(i->path)) {
+                    // FIXME: inefficient; we already loaded the
+                    // derivation in addValidPath().
+                    Derivation drv = readDerivation(i->path);
+                    checkDerivationOutputs(i->path, drv);
+                }
 
-        txn.commit();
-    } end_retry_sqlite;
+            /* Do a topological sort of the paths.  This will throw an
+               error if a cycle is detected and roll back the
+               transaction.  Cycles can only occur when a derivation
+               has multiple outputs. */
+            topoSortPaths(*this, paths);
+
+            txn.commit();
+        } end_retry_sqlite;
+    } catch (...) {
+        /* The queries in topoSortPaths() may have cached paths that
+           are no longer valid now that the transaction has been
+           rolled back. */
+        foreach (ValidPathInfos::const_iterator, i, infos)
+            pathInfoCache.erase(i->path);
+        throw;
+    }
 }
 
 
@@ -1324,6 +1712,7 @@ void LocalStore::invalidatePath(const Path & path)
     debug(format("invalidating path `%1%'") % path);
 
     drvHashes.erase(path);
+    pathInfoCache.erase(path);
 
     SQLiteStmtUse use(stmtInvalidatePath);
 
@@ -1337,11 +1726,57 @@ void LocalStore::invalidatePath(const Path & path)
 }
 
 
-Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
+/* Unpack the NAR from `source' to `unpacked', hashing it on the way.
+   Sets `h' to the hash that determines the store path.  This doesn't
+   touch the database, so it can run on a thread of its own. */
+static void unpackNAR(Source & source, const Path & unpacked,
+    bool recursive, HashType hashAlgo, Hash & h, HashResult & narHash)
+{
+    HashSink narHashSink(htSHA256), hashSink(hashAlgo);
+    TeeSource narSource(source, narHashSink);
+    TeeSource hashSource(narSource, hashSink);
+    bool needHashSource = recursive && hashAlgo != htSHA256;
+    restorePath(unpacked, needHashSource ? (Source &) hashSource : (Source &) narSource);
+
+    narHash = narHashSink.finish();
+
+    if (recursive)
+        h = needHashSource ? hashSink.finish().first : narHash.first;
+    else {
+        /* Flat paths are hashed over the contents of the file, and
+           are never executable. */
+        struct stat st;
+        if (lstat(unpacked.c_str(), &st))
+            throw SysError(format("getting attributes of path `%1%'") % unpacked);
+        if (!S_ISREG(st.st_mode)) throw Error("regular file expected");
+        if (chmod(unpacked.c_str(), 0644) == -1)
+            throw SysError(format("changing mode of `%1%'") % unpacked);
+        h = hashFile(hashAlgo, unpacked);
+    }
+}
+
+
+Path LocalStore::addToStoreFromNAR(Source & source, const string & name,
     bool recursive, HashType hashAlgo, bool repair)
 {
-    Hash h = hashString(hashAlgo, dump);
+    /* Unpack the NAR into a temporary directory in the store, since
+       we don't know the store path yet. */
+    Path tmpDir = createTempDirInStore();
+    AutoDelete delTmp(tmpDir);
+    Path unpacked = tmpDir + "/unpacked";
+
+    Hash h;
+    HashResult narHash;
+    unpackNAR(source, unpacked, recursive, hashAlgo, h, narHash);
+
+    return addUnpackedToStore(unpacked, name, recursive, hashAlgo, h, narHash, repair);
+}
+
 
+Path LocalStore::addUnpackedToStore(const Path & unpacked, const string & name,
+    bool recursive, HashType hashAlgo, const Hash & h, const HashResult & narHash,
+    bool repair)
+{
     Path dstPath = makeFixedOutputPath(recursive, hashAlgo, h, name);
 
     addTempRoot(dstPath);
@@ -1357,24 +1792,16 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
 
             if (pathExists(dstPath)) deletePath(dstPath);
 
-            if (recursive) {
-                StringSource source(dump);
-                restorePath(dstPath, source);
-            } else
-                writeFile(dstPath, dump);
+            if (rename(unpacked.c_str(), dstPath.c_str()) == -1)
+                throw SysError(format("cannot move `%1%' to `%2%'") % unpacked % dstPath);
 
             canonicalisePathMetaData(dstPath, -1);
 
             /* Register the SHA-256 hash of the NAR serialisation of
-               the path in the database.  We may just have computed it
-               above (if called with recursive == true and hashAlgo ==
-               sha256); otherwise, compute it here. */
-            HashResult hash;
-            if (recursive) {
-                hash.first = hashAlgo == htSHA256 ? h : hashString(htSHA256, dump);
-                hash.second = dump.size();
-            } else
-                hash = hashPath(htSHA256, dstPath);
+               the path in the database.  For flat files, it's not the
+               NAR we read, since that may have had the executable
+               bit set. */
+            HashResult hash = recursive ? narHash : hashPath(htSHA256, dstPath);
 
             optimisePath(dstPath); // FIXME: combine with hashPath()
 
@@ -1398,16 +1825,105 @@ Path LocalStore::addToStore(const Path & _srcPath,
     Path srcPath(absPath(_srcPath));
     debug(format("adding `%1%' to the store") % srcPath);
 
-    /* Read the whole path into memory. This is not a very scalable
-       method for very large paths, but `copyPath' is mainly used for
-       small files. */
-    StringSink sink;
-    if (recursive)
-        dumpPath(srcPath, sink, filter);
-    else
-        sink.s = readFile(srcPath);
+    /* A filter may call back into the caller (e.g. the evaluator for
+       builtins.filterSource), so it must run on this thread, and only
+       once per file.  So serialise a filtered path on this thread and
+       unpack it into a temporary directory on another one, which
+       computes the store path on the way. */
+    if (recursive && &filter != &defaultPathFilter) {
+        Path tmpDir = createTempDirInStore();
+        AutoDelete delTmp(tmpDir);
+        Path unpacked = tmpDir + "/unpacked";
+
+        Pipe pipe;
+        pipe.create();
+
+        Hash h;
+        HashResult narHash;
+        std::exception_ptr unpackError;
+        std::thread unpacker([&]() {
+            try {
+                FdSource source(pipe.readSide);
+                unpackNAR(source, unpacked, recursive, hashAlgo, h, narHash);
+            } catch (...) {
+                unpackError = std::current_exception();
+            }
+            pipe.readSide.close();
+        });
+
+        try {
+            FdSink sink(pipe.writeSide);
+            dumpPath(srcPath, sink, filter);
+            sink.flush();
+        } catch (SysError & e) {
+            /* If the unpacker stopped early, report why. */
+            pipe.writeSide.close();
+            unpacker.join();
+            if (e.errNo == EPIPE && unpackError) std::rethrow_exception(unpackError);
+            throw;
+        } catch (...) {
+            /* E.g. the filter failed; the unpacker will get EOF. */
+            pipe.writeSide.close();
+            unpacker.join();
+            throw;
+        }
+
+        pipe.writeSide.close();
+        unpacker.join();
+        if (unpackError) std::rethrow_exception(unpackError);
+
+        return addUnpackedToStore(unpacked, baseNameOf(srcPath), recursive, hashAlgo, h, narHash, repair);
+    }
+
+    /* Compute the store path first, so that nothing is copied if the
+       path is already valid (which is the common case, e.g. for
+       sources referenced by Nix expressions).  The price is that a
+       new path is read twice. */
+    Path dstPath = computeStorePathForPath(srcPath, recursive, hashAlgo, filter).first;
+    addTempRoot(dstPath);
+    if (!repair && isValidPath(dstPath)) return dstPath;
+
+    /* Otherwise, serialise the path on another thread and unpack it
+       into the store on this one, through a pipe.  This needs
+       constant memory regardless of the size of the path. */
+    Pipe pipe;
+    pipe.create();
+
+    std::exception_ptr dumpError;
+    std::thread dumper([&]() {
+        try {
+            FdSink sink(pipe.writeSide);
+            dumpPath(srcPath, sink, filter);
+            sink.flush();
+        } catch (...) {
+            dumpError = std::current_exception();
+        }
+        pipe.writeSide.close();
+    });
+
+    Path path;
+    try {
+        FdSource source(pipe.readSide);
+        path = addToStoreFromNAR(source, baseNameOf(srcPath), recursive, hashAlgo, repair);
+    } catch (EndOfFile & e) {
+        /* The dumper stopped early, so report why. */
+        dumper.join();
+        if (dumpError) std::rethrow_exception(dumpError);
+        throw;
+    } catch (...) {
+        /* Make the dumper fail if it's still writing. */
+        pipe.readSide.close();
+        dumper.join();
+        throw;
+    }
+
+    dumper.join();
+    if (dumpError) std::rethrow_exception(dumpError);
 
-    return addToStoreFromDump(sink.s, baseNameOf(srcPath), recursive, hashAlgo, repair);
+    if (path != dstPath)
+        throw Error(format("path `%1%' changed while it was being added to the store") % srcPath);
+
+    return path;
 }
 
 
@@ -1489,8 +2005,7 @@ void LocalStore::exportPath(const Path & path, bool sign,
     printMsg(lvlInfo, format("exporting path `%1%'") % path);
 
     addTempRoot(path);
-    if (!isValidPath(path))
-        throw Error(format("path `%1%' is not valid") % path);
+    ValidPathInfo info = queryPathInfo(path);
 
     HashAndWriteSink hashAndWriteSink(sink);
 
@@ -1500,21 +2015,17 @@ void LocalStore::exportPath(const Path & path, bool sign,
        filesystem corruption from spreading to other machines.
        Don't complain if the stored hash is zero (unknown). */
     Hash hash = hashAndWriteSink.currentHash();
-    Hash storedHash = queryPathHash(path);
-    if (hash != storedHash && storedHash != Hash(storedHash.type))
+    if (hash != info.hash && info.hash != Hash(info.hash.type))
         throw Error(format("hash of path `%1%' has changed from `%2%' to `%3%'!") % path
-            % printHash(storedHash) % printHash(hash));
+            % printHash(info.hash) % printHash(hash));
 
     writeInt(EXPORT_MAGIC, hashAndWriteSink);
 
     writeString(path, hashAndWriteSink);
 
-    PathSet references;
-    queryReferences(path, references);
-    writeStrings(references, hashAndWriteSink);
+    writeStrings(info.references, hashAndWriteSink);
 
-    Path deriver = queryDeriver(path);
-    writeString(deriver, hashAndWriteSink);
+    writeString(info.deriver, hashAndWriteSink);
 
     if (sign) {
         Hash hash = hashAndWriteSink.currentHash();
@@ -1550,9 +2061,9 @@ struct HashAndReadSource : Source
     Source & readSource;
     HashSink hashSink;
     bool hashing;
-    HashAndReadSource(Source & readSource) : readSource(readSource), hashSink(htSHA256)
+    HashAndReadSource(Source & readSource, bool hashing = true)
+        : readSource(readSource), hashSink(htSHA256), hashing(hashing)
     {
-        hashing = true;
     }
     size_t read(unsigned char * data, size_t len)
     {
@@ -1560,6 +2071,10 @@ struct HashAndReadSource : Source
         if (hashing) hashSink(data, n);
         return n;
     }
+    unsigned long long copyToFd(int fd, unsigned long long len)
+    {
+        return hashing ? 0 : readSource.copyToFd(fd, len);
+    }
 };
 
 
@@ -1581,7 +2096,10 @@ Path LocalStore::createTempDirInStore()
 
 Path LocalStore::importPath(bool requireSignature, Source & source)
 {
-    HashAndReadSource hashAndReadSource(source);
+    /* The hash is only needed to check the signature.  Without it,
+       the contents of files can be copied straight from the source
+       to the store. */
+    HashAndReadSource hashAndReadSource(source, requireSignature);
 
     /* We don't yet know what store path this archive contains (the
        store path follows the archive data proper), and besides, we
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <string>
+#include <list>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "store-api.hh"
 #include "util.hh"
 #include "pathlocks.hh"
+#include "path-ids.hh"
+#include "archive.hh"
 
 
 class sqlite3;
@@ -18,8 +22,8 @@ namespace nix {
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
-   Nix 1.0.  Version 7 is Nix 1.3. */
-const int nixSchemaVersion = 7;
+   Nix 1.0.  Version 7 is Nix 1.3.  Version 8 is Nix 1.9. */
+const int nixSchemaVersion = 8;
 
 
 extern string drvsLogDir;
@@ -80,6 +84,44 @@ struct SQLiteStmt
 };
 
 
+/* A bounded in-memory cache of the info of valid paths, evicted in
+   least-recently-used order.  An entry may record only that a path
+   is valid, without the rest of its info.  Invalid paths are not
+   cached, since other processes may register them at any time.
+   Conversely, the garbage collector of another process may delete a
+   cached path at any time, so a path's entry is dropped when it gets
+   a temporary root (see addTempRoot()). */
+struct PathInfoCache
+{
+    struct Entry
+    {
+        ValidPathInfo info;
+        bool haveInfo;
+        std::list<Path>::iterator lru;
+    };
+
+    typedef std::unordered_map<Path, Entry> Entries;
+    Entries entries;
+    std::list<Path> lru;
+
+    size_t maxSize;
+
+    /* Statistics. */
+    unsigned long hits, misses;
+
+    PathInfoCache() : maxSize(0), hits(0), misses(0) { }
+
+    /* Return the entry for `path', or 0 if there is none.  If
+       `needInfo' is set, entries that only record validity don't
+       count. */
+    Entry * lookup(const Path & path, bool needInfo);
+
+    void insert(const ValidPathInfo & info, bool haveInfo = true);
+
+    void erase(const Path & path);
+};
+
+
 class LocalStore : public StoreAPI
 {
 private:
@@ -106,12 +148,17 @@ public:
 
     ValidPathInfo queryPathInfo(const Path & path);
 
+    ValidPathInfoMap queryPathInfos(const PathSet & paths);
+
     Hash queryPathHash(const Path & path);
 
     void queryReferences(const Path & path, PathSet & references);
 
     void queryReferrers(const Path & path, PathSet & referrers);
 
+    PathSet queryClosure(const PathSet & paths, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false);
+
     Path queryDeriver(const Path & path);
 
     PathSet queryValidDerivers(const Path & path);
@@ -134,11 +181,11 @@ public:
         bool recursive = true, HashType hashAlgo = htSHA256,
         PathFilter & filter = defaultPathFilter, bool repair = false);
 
-    /* Like addToStore(), but the contents of the path are contained
-       in `dump', which is either a NAR serialisation (if recursive ==
-       true) or simply the contents of a regular file (if recursive ==
-       false). */
-    Path addToStoreFromDump(const string & dump, const string & name,
+    /* Like addToStore(), but the contents of the path are read from
+       `source' as a NAR serialisation.  If recursive == false, it must
+       contain a single regular file.  The NAR is unpacked into the
+       store as it is read, so it is never held in memory. */
+    Path addToStoreFromNAR(Source & source, const string & name,
         bool recursive = true, HashType hashAlgo = htSHA256, bool repair = false);
 
     Path addTextToStore(const string & name, const string & s,
@@ -170,6 +217,10 @@ public:
     /* Optimise a single store path. */
     void optimisePath(const Path & path);
 
+    /* Optimise a single store path, given the hashes of its files
+       from dumpPath(), rather than reading them again. */
+    void optimisePath(const Path & path, const FileHashes & files);
+
     /* Check the integrity of the Nix store.  Returns true if errors
        remain. */
     bool verifyStore(bool checkContents, bool repair);
@@ -235,6 +286,17 @@ private:
     SQLiteStmt stmtQueryValidDerivers;
     SQLiteStmt stmtQueryDerivationOutputs;
     SQLiteStmt stmtQueryPathFromHashPart;
+    SQLiteStmt stmtAddClosureRoot;
+    SQLiteStmt stmtQueryPathsByAge[2];
+    SQLiteStmt stmtMarkOptimised;
+
+    /* The closure queries, indexed by the flags passed to
+       queryClosure().  These are prepared on first use. */
+    SQLiteStmt stmtQueryClosure[8];
+
+    /* Cache for isValidPath(), queryPathInfo() and the queries
+       built on them. */
+    PathInfoCache pathInfoCache;
 
     /* Cache for pathContentsGood(). */
     std::map<Path, bool> pathContentsGoodCache;
@@ -267,6 +329,12 @@ private:
 
     void updatePathInfo(const ValidPathInfo & info);
 
+    /* Move the path `unpacked', whose hash is `h', to the store (unless
+       the resulting path is already valid), and register it. */
+    Path addUnpackedToStore(const Path & unpacked, const string & name,
+        bool recursive, HashType hashAlgo, const Hash & h,
+        const HashResult & narHash, bool repair);
+
     void upgradeStore6();
     void upgradeStore7();
     PathSet queryValidPathsOld();
@@ -274,11 +342,31 @@ private:
 
     struct GCState;
 
+    /* Load the graph of all valid paths, with an edge from every
+       path to the paths that it keeps alive, i.e. its references
+       and, depending on the flags, the outputs or derivers it keeps.
+       The ids of the valid paths are stored in `valid'. */
+    void queryReferenceGraph(PathIds & ids, PathGraph & graph,
+        std::vector<PathId> & valid, bool keepOutputs, bool keepDerivations);
+
+    void markLivePaths(GCState & state, const PathSet & roots);
+
+    /* Return up to `limit' valid paths that were registered after
+       the path with registration time `time' and id `id', oldest
+       first.  Only the path, registration time and id are filled
+       in. */
+    ValidPathInfos queryValidPathsByAge(time_t time,
+        unsigned long long id, unsigned int limit);
+
+    void tryToDeleteOldest(GCState & state);
+
+    void rankGarbage(GCState & state, vector<Path> & entries);
+
     void deleteGarbage(GCState & state, const Path & path);
 
     void tryToDelete(GCState & state, const Path & path);
 
-    bool canReachRoot(GCState & state, PathSet & visited, const Path & path);
+    bool canReachRoot(GCState & state, std::unordered_set<PathId> & visited, PathId id);
 
     void deletePathRecursive(GCState & state, const Path & path);
 
@@ -306,10 +394,18 @@ private:
 
     InodeHash loadInodeHash();
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
+    void optimisePath_(OptimiseStats & stats, const Path & path, const InodeHash & inodeHash);
+    void optimiseFile_(OptimiseStats & stats, const Path & path,
+        const struct stat & st, const Hash & hash);
+
+    /* Return the valid paths that optimiseStore() hasn't finished
+       with yet, and record that it has finished with `paths'. */
+    Paths queryUnoptimisedPaths();
+    void markOptimised(const std::vector<Path> & paths);
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(const Path & path);
+    bool queryPathInfo_(const Path & path, ValidPathInfo & info);
     void queryReferrers_(const Path & path, PathSet & referrers);
 };
 
@@ -331,6 +427,15 @@ void canonicalisePathMetaData(const Path & path, uid_t fromUid);
 
 void canonicaliseTimestampAndPermissions(const Path & path);
 
+/* Return the number of bytes available to unprivileged users on the
+   file system containing the store, or ULLONG_MAX if unknown. */
+unsigned long long getStoreFreeSpace();
+
+/* Return the number of bytes of the file open on `fd' that are stored
+   in data blocks shared with other files, or 0 if the file system
+   can't tell. */
+unsigned long long getSharedBytes(int fd);
+
 MakeError(PathInUse, Error);
 
 }
@@ -2,6 +2,7 @@
 #include "store-api.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "path-ids.hh"
 
 
 namespace nix {
@@ -19,43 +20,9 @@ void computeFSClosure(StoreAPI & store, const Path & path,
     PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
     if (paths.find(path) != paths.end()) return;
-    paths.insert(path);
-
-    PathSet edges;
-
-    if (flipDirection) {
-        store.queryReferrers(path, edges);
-
-        if (includeOutputs) {
-            PathSet derivers = store.queryValidDerivers(path);
-            foreach (PathSet::iterator, i, derivers)
-                edges.insert(*i);
-        }
-
-        if (includeDerivers && isDerivation(path)) {
-            PathSet outputs = store.queryDerivationOutputs(path);
-            foreach (PathSet::iterator, i, outputs)
-                if (store.isValidPath(*i) && store.queryDeriver(*i) == path)
-                    edges.insert(*i);
-        }
-
-    } else {
-        store.queryReferences(path, edges);
-
-        if (includeOutputs && isDerivation(path)) {
-            PathSet outputs = store.queryDerivationOutputs(path);
-            foreach (PathSet::iterator, i, outputs)
-                if (store.isValidPath(*i)) edges.insert(*i);
-        }
-
-        if (includeDerivers) {
-            Path deriver = store.queryDeriver(path);
-            if (store.isValidPath(deriver)) edges.insert(deriver);
-        }
-    }
-
-    foreach (PathSet::iterator, i, edges)
-        computeFSClosure(store, *i, paths, flipDirection, includeOutputs, includeDerivers);
+    PathSet closure = store.queryClosure(singleton<PathSet>(path),
+        flipDirection, includeOutputs, includeDerivers);
+    paths.insert(closure.begin(), closure.end());
 }
 
 
@@ -181,38 +148,44 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
 }
 
 
-static void dfsVisit(StoreAPI & store, const PathSet & paths,
-    const Path & path, PathSet & visited, Paths & sorted,
-    PathSet & parents)
+static void dfsVisit(StoreAPI & store, const PathIds & ids,
+    PathId id, PathIdSet & visited, Paths & sorted,
+    PathIdSet & parents)
 {
-    if (parents.find(path) != parents.end())
+    const Path & path(ids[id]);
+
+    if (parents.contains(id))
         throw BuildError(format("cycle detected in the references of `%1%'") % path);
 
-    if (visited.find(path) != visited.end()) return;
-    visited.insert(path);
-    parents.insert(path);
+    if (!visited.insert(id)) return;
+    parents.insert(id);
 
     PathSet references;
     if (store.isValidPath(path))
         store.queryReferences(path, references);
 
-    foreach (PathSet::iterator, i, references)
+    foreach (PathSet::iterator, i, references) {
         /* Don't traverse into paths that don't exist.  That can
            happen due to substitutes for non-existent paths. */
-        if (*i != path && paths.find(*i) != paths.end())
-            dfsVisit(store, paths, *i, visited, sorted, parents);
+        PathId ref = ids.lookup(*i);
+        if (ref != id && ref != PathIds::none)
+            dfsVisit(store, ids, ref, visited, sorted, parents);
+    }
 
     sorted.push_front(path);
-    parents.erase(path);
+    parents.erase(id);
 }
 
 
 Paths topoSortPaths(StoreAPI & store, const PathSet & paths)
 {
+    PathIds ids;
+    foreach (PathSet::const_iterator, i, paths) ids.intern(*i);
+
     Paths sorted;
-    PathSet visited, parents;
-    foreach (PathSet::const_iterator, i, paths)
-        dfsVisit(store, paths, *i, visited, sorted, parents);
+    PathIdSet visited, parents;
+    for (PathId id = 0; id < ids.size(); ++id)
+        dfsVisit(store, ids, id, visited, sorted, parents);
     return sorted;
 }
 
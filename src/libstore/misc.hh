@@ -16,7 +16,8 @@ Derivation derivationFromPath(StoreAPI & store, const Path & drvPath);
    `flipDirection' is true, the set of paths that can reach
    `storePath' is returned; that is, the closures under the
    `referrers' relation instead of the `references' relation is
-   returned. */
+   returned.  To get the closure of several paths, use
+   StoreAPI::queryClosure() directly, which needs only one query. */
 void computeFSClosure(StoreAPI & store, const Path & path,
     PathSet & paths, bool flipDirection = false,
     bool includeOutputs = false, bool includeDerivers = false);
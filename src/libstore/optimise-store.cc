@@ -4,11 +4,28 @@
 #include "local-store.hh"
 #include "globals.hh"
 
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
+
+#if HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/ioctl.h>
+#endif
+
+#if defined(FIDEDUPERANGE) && defined(FS_IOC_FIEMAP)
+#define CAN_DEDUPE 1
+#endif
 
 
 namespace nix {
@@ -88,7 +105,137 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
 }
 
 
-void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHash & inodeHash)
+static bool useReflinks()
+{
+    if (settings.optimiseStoreMethod == "hardlink") return false;
+    if (settings.optimiseStoreMethod == "reflink") return true;
+    throw Error(format("configuration setting `optimise-store-method' should be either `hardlink' or `reflink', not `%1%'")
+        % settings.optimiseStoreMethod);
+}
+
+
+unsigned long long getSharedBytes(int fd)
+{
+    unsigned long long shared = 0;
+
+#if CAN_DEDUPE
+    const unsigned int maxExtents = 64;
+    std::vector<char> buf(sizeof(struct fiemap) + maxExtents * sizeof(struct fiemap_extent));
+    struct fiemap * map = (struct fiemap *) &buf[0];
+
+    __u64 start = 0;
+    while (true) {
+        memset(map, 0, buf.size());
+        map->fm_start = start;
+        map->fm_length = FIEMAP_MAX_OFFSET - start;
+        map->fm_flags = FIEMAP_FLAG_SYNC;
+        map->fm_extent_count = maxExtents;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, map) == -1) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY) return 0;
+            throw SysError("getting the extents of a file");
+        }
+
+        if (map->fm_mapped_extents == 0) break;
+
+        bool last = false;
+        for (unsigned int n = 0; n < map->fm_mapped_extents; ++n) {
+            struct fiemap_extent & extent(map->fm_extents[n]);
+            if (extent.fe_flags & FIEMAP_EXTENT_SHARED) shared += extent.fe_length;
+            if (extent.fe_flags & FIEMAP_EXTENT_LAST) last = true;
+            start = extent.fe_logical + extent.fe_length;
+        }
+        if (last) break;
+    }
+#endif
+
+    return shared;
+}
+
+
+#if CAN_DEDUPE
+/* The largest range passed to a single FIDEDUPERANGE call.  Some file
+   systems (e.g. Btrfs) silently clamp larger requests to 16 MiB. */
+static const unsigned long long maxDedupeRange = 16 * 1024 * 1024;
+#endif
+
+
+/* Make `path' share its data blocks with `linkPath', which has the
+   same contents.  The kernel compares the contents itself, and the
+   files keep their own inodes and metadata.  Ranges are deduplicated
+   one at a time, so large files are handled in pieces, including the
+   partial block at the end. */
+static void dedupeFile(OptimiseStats & stats, const Path & path, const Path & linkPath, const struct stat & st)
+{
+#if CAN_DEDUPE
+    AutoCloseFD src = open(linkPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src == -1) {
+        /* The garbage collector may have removed it just now. */
+        if (errno == ENOENT) return;
+        throw SysError(format("opening `%1%'") % linkPath);
+    }
+
+    AutoCloseFD dst = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dst == -1)
+        throw SysError(format("opening `%1%'") % path);
+
+    unsigned long long sharedBefore = getSharedBytes(dst);
+
+    std::vector<char> buf(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+    struct file_dedupe_range * range = (struct file_dedupe_range *) &buf[0];
+
+    unsigned long long offset = 0, size = st.st_size;
+    while (offset < size) {
+        checkInterrupt();
+        memset(range, 0, buf.size());
+        range->src_offset = offset;
+        range->src_length = std::min(size - offset, maxDedupeRange);
+        range->dest_count = 1;
+        range->info[0].dest_fd = dst;
+        range->info[0].dest_offset = offset;
+
+        if (ioctl(src, FIDEDUPERANGE, range) == -1) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+                throw Error(format("the file system containing `%1%' does not support `optimise-store-method = reflink'") % path);
+            throw SysError(format("deduplicating `%1%' against `%2%'") % path % linkPath);
+        }
+
+        if (range->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) {
+            printMsg(lvlError, format("`%1%' and `%2%' differ, not deduplicating") % path % linkPath);
+            return;
+        }
+        if (range->info[0].status < 0) {
+            errno = -range->info[0].status;
+            throw SysError(format("deduplicating `%1%' against `%2%'") % path % linkPath);
+        }
+        if (range->info[0].bytes_deduped == 0) break;
+
+        offset += range->info[0].bytes_deduped;
+    }
+
+    unsigned long long sharedAfter = getSharedBytes(dst);
+    if (sharedAfter <= sharedBefore) {
+        printMsg(lvlDebug, format("`%1%' already shares its data with `%2%'") % path % linkPath);
+        return;
+    }
+
+    printMsg(lvlTalkative, format("deduplicated `%1%' against `%2%'") % path % linkPath);
+
+    stats.filesLinked++;
+    stats.bytesFreed += sharedAfter - sharedBefore;
+    stats.blocksFreed += (sharedAfter - sharedBefore) / 512;
+#else
+    throw Error("`optimise-store-method = reflink' is not supported on this platform");
+#endif
+}
+
+
+/* Used to give temporary links unique names, since several threads
+   may be linking files at the same time. */
+static std::atomic<unsigned long> tempLinkCounter(0);
+
+
+void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, const InodeHash & inodeHash)
 {
     checkInterrupt();
 
@@ -137,15 +284,19 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
     Hash hash = hashPath(htSHA256, path).first;
     printMsg(lvlDebug, format("`%1%' has hash `%2%'") % path % printHash(hash));
 
+    optimiseFile_(stats, path, st, hash);
+}
+
+
+void LocalStore::optimiseFile_(OptimiseStats & stats, const Path & path,
+    const struct stat & st, const Hash & hash)
+{
     /* Check if this is a known hash. */
     Path linkPath = linksDir + "/" + printHash32(hash);
 
     if (!pathExists(linkPath)) {
         /* Nope, create a hard link in the links directory. */
-        if (link(path.c_str(), linkPath.c_str()) == 0) {
-            inodeHash.insert(st.st_ino);
-            return;
-        }
+        if (link(path.c_str(), linkPath.c_str()) == 0) return;
         if (errno != EEXIST)
             throw SysError(format("cannot link `%1%' to `%2%'") % linkPath % path);
         /* Fall through if another process created ‘linkPath’ before
@@ -163,6 +314,16 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
         return;
     }
 
+    /* With reflinks, the entry in the links directory is just the
+       first copy seen, and other copies share its data blocks rather
+       than its inode.  This avoids the link count limit and leaves
+       their metadata alone.  Symlinks have no data blocks, so they
+       are left as they are. */
+    if (useReflinks()) {
+        if (S_ISREG(st.st_mode)) dedupeFile(stats, path, linkPath, st);
+        return;
+    }
+
     printMsg(lvlTalkative, format("linking `%1%' to `%2%'") % path % linkPath);
 
     /* Make the containing directory writable, but only if it's not
@@ -176,7 +337,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
     MakeReadOnly makeReadOnly(mustToggle ? dirOf(path) : "");
 
     Path tempLink = (format("%1%/.tmp-link-%2%-%3%")
-        % settings.nixStore % getpid() % rand()).str();
+        % settings.nixStore % getpid() % tempLinkCounter++).str();
 
     if (link(linkPath.c_str(), tempLink.c_str()) == -1) {
         if (errno == EMLINK) {
@@ -212,16 +373,73 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path, InodeHa
 }
 
 
+/* The number of store paths that are optimised before their
+   completion is recorded in the database. */
+static const size_t optimiseBatchSize = 256;
+
+
 void LocalStore::optimiseStore(OptimiseStats & stats)
 {
-    PathSet paths = queryAllValidPaths();
+    Paths paths = queryUnoptimisedPaths();
     InodeHash inodeHash = loadInodeHash();
 
-    foreach (PathSet::iterator, i, paths) {
-        addTempRoot(*i);
-        if (!isValidPath(*i)) continue; /* path was GC'ed, probably */
-        startNest(nest, lvlChatty, format("hashing files in `%1%'") % *i);
-        optimisePath_(stats, *i, inodeHash);
+    unsigned int nrThreads = settings.optimiseStoreJobs;
+    if (!nrThreads) nrThreads = std::thread::hardware_concurrency();
+    if (!nrThreads) nrThreads = 1;
+
+    printMsg(lvlInfo, format("optimising %1% store paths") % paths.size());
+
+    Paths::iterator i = paths.begin();
+    while (i != paths.end()) {
+
+        /* Make sure the paths of the next batch can't be garbage
+           collected while we're working on them. */
+        std::vector<Path> batch;
+        for ( ; i != paths.end() && batch.size() < optimiseBatchSize; ++i) {
+            addTempRoot(*i);
+            if (!isValidPath(*i)) continue; /* path was GC'ed, probably */
+            batch.push_back(*i);
+        }
+
+        /* Optimise the paths of the batch in parallel.  Since every
+           store path is handled by one thread, threads never touch
+           the same directory. */
+        std::atomic<size_t> next(0);
+        std::vector<OptimiseStats> threadStats(nrThreads);
+        std::vector<std::exception_ptr> errors(nrThreads);
+
+        auto work = [&](size_t t) {
+            try {
+                size_t n;
+                while ((n = next++) < batch.size()) {
+                    printMsg(lvlChatty, format("hashing files in `%1%'") % batch[n]);
+                    optimisePath_(threadStats[t], batch[n], inodeHash);
+                }
+            } catch (...) {
+                errors[t] = std::current_exception();
+                next = batch.size();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < nrThreads; ++t)
+            workers.push_back(std::thread(work, t));
+        work(0);
+        for (size_t t = 0; t < workers.size(); ++t)
+            workers[t].join();
+
+        foreach (std::vector<OptimiseStats>::iterator, j, threadStats) {
+            stats.filesLinked += j->filesLinked;
+            stats.bytesFreed += j->bytesFreed;
+            stats.blocksFreed += j->blocksFreed;
+        }
+
+        foreach (std::vector<std::exception_ptr>::iterator, j, errors)
+            if (*j) std::rethrow_exception(*j);
+
+        /* Store paths are immutable, so these don't need to be
+           looked at again by later runs. */
+        markOptimised(batch);
     }
 }
 
@@ -235,4 +453,22 @@ void LocalStore::optimisePath(const Path & path)
 }
 
 
+void LocalStore::optimisePath(const Path & path, const FileHashes & files)
+{
+    OptimiseStats stats;
+
+    if (!settings.autoOptimiseStore) return;
+
+    foreach (FileHashes::const_iterator, i, files) {
+        checkInterrupt();
+        if (!S_ISREG(i->st.st_mode)
+#if CAN_LINK_SYMLINK
+            && !S_ISLNK(i->st.st_mode)
+#endif
+            ) continue;
+        optimiseFile_(stats, i->path, i->st, i->hash);
+    }
+}
+
+
 }
@@ -0,0 +1,134 @@
+#include "path-ids.hh"
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+
+namespace nix {
+
+
+const PathId PathIds::none;
+
+
+PathId PathIds::intern(const Path & path)
+{
+    std::pair<Ids::iterator, bool> res =
+        ids.insert(Ids::value_type(path, paths.size()));
+    if (res.second) paths.push_back(&res.first->first);
+    return res.first->second;
+}
+
+
+PathId PathIds::lookup(const Path & path) const
+{
+    Ids::const_iterator i = ids.find(path);
+    return i == ids.end() ? none : i->second;
+}
+
+
+bool PathIdSet::insert(PathId id)
+{
+    if (id >= bits.size()) bits.resize(id + 1);
+    if (bits[id]) return false;
+    bits[id] = true;
+    count++;
+    return true;
+}
+
+
+void PathIdSet::erase(PathId id)
+{
+    if (!contains(id)) return;
+    bits[id] = false;
+    count--;
+}
+
+
+PathSet PathIdSet::toPathSet(const PathIds & ids) const
+{
+    PathSet res;
+    for (PathId id = 0; id < bits.size(); ++id)
+        if (bits[id]) res.insert(ids[id]);
+    return res;
+}
+
+
+void PathGraph::setEdges(size_t size, const Edges & edges)
+{
+    offsets.assign(size + 1, 0);
+    for (Edges::const_iterator i = edges.begin(); i != edges.end(); ++i)
+        offsets[i->first + 1]++;
+    for (size_t n = 0; n < size; ++n)
+        offsets[n + 1] += offsets[n];
+
+    targets.resize(edges.size());
+    std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+    for (Edges::const_iterator i = edges.begin(); i != edges.end(); ++i)
+        targets[pos[i->first]++] = i->second;
+}
+
+
+/* Below this many nodes in a level, it's not worth starting threads. */
+static const size_t minNodesPerThread = 1024;
+
+
+PathIdSet markReachable(const PathGraph & graph,
+    const std::vector<PathId> & roots, unsigned int threads)
+{
+    size_t size = graph.size();
+    std::vector<std::atomic<bool> > marked(size);
+
+    std::vector<PathId> level;
+    for (std::vector<PathId>::const_iterator i = roots.begin(); i != roots.end(); ++i)
+        if (*i < size && !marked[*i].exchange(true))
+            level.push_back(*i);
+
+    while (!level.empty()) {
+
+        size_t nrThreads = std::max((size_t) 1,
+            std::min((size_t) threads, level.size() / minNodesPerThread));
+        size_t chunk = (level.size() + nrThreads - 1) / nrThreads;
+
+        std::vector<std::vector<PathId> > next(nrThreads);
+
+        /* Visit the successors of the nodes in one chunk of the
+           current level.  Whichever thread marks a node first adds it
+           to the next level. */
+        auto visit = [&](size_t t) {
+            size_t end = std::min(level.size(), (t + 1) * chunk);
+            for (size_t n = t * chunk; n < end; ++n) {
+                PathId id = level[n];
+                for (size_t e = graph.offsets[id]; e < graph.offsets[id + 1]; ++e) {
+                    PathId succ = graph.targets[e];
+                    if (!marked[succ].load(std::memory_order_relaxed)
+                        && !marked[succ].exchange(true))
+                        next[t].push_back(succ);
+                }
+            }
+        };
+
+        if (nrThreads == 1)
+            visit(0);
+        else {
+            std::vector<std::thread> workers;
+            for (size_t t = 1; t < nrThreads; ++t)
+                workers.push_back(std::thread(visit, t));
+            visit(0);
+            for (size_t t = 0; t < workers.size(); ++t)
+                workers[t].join();
+        }
+
+        level.clear();
+        for (size_t t = 0; t < nrThreads; ++t)
+            level.insert(level.end(), next[t].begin(), next[t].end());
+    }
+
+    PathIdSet res;
+    for (PathId id = 0; id < size; ++id)
+        if (marked[id].load(std::memory_order_relaxed)) res.insert(id);
+    return res;
+}
+
+
+}
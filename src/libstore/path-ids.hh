@@ -0,0 +1,113 @@
+#pragma once
+
+#include "types.hh"
+
+#include <vector>
+#include <unordered_map>
+
+
+namespace nix {
+
+
+/* A small integer standing for a path in a PathIds table. */
+typedef unsigned int PathId;
+
+
+/* A table that interns paths.  Algorithms over large graphs of store
+   paths (such as the garbage collector) can use it to work on
+   integers rather than copying and comparing strings.  Ids are
+   allocated densely from 0, so sets of them can be bitsets. */
+class PathIds
+{
+    typedef std::unordered_map<Path, PathId> Ids;
+    Ids ids;
+
+    /* Points to the keys of `ids', which don't move. */
+    std::vector<const Path *> paths;
+
+public:
+
+    static const PathId none = (PathId) -1;
+
+    /* Return the id of `path', adding it to the table if necessary. */
+    PathId intern(const Path & path);
+
+    /* Return the id of `path', or `none' if it's not in the table. */
+    PathId lookup(const Path & path) const;
+
+    const Path & operator [] (PathId id) const
+    {
+        return *paths[id];
+    }
+
+    size_t size() const
+    {
+        return paths.size();
+    }
+};
+
+
+/* A set of ids from a PathIds table, stored as a bitset. */
+class PathIdSet
+{
+    std::vector<bool> bits;
+    size_t count;
+
+public:
+
+    PathIdSet() : count(0) { }
+
+    bool contains(PathId id) const
+    {
+        return id < bits.size() && bits[id];
+    }
+
+    /* Add `id' to the set.  Returns false if it was already in it. */
+    bool insert(PathId id);
+
+    void erase(PathId id);
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    /* Return the paths in the set. */
+    PathSet toPathSet(const PathIds & ids) const;
+};
+
+
+/* A directed graph over the ids of a PathIds table, in compressed
+   form: the successors of id i are targets[offsets[i]] up to (but not
+   including) targets[offsets[i + 1]]. */
+struct PathGraph
+{
+    std::vector<size_t> offsets;
+    std::vector<PathId> targets;
+
+    typedef std::vector<std::pair<PathId, PathId> > Edges;
+
+    /* Build the graph with nodes 0 to `size - 1' from a list of
+       edges. */
+    void setEdges(size_t size, const Edges & edges);
+
+    size_t size() const
+    {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+};
+
+
+/* Return the set of nodes of `graph' that are reachable from
+   `roots'.  The graph is traversed breadth-first, with each level
+   split among `threads' threads. */
+PathIdSet markReachable(const PathGraph & graph,
+    const std::vector<PathId> & roots, unsigned int threads);
+
+
+}
@@ -4,44 +4,159 @@
 #include "archive.hh"
 
 #include <map>
+#include <vector>
 #include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static const size_t refLength = 32; /* characters */
+
+
+/* The set of hash parts to look for.  It's an open addressing hash
+   table of fixed-size keys, so that checking a candidate doesn't
+   allocate.  Hash parts are found at most once. */
+class RefSet
+{
+    struct Slot
+    {
+        unsigned char key[refLength];
+        bool used, found;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask;
+
+    size_t slotFor(const unsigned char * key) const
+    {
+        /* The characters of a hash part are random enough that its
+           first 8 bytes make a good hash. */
+        uint64_t h;
+        memcpy(&h, key, sizeof(h));
+        return (h * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+    }
+
+public:
+
+    RefSet(const StringSet & hashes)
+    {
+        size_t size = 16;
+        while (size < hashes.size() * 2) size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+        foreach (StringSet::const_iterator, i, hashes) {
+            assert(i->size() == refLength);
+            size_t n = slotFor((const unsigned char *) i->data());
+            while (slots[n].used) n = (n + 1) & mask;
+            memcpy(slots[n].key, i->data(), refLength);
+            slots[n].used = true;
+            slots[n].found = false;
+        }
+    }
+
+    void check(const unsigned char * s, size_t offset)
+    {
+        for (size_t n = slotFor(s); slots[n].used; n = (n + 1) & mask)
+            if (memcmp(slots[n].key, s, refLength) == 0) {
+                if (!slots[n].found) {
+                    debug(format("found reference to `%1%' at offset `%2%'")
+                        % string((const char *) s, refLength) % offset);
+                    slots[n].found = true;
+                }
+                return;
+            }
+    }
+
+    StringSet found() const
+    {
+        StringSet res;
+        foreach (std::vector<Slot>::const_iterator, i, slots)
+            if (i->used && i->found)
+                res.insert(string((const char *) i->key, refLength));
+        return res;
+    }
+};
 
 
-static void search(const unsigned char * s, unsigned int len, 
-    StringSet & hashes, StringSet & seen)
+static bool isBase32[256];
+
+static void initIsBase32()
 {
     static bool initialised = false;
-    static bool isBase32[256];
     if (!initialised) {
         for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
         for (unsigned int i = 0; i < base32Chars.size(); ++i)
             isBase32[(unsigned char) base32Chars[i]] = true;
         initialised = true;
     }
-    
-    for (unsigned int i = 0; i + refLength <= len; ) {
+}
+
+
+#if __SSE2__
+/* Return a mask with bit i set iff s[i] is a base-32 character, for
+   0 <= i < 16. */
+static inline unsigned int base32Mask(const unsigned char * s)
+{
+    __m128i c = _mm_loadu_si128((const __m128i *) s);
+    /* Unsigned "x <= n" is "min(x, n) == x". */
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i l = _mm_sub_epi8(c, _mm_set1_epi8('a'));
+    __m128i letter = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(25)), l);
+    /* The letters that base-32 leaves out. */
+    __m128i omitted = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('e')), _mm_cmpeq_epi8(c, _mm_set1_epi8('o'))),
+        _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('t')), _mm_cmpeq_epi8(c, _mm_set1_epi8('u'))));
+    return _mm_movemask_epi8(_mm_or_si128(digit, _mm_andnot_si128(omitted, letter)));
+}
+#endif
+
+
+/* Look for hash parts in `s'.  At every position, check whether the
+   next `refLength' characters are all base-32, from the last one
+   backwards.  If not, the search can skip past the last one that
+   isn't.  With SSE2, all of them are checked at once. */
+static void search(const unsigned char * s, size_t len, RefSet & refs, size_t offset)
+{
+    size_t i = 0;
+
+#if __SSE2__
+    for ( ; i + refLength <= len; ) {
+        /* In binary data, the last character usually isn't base-32,
+           which is cheaper to check on its own. */
+        if (!isBase32[s[i + refLength - 1]]) {
+            i += refLength;
+            continue;
+        }
+        uint32_t mask = base32Mask(s + i) | (uint32_t) base32Mask(s + i + 16) << 16;
+        if (mask != 0xffffffff) {
+            /* Skip past the last non-base-32 character. */
+            i += 32 - __builtin_clz(~mask);
+            continue;
+        }
+        refs.check(s + i, offset + i);
+        ++i;
+    }
+#endif
+
+    while (i + refLength <= len) {
         int j;
         bool match = true;
         for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
+            if (!isBase32[s[i + j]]) {
                 i += j + 1;
                 match = false;
                 break;
             }
         if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.find(ref) != hashes.end()) {
-            debug(format("found reference to `%1%' at offset `%2%'")
-                  % ref % i);
-            seen.insert(ref);
-            hashes.erase(ref);
-        }
+        refs.check(s + i, offset + i);
         ++i;
     }
 }
@@ -50,13 +165,17 @@ static void search(const unsigned char * s, unsigned int len,
 struct RefScanSink : Sink
 {
     HashSink hashSink;
-    StringSet hashes;
-    StringSet seen;
+    RefSet & refs;
+
+    /* The last bytes seen, since a reference may span fragments. */
+    unsigned char tail[refLength];
+    size_t tailLen;
+
+    /* The number of bytes seen. */
+    size_t offset;
 
-    string tail;
+    RefScanSink(RefSet & refs) : hashSink(htSHA256), refs(refs), tailLen(0), offset(0) { }
 
-    RefScanSink() : hashSink(htSHA256) { }
-    
     void operator () (const unsigned char * data, size_t len);
 };
 
@@ -68,22 +187,36 @@ void RefScanSink::operator () (const unsigned char * data, size_t len)
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
-    string s = tail + string((const char *) data, len > refLength ? refLength : len);
-    search((const unsigned char *) s.data(), s.size(), hashes, seen);
+    unsigned char buf[2 * refLength];
+    size_t headLen = len > refLength ? refLength : len;
+    memcpy(buf, tail, tailLen);
+    memcpy(buf + tailLen, data, headLen);
+    search(buf, tailLen + headLen, refs, offset - tailLen);
 
-    search(data, len, hashes, seen);
+    search(data, len, refs, offset);
 
-    unsigned int tailLen = len <= refLength ? len : refLength;
-    tail =
-        string(tail, tail.size() < refLength - tailLen ? 0 : tail.size() - (refLength - tailLen)) +
-        string((const char *) data + len - tailLen, tailLen);
+    /* Keep the last `refLength' bytes. */
+    if (len >= refLength) {
+        memcpy(tail, data + len - refLength, refLength);
+        tailLen = refLength;
+    } else {
+        size_t keep = tailLen + len > refLength ? refLength - len : tailLen;
+        memmove(tail, tail + tailLen - keep, keep);
+        memcpy(tail + keep, data, len);
+        tailLen = keep + len;
+    }
+
+    offset += len;
 }
 
 
-PathSet scanForReferences(const string & path,
-    const PathSet & refs, HashResult & hash)
+/* Look for the hash parts of `refs' in the NAR dump of `path', which
+   `dump' writes to a sink. */
+template<class DumpFn>
+static PathSet scanForReferences_(const PathSet & refs, HashResult & hash,
+    DumpFn dump)
 {
-    RefScanSink sink;
+    StringSet hashes;
     std::map<string, Path> backMap;
 
     /* For efficiency (and a higher hit rate), just search for the
@@ -98,16 +231,20 @@ PathSet scanForReferences(const string & path,
         assert(s.size() == refLength);
         assert(backMap.find(s) == backMap.end());
         // parseHash(htSHA256, s);
-        sink.hashes.insert(s);
+        hashes.insert(s);
         backMap[s] = *i;
     }
 
     /* Look for the hashes in the NAR dump of the path. */
-    dumpPath(path, sink);
+    initIsBase32();
+    RefSet refSet(hashes);
+    RefScanSink sink(refSet);
+    dump(sink);
 
     /* Map the hashes found back to their store paths. */
     PathSet found;
-    foreach (StringSet::iterator, i, sink.seen) {
+    StringSet seen = refSet.found();
+    foreach (StringSet::iterator, i, seen) {
         std::map<string, Path>::iterator j;
         if ((j = backMap.find(*i)) == backMap.end()) abort();
         found.insert(j->second);
@@ -119,4 +256,28 @@ PathSet scanForReferences(const string & path,
 }
 
 
+PathSet scanForReferences(const string & path,
+    const PathSet & refs, HashResult & hash)
+{
+    return scanForReferences_(refs, hash,
+        [&](Sink & sink) { dumpPath(path, sink); });
+}
+
+
+PathSet scanForReferences(const Path & path, const PathSet & refs,
+    HashResult & hash, Sink * sink, FileHashes * files)
+{
+    auto dump = [&](Sink & out) {
+        if (files) dumpPath(path, out, *files); else dumpPath(path, out);
+    };
+
+    return scanForReferences_(refs, hash,
+        [&](Sink & refSink) {
+            if (!sink) { dump(refSink); return; }
+            TeeSink tee(refSink, *sink);
+            dump(tee);
+        });
+}
+
+
 }
@@ -2,10 +2,17 @@
 
 #include "types.hh"
 #include "hash.hh"
+#include "archive.hh"
 
 namespace nix {
 
 PathSet scanForReferences(const Path & path, const PathSet & refs,
     HashResult & hash);
+
+/* Like the above, but also pass the NAR serialisation of `path' to
+   `sink', and hash each file in it into `files' (see dumpPath()), if
+   they're not null.  This way `path' is read only once. */
+PathSet scanForReferences(const Path & path, const PathSet & refs,
+    HashResult & hash, Sink * sink, FileHashes * files);
     
 }
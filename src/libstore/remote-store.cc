@@ -296,6 +296,35 @@ ValidPathInfo RemoteStore::queryPathInfo(const Path & path)
 }
 
 
+ValidPathInfoMap RemoteStore::queryPathInfos(const PathSet & paths)
+{
+    openConnection();
+    ValidPathInfoMap infos;
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 16) {
+        PathSet valid = queryValidPaths(paths);
+        foreach (PathSet::iterator, i, valid)
+            infos[*i] = queryPathInfo(*i);
+        return infos;
+    }
+    writeInt(wopQueryPathInfos, to);
+    writeStrings(paths, to);
+    processStderr();
+    unsigned int count = readInt(from);
+    for (unsigned int n = 0; n < count; n++) {
+        Path path = readStorePath(from);
+        ValidPathInfo & info(infos[path]);
+        info.path = path;
+        info.deriver = readString(from);
+        if (info.deriver != "") assertStorePath(info.deriver);
+        info.hash = parseHash(htSHA256, readString(from));
+        info.references = readStorePaths<PathSet>(from);
+        info.registrationTime = readInt(from);
+        info.narSize = readLongLong(from);
+    }
+    return infos;
+}
+
+
 Hash RemoteStore::queryPathHash(const Path & path)
 {
     openConnection();
@@ -343,6 +372,22 @@ Path RemoteStore::queryDeriver(const Path & path)
 }
 
 
+PathSet RemoteStore::queryClosure(const PathSet & paths,
+    bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 15)
+        return StoreAPI::queryClosure(paths, flipDirection, includeOutputs, includeDerivers);
+    writeInt(wopQueryClosure, to);
+    writeStrings(paths, to);
+    writeInt(flipDirection, to);
+    writeInt(includeOutputs, to);
+    writeInt(includeDerivers, to);
+    processStderr();
+    return readStorePaths<PathSet>(from);
+}
+
+
 PathSet RemoteStore::queryValidDerivers(const Path & path)
 {
     openConnection();
@@ -402,14 +447,11 @@ Path RemoteStore::addToStore(const Path & _srcPath,
     writeString(printHashType(hashAlgo), to);
 
     try {
-        to.written = 0;
-        to.warn = true;
         dumpPath(srcPath, to, filter);
-        to.warn = false;
         processStderr();
     } catch (SysError & e) {
-        /* Daemon closed while we were sending the path. Probably OOM
-           or I/O error. */
+        /* Daemon closed while we were sending the path.  Probably an
+           I/O error, e.g. the disk is full. */
         if (e.errNo == EPIPE)
             try {
                 processStderr();
@@ -550,6 +592,10 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
         writeInt(0, to);
         writeInt(0, to);
     }
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 17)
+        writeInt(options.incremental, to);
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 18)
+        writeLongLong(options.minFree, to);
 
     processStderr();
 
@@ -32,12 +32,17 @@ public:
     
     ValidPathInfo queryPathInfo(const Path & path);
 
+    ValidPathInfoMap queryPathInfos(const PathSet & paths);
+
     Hash queryPathHash(const Path & path);
 
     void queryReferences(const Path & path, PathSet & references);
 
     void queryReferrers(const Path & path, PathSet & referrers);
 
+    PathSet queryClosure(const PathSet & paths, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false);
+
     Path queryDeriver(const Path & path);
     
     PathSet queryValidDerivers(const Path & path);
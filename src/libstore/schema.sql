@@ -7,6 +7,9 @@ create table if not exists ValidPaths (
     narSize          integer
 );
 
+-- Used by the incremental garbage collector to find the oldest paths.
+create index if not exists IndexRegistrationTime on ValidPaths(registrationTime);
+
 create table if not exists Refs (
     referrer  integer not null,
     reference integer not null,
@@ -38,6 +41,13 @@ create table if not exists DerivationOutputs (
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
 
+-- The valid paths whose files have been hard-linked to the files
+-- with the same contents in /nix/store/.links by `nix-store --optimise'.
+create table if not exists OptimisedPaths (
+    id integer primary key not null,
+    foreign key (id) references ValidPaths(id) on delete cascade
+);
+
 create table if not exists FailedPaths (
     path text primary key not null,
     time integer not null
@@ -1,6 +1,7 @@
 #include "store-api.hh"
 #include "globals.hh"
 #include "util.hh"
+#include "derivations.hh"
 
 #include <climits>
 
@@ -13,6 +14,8 @@ GCOptions::GCOptions()
     action = gcDeleteDead;
     ignoreLiveness = false;
     maxFreed = ULLONG_MAX;
+    incremental = false;
+    minFree = 0;
 }
 
 
@@ -227,6 +230,58 @@ Path computeStorePathForText(const string & name, const string & s,
 }
 
 
+PathSet StoreAPI::queryClosure(const PathSet & paths,
+    bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    PathSet closure;
+    Paths todo(paths.begin(), paths.end());
+
+    while (!todo.empty()) {
+        Path path = todo.front();
+        todo.pop_front();
+        if (closure.find(path) != closure.end()) continue;
+        closure.insert(path);
+
+        PathSet edges;
+
+        if (flipDirection) {
+            queryReferrers(path, edges);
+
+            if (includeOutputs) {
+                PathSet derivers = queryValidDerivers(path);
+                edges.insert(derivers.begin(), derivers.end());
+            }
+
+            if (includeDerivers && isDerivation(path)) {
+                PathSet outputs = queryDerivationOutputs(path);
+                foreach (PathSet::iterator, i, outputs)
+                    if (isValidPath(*i) && queryDeriver(*i) == path)
+                        edges.insert(*i);
+            }
+
+        } else {
+            queryReferences(path, edges);
+
+            if (includeOutputs && isDerivation(path)) {
+                PathSet outputs = queryDerivationOutputs(path);
+                foreach (PathSet::iterator, i, outputs)
+                    if (isValidPath(*i)) edges.insert(*i);
+            }
+
+            if (includeDerivers) {
+                Path deriver = queryDeriver(path);
+                if (isValidPath(deriver)) edges.insert(deriver);
+            }
+        }
+
+        foreach (PathSet::iterator, i, edges)
+            if (closure.find(*i) == closure.end()) todo.push_back(*i);
+    }
+
+    return closure;
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -234,11 +289,15 @@ string StoreAPI::makeValidityRegistration(const PathSet & paths,
     bool showDerivers, bool showHash)
 {
     string s = "";
-    
+
+    ValidPathInfoMap infos = queryPathInfos(paths);
+
     foreach (PathSet::iterator, i, paths) {
         s += *i + "\n";
 
-        ValidPathInfo info = queryPathInfo(*i);
+        if (infos.find(*i) == infos.end())
+            throw Error(format("path `%1%' is not valid") % *i);
+        ValidPathInfo & info(infos[*i]);
 
         if (showHash) {
             s += printHash(info.hash) + "\n";
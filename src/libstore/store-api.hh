@@ -50,6 +50,19 @@ struct GCOptions
     /* Stop after at least `maxFreed' bytes have been freed. */
     unsigned long long maxFreed;
 
+    /* If non-zero, stop once at least `minFree' bytes are available
+       on the file system containing the store.  When the amount of
+       garbage to delete is limited, the paths accessed longest ago
+       are deleted first. */
+    unsigned long long minFree;
+
+    /* For `gcDeleteDead' and `gcReturnDead', consider only valid
+       paths, in order of registration, starting after the last path
+       considered by the previous incremental collection.  This
+       avoids scanning the whole store, so with `maxFreed' the work
+       done is proportional to the garbage found. */
+    bool incremental;
+
     GCOptions();
 };
 
@@ -96,6 +109,8 @@ struct ValidPathInfo
 
 typedef list<ValidPathInfo> ValidPathInfos;
 
+typedef std::map<Path, ValidPathInfo> ValidPathInfoMap;
+
 
 enum BuildMode { bmNormal, bmRepair, bmCheck };
 
@@ -118,6 +133,10 @@ public:
     /* Query information about a valid path. */
     virtual ValidPathInfo queryPathInfo(const Path & path) = 0;
 
+    /* Query information about a set of paths.  Paths that are not
+       valid are omitted from the result. */
+    virtual ValidPathInfoMap queryPathInfos(const PathSet & paths) = 0;
+
     /* Query the hash of a valid path. */ 
     virtual Hash queryPathHash(const Path & path) = 0;
 
@@ -131,6 +150,18 @@ public:
     virtual void queryReferrers(const Path & path,
         PathSet & referrers) = 0;
 
+    /* Return the closure of the given valid paths under the
+       references relation, or under the referrers relation if
+       `flipDirection' is true.  If `includeOutputs' is set, the valid
+       outputs of derivations (or, when flipped, the valid derivers of
+       outputs) are followed as well; if `includeDerivers' is set, the
+       valid deriver of each path (or, when flipped, the valid outputs
+       that were produced by a derivation) is followed.  The default
+       implementation queries the edges of every path separately. */
+    virtual PathSet queryClosure(const PathSet & paths,
+        bool flipDirection = false, bool includeOutputs = false,
+        bool includeDerivers = false);
+
     /* Query the deriver of a store path.  Return the empty string if
        no deriver has been set. */
     virtual Path queryDeriver(const Path & path) = 0;
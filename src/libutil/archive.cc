@@ -6,6 +6,11 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <strings.h> // for strcasecmp
 
@@ -36,15 +41,193 @@ static string caseHackSuffix = "~nix~case~hack~";
 PathFilter defaultPathFilter;
 
 
+/* Reads the contents of the files in a directory on a pool of
+   threads, ahead of dump() getting to them, so that the NAR
+   serialisation of a large tree isn't limited by the latency of
+   reading one file at a time.  Small files are read into memory, up
+   to a fixed total; the kernel is just asked to read ahead large
+   files.  Files that aren't prefetched (or fail to be) are read by
+   dump() itself, so errors are reported in the usual order. */
+class Prefetcher
+{
+    struct File
+    {
+        Path path;
+        size_t size;
+        bool done, ok;
+        string contents;
+    };
+
+    typedef std::shared_ptr<File> FilePtr;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::deque<FilePtr> queue;
+    std::map<Path, FilePtr> files;
+    size_t buffered;
+    bool quit;
+    std::vector<std::thread> threads;
+
+    /* Reading files is I/O bound, so this many threads help even on
+       a single core. */
+    static const unsigned int nrThreads = 8;
+
+    /* Files larger than this are not read into memory. */
+    static const size_t maxFileSize = 4 * 1024 * 1024;
+
+    /* The maximum size of the files in memory at any time. */
+    static const size_t maxBuffered = 64 * 1024 * 1024;
+
+    /* How much of a large file the kernel is asked to read ahead. */
+    static const off_t readAheadSize = 64 * 1024 * 1024;
+
+    void run();
+
+public:
+
+    Prefetcher() : buffered(0), quit(false) { }
+    ~Prefetcher();
+
+    /* Start reading `path', which is a regular file of `size' bytes,
+       if there is room. */
+    void enqueue(const Path & path, size_t size);
+
+    /* Return the contents of `path' in `contents' if it has been
+       prefetched, waiting for it if necessary. */
+    bool take(const Path & path, size_t size, string & contents);
+};
+
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::unique_lock<std::mutex> l(lock);
+        quit = true;
+    }
+    wakeup.notify_all();
+    for (auto & i : threads) i.join();
+}
+
+
+void Prefetcher::enqueue(const Path & path, size_t size)
+{
+    std::unique_lock<std::mutex> l(lock);
+
+    if (size <= maxFileSize) {
+        if (buffered + size > maxBuffered) return;
+        buffered += size;
+    }
+
+    FilePtr file(new File);
+    file->path = path;
+    file->size = size;
+    file->done = file->ok = false;
+    queue.push_back(file);
+    if (size <= maxFileSize) files[path] = file;
+
+    if (threads.size() < nrThreads && threads.size() < queue.size())
+        threads.push_back(std::thread(&Prefetcher::run, this));
+
+    wakeup.notify_one();
+}
+
+
+bool Prefetcher::take(const Path & path, size_t size, string & contents)
+{
+    std::unique_lock<std::mutex> l(lock);
+
+    auto i = files.find(path);
+    if (i == files.end()) return false;
+    FilePtr file = i->second;
+    files.erase(i);
+
+    /* If it hasn't been started yet, don't wait for it. */
+    for (auto j = queue.begin(); j != queue.end(); ++j)
+        if (*j == file) {
+            queue.erase(j);
+            buffered -= file->size;
+            return false;
+        }
+
+    while (!file->done) wakeup.wait(l);
+
+    buffered -= file->size;
+    if (!file->ok || file->size != size) return false;
+    contents.swap(file->contents);
+    return true;
+}
+
+
+void Prefetcher::run()
+{
+    while (true) {
+        FilePtr file;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            while (!quit && queue.empty()) wakeup.wait(l);
+            if (quit) return;
+            file = queue.front();
+            queue.pop_front();
+        }
+
+        bool ok = false;
+        string contents;
+
+        try {
+            AutoCloseFD fd = open(file->path.c_str(), O_RDONLY);
+            if (fd != -1) {
+                if (file->size > maxFileSize) {
+#if HAVE_POSIX_FADVISE
+                    posix_fadvise(fd, 0, (off_t) file->size > readAheadSize ? readAheadSize : file->size,
+                        POSIX_FADV_WILLNEED);
+#endif
+                } else {
+                    contents.resize(file->size);
+                    size_t n = 0;
+                    while (n < file->size) {
+                        ssize_t res = read(fd, &contents[n], file->size - n);
+                        if (res == -1 && errno == EINTR) continue;
+                        if (res <= 0) break;
+                        n += res;
+                    }
+                    ok = n == file->size;
+                }
+            }
+        } catch (...) {
+            /* Let dump() read it and report the error. */
+        }
+
+        {
+            std::unique_lock<std::mutex> l(lock);
+            file->done = true;
+            file->ok = ok;
+            file->contents.swap(contents);
+        }
+        wakeup.notify_all();
+    }
+}
+
+
 static void dumpContents(const Path & path, size_t size,
-    Sink & sink)
+    Sink & sink, Prefetcher & prefetcher)
 {
     writeString("contents", sink);
     writeLongLong(size, sink);
 
+    string contents;
+    if (prefetcher.take(path, size, contents)) {
+        sink((const unsigned char *) contents.data(), size);
+        writePadding(size, sink);
+        return;
+    }
+
     AutoCloseFD fd = open(path.c_str(), O_RDONLY);
     if (fd == -1) throw SysError(format("opening file `%1%'") % path);
 
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
     unsigned char buf[65536];
     size_t left = size;
 
@@ -59,12 +242,13 @@ static void dumpContents(const Path & path, size_t size,
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
-{
-    struct stat st;
-    if (lstat(path.c_str(), &st))
-        throw SysError(format("getting attributes of path `%1%'") % path);
+static void dump(const Path & path, Sink & sink, PathFilter & filter,
+    Prefetcher & prefetcher, FileHashes * files);
+
 
+static void dumpNode(const Path & path, const struct stat & st, Sink & sink,
+    PathFilter & filter, Prefetcher & prefetcher, FileHashes * files)
+{
     writeString("(", sink);
 
     if (S_ISREG(st.st_mode)) {
@@ -74,7 +258,7 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
             writeString("executable", sink);
             writeString("", sink);
         }
-        dumpContents(path, (size_t) st.st_size, sink);
+        dumpContents(path, (size_t) st.st_size, sink, prefetcher);
     }
 
     else if (S_ISDIR(st.st_mode)) {
@@ -100,16 +284,28 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
             } else
                 unhacked[i] = i;
 
+        std::vector<std::pair<string, string> > entries;
         for (auto & i : unhacked)
-            if (filter(path + "/" + i.first)) {
-                writeString("entry", sink);
-                writeString("(", sink);
-                writeString("name", sink);
-                writeString(i.first, sink);
-                writeString("node", sink);
-                dump(path + "/" + i.second, sink, filter);
-                writeString(")", sink);
+            if (filter(path + "/" + i.first)) entries.push_back(i);
+
+        /* Start reading the regular files in this directory. */
+        if (entries.size() > 1)
+            for (auto & i : entries) {
+                Path child = path + "/" + i.second;
+                struct stat st2;
+                if (lstat(child.c_str(), &st2) == 0 && S_ISREG(st2.st_mode))
+                    prefetcher.enqueue(child, st2.st_size);
             }
+
+        for (auto & i : entries) {
+            writeString("entry", sink);
+            writeString("(", sink);
+            writeString("name", sink);
+            writeString(i.first, sink);
+            writeString("node", sink);
+            dump(path + "/" + i.second, sink, filter, prefetcher, files);
+            writeString(")", sink);
+        }
     }
 
     else if (S_ISLNK(st.st_mode)) {
@@ -125,10 +321,45 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 }
 
 
+static void dump(const Path & path, Sink & sink, PathFilter & filter,
+    Prefetcher & prefetcher, FileHashes * files)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % path);
+
+    if (!files || S_ISDIR(st.st_mode)) {
+        dumpNode(path, st, sink, filter, prefetcher, files);
+        return;
+    }
+
+    /* Hash the serialisation of this file on its own as well. */
+    HashSink hashSink(htSHA256);
+    writeString(archiveVersion1, hashSink);
+    TeeSink tee(sink, hashSink);
+    dumpNode(path, st, tee, filter, prefetcher, 0);
+
+    FileHash file;
+    file.path = path;
+    file.st = st;
+    file.hash = hashSink.finish().first;
+    files->push_back(file);
+}
+
+
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
     writeString(archiveVersion1, sink);
-    dump(path, sink, filter);
+    Prefetcher prefetcher;
+    dump(path, sink, filter, prefetcher, 0);
+}
+
+
+void dumpPath(const Path & path, Sink & sink, FileHashes & files)
+{
+    writeString(archiveVersion1, sink);
+    Prefetcher prefetcher;
+    dump(path, sink, defaultPathFilter, prefetcher, &files);
 }
 
 
@@ -156,6 +387,10 @@ static void parseContents(ParseSink & sink, Source & source, const Path & path)
     sink.preallocateContents(size);
 
     unsigned long long left = size;
+
+    /* Try to copy the contents without reading them into memory. */
+    left -= sink.copyContents(source, left);
+
     unsigned char buf[65536];
 
     while (left) {
@@ -344,6 +579,11 @@ struct RestoreSink : ParseSink
         writeFull(fd, data, len);
     }
 
+    unsigned long long copyContents(Source & source, unsigned long long len)
+    {
+        return source.copyToFd(fd, len);
+    }
+
     void createSymlink(const Path & path, const string & target)
     {
         Path p = dstPath + path;
@@ -2,6 +2,9 @@
 
 #include "types.hh"
 #include "serialise.hh"
+#include "hash.hh"
+
+#include <sys/stat.h>
 
 
 namespace nix {
@@ -55,6 +58,22 @@ extern PathFilter defaultPathFilter;
 void dumpPath(const Path & path, Sink & sink,
     PathFilter & filter = defaultPathFilter);
 
+/* A regular file or symlink in a dump, with its attributes and the
+   SHA-256 hash of its own serialisation, i.e. what hashPath() would
+   return for it. */
+struct FileHash
+{
+    Path path;
+    struct stat st;
+    Hash hash;
+};
+
+typedef std::list<FileHash> FileHashes;
+
+/* Like dumpPath(), but also hash every regular file and symlink in
+   `path' while it's being read. */
+void dumpPath(const Path & path, Sink & sink, FileHashes & files);
+
 struct ParseSink
 {
     virtual void createDirectory(const Path & path) { };
@@ -64,6 +83,10 @@ struct ParseSink
     virtual void preallocateContents(unsigned long long size) { };
     virtual void receiveContents(unsigned char * data, unsigned int len) { };
 
+    /* Like receiveContents(), but take up to `len' bytes directly from
+       `source' if possible.  Returns the number of bytes taken. */
+    virtual unsigned long long copyContents(Source & source, unsigned long long len) { return 0; };
+
     virtual void createSymlink(const Path & path, const string & target) { };
 };
 
@@ -12,4 +12,6 @@ else
   libutil_SOURCES += $(d)/md5.c $(d)/sha1.c $(d)/sha256.c
 endif
 
+libutil_LDFLAGS += -pthread
+
 libutil_LIBS = libformat
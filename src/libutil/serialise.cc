@@ -4,6 +4,9 @@
 #include <cstring>
 #include <cerrno>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 
 namespace nix {
 
@@ -125,6 +128,59 @@ size_t FdSource::readUnbuffered(unsigned char * data, size_t len)
 }
 
 
+/* The most data moved by one system call in FdSource::copyToFd(),
+   so that interrupts are noticed. */
+static const size_t maxCopyChunk = 16 * 1024 * 1024;
+
+
+unsigned long long FdSource::copyToFd(int dst, unsigned long long len)
+{
+    unsigned long long copied = 0;
+
+    /* First write out the data we have already read. */
+    if (bufPosOut < bufPosIn) {
+        size_t n = bufPosIn - bufPosOut;
+        if (n > len) n = len;
+        writeFull(dst, buffer + bufPosOut, n);
+        bufPosOut += n;
+        copied += n;
+        if (bufPosIn != bufPosOut) return copied;
+        bufPosIn = bufPosOut = 0;
+    }
+
+    while (canCopy && copied < len) {
+        checkInterrupt();
+
+        size_t chunk = len - copied > maxCopyChunk ? maxCopyChunk : len - copied;
+        ssize_t n = -1;
+        errno = EINVAL;
+
+#if HAVE_COPY_FILE_RANGE
+        n = copy_file_range(fd, 0, dst, 0, chunk, 0);
+#endif
+#if HAVE_SPLICE
+        if (n == -1 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EBADF))
+            n = splice(fd, 0, dst, 0, chunk, SPLICE_F_MOVE);
+#endif
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* Neither works for this kind of file, so stop trying. */
+            if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP) {
+                canCopy = false;
+                break;
+            }
+            throw SysError("copying data to a file");
+        }
+        if (n == 0) throw EndOfFile("unexpected end-of-file");
+
+        copied += n;
+    }
+
+    return copied;
+}
+
+
 size_t StringSource::read(unsigned char * data, size_t len)
 {
     if (pos == s.size()) throw EndOfFile("end of string reached");
@@ -134,6 +190,21 @@ size_t StringSource::read(unsigned char * data, size_t len)
 }
 
 
+size_t TeeSource::read(unsigned char * data, size_t len)
+{
+    size_t n = orig.read(data, len);
+    sink(data, n);
+    return n;
+}
+
+
+void TeeSink::operator () (const unsigned char * data, size_t len)
+{
+    sink1(data, len);
+    sink2(data, len);
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
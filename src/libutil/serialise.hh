@@ -46,6 +46,12 @@ struct Source
        return the number of bytes stored.  If blocks until at least
        one byte is available. */
     virtual size_t read(unsigned char * data, size_t len) = 0;
+
+    /* Copy up to ‘len’ bytes to the file descriptor ‘fd’ without
+       going through a user-space buffer, if the source supports it,
+       and return the number of bytes copied.  The caller reads the
+       rest as usual. */
+    virtual unsigned long long copyToFd(int fd, unsigned long long len) { return 0; }
 };
 
 
@@ -87,9 +93,14 @@ struct FdSink : BufferedSink
 struct FdSource : BufferedSource
 {
     int fd;
-    FdSource() : fd(-1) { }
-    FdSource(int fd) : fd(fd) { }
+    bool canCopy;
+    FdSource() : fd(-1), canCopy(true) { }
+    FdSource(int fd) : fd(fd), canCopy(true) { }
     size_t readUnbuffered(unsigned char * data, size_t len);
+
+    /* Uses copy_file_range() if ‘fd’ is a regular file, or splice()
+       if it's a pipe. */
+    unsigned long long copyToFd(int fd, unsigned long long len);
 };
 
 
@@ -111,6 +122,26 @@ struct StringSource : Source
 };
 
 
+/* A source that also writes all data read from another source to a
+   sink, e.g. to hash it. */
+struct TeeSource : Source
+{
+    Source & orig;
+    Sink & sink;
+    TeeSource(Source & orig, Sink & sink) : orig(orig), sink(sink) { }
+    size_t read(unsigned char * data, size_t len);
+};
+
+
+/* A sink that writes data to two other sinks. */
+struct TeeSink : Sink
+{
+    Sink & sink1, & sink2;
+    TeeSink(Sink & sink1, Sink & sink2) : sink1(sink1), sink2(sink2) { }
+    void operator () (const unsigned char * data, size_t len);
+};
+
+
 void writePadding(size_t len, Sink & sink);
 void writeInt(unsigned int n, Sink & sink);
 void writeLongLong(unsigned long long n, Sink & sink);
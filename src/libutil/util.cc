@@ -282,31 +282,59 @@ void writeLine(int fd, string s)
 }
 
 
-static void _deletePath(const Path & path, unsigned long long & bytesFreed)
+/* Delete the entry `name' of the directory open as `parentfd'.  The
+   directory's own path `dir' is only used in messages, so that the
+   paths of the entries don't have to be constructed. */
+static void _deletePath(int parentfd, const Path & dir, const string & name,
+    unsigned long long & bytesFreed)
 {
     checkInterrupt();
 
-    printMsg(lvlVomit, format("%1%") % path);
+    Path path = dir.empty() ? name : dir + "/" + name;
 
-    struct stat st = lstat(path);
+    struct stat st;
+    if (fstatat(parentfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+        throw SysError(format("getting status of `%1%'") % path);
 
     if (!S_ISDIR(st.st_mode) && st.st_nlink == 1)
         bytesFreed += st.st_blocks * 512;
 
     if (S_ISDIR(st.st_mode)) {
-        Strings names = readDirectory(path);
-
         /* Make the directory writable. */
         if (!(st.st_mode & S_IWUSR)) {
-            if (chmod(path.c_str(), st.st_mode | S_IWUSR) == -1)
+            if (fchmodat(parentfd, name.c_str(), st.st_mode | S_IWUSR, 0) == -1)
                 throw SysError(format("making `%1%' writable") % path);
         }
 
+        int fd = openat(parentfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd == -1)
+            throw SysError(format("opening directory `%1%'") % path);
+        closeOnExec(fd);
+
+        AutoCloseDir dirp = fdopendir(fd);
+        if (!dirp) {
+            close(fd);
+            throw SysError(format("opening directory `%1%'") % path);
+        }
+
+        /* Read all entries before deleting any of them, since
+           removing entries while reading a directory may cause
+           entries to be skipped. */
+        Strings names;
+        struct dirent * dirent;
+        while (errno = 0, dirent = readdir(dirp)) {
+            checkInterrupt();
+            string childName = dirent->d_name;
+            if (childName == "." || childName == "..") continue;
+            names.push_back(childName);
+        }
+        if (errno) throw SysError(format("reading directory `%1%'") % path);
+
         for (Strings::iterator i = names.begin(); i != names.end(); ++i)
-            _deletePath(path + "/" + *i, bytesFreed);
+            _deletePath(dirfd(dirp), path, *i, bytesFreed);
     }
 
-    if (remove(path.c_str()) == -1)
+    if (unlinkat(parentfd, name.c_str(), S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) == -1)
         throw SysError(format("cannot unlink `%1%'") % path);
 }
 
@@ -323,7 +351,13 @@ void deletePath(const Path & path, unsigned long long & bytesFreed)
     startNest(nest, lvlDebug,
         format("recursively deleting path `%1%'") % path);
     bytesFreed = 0;
-    _deletePath(path, bytesFreed);
+    _deletePath(AT_FDCWD, "", path, bytesFreed);
+}
+
+
+void deletePathUnlogged(const Path & path, unsigned long long & bytesFreed)
+{
+    _deletePath(AT_FDCWD, "", path, bytesFreed);
 }
 
 
@@ -86,6 +86,11 @@ void deletePath(const Path & path);
 
 void deletePath(const Path & path, unsigned long long & bytesFreed);
 
+/* Like deletePath(), but doesn't print anything, so that it can be
+   called from threads other than the main thread.  The number of bytes
+   freed is added to `bytesFreed'. */
+void deletePathUnlogged(const Path & path, unsigned long long & bytesFreed);
+
 /* Create a temporary directory. */
 Path createTempDir(const Path & tmpRoot = "", const Path & prefix = "nix",
     bool includePid = true, bool useGlobalCounter = true, mode_t mode = 0755);
@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
@@ -105,47 +106,6 @@ struct TunnelSource : BufferedSource
 };
 
 
-/* If the NAR archive contains a single file at top-level, then save
-   the contents of the file to `s'.  Otherwise barf. */
-struct RetrieveRegularNARSink : ParseSink
-{
-    bool regular;
-    string s;
-
-    RetrieveRegularNARSink() : regular(true) { }
-
-    void createDirectory(const Path & path)
-    {
-        regular = false;
-    }
-
-    void receiveContents(unsigned char * data, unsigned int len)
-    {
-        s.append((const char *) data, len);
-    }
-
-    void createSymlink(const Path & path, const string & target)
-    {
-        regular = false;
-    }
-};
-
-
-/* Adapter class of a Source that saves all data read to `s'. */
-struct SavingSourceAdapter : Source
-{
-    Source & orig;
-    string s;
-    SavingSourceAdapter(Source & orig) : orig(orig) { }
-    size_t read(unsigned char * data, size_t len)
-    {
-        size_t n = orig.read(data, len);
-        s.append((const char *) data, n);
-        return n;
-    }
-};
-
-
 static void performOp(bool trusted, unsigned int clientVersion,
     Source & from, Sink & to, unsigned int op)
 {
@@ -221,6 +181,18 @@ static void performOp(bool trusted, unsigned int clientVersion,
         break;
     }
 
+    case wopQueryClosure: {
+        PathSet paths = readStorePaths<PathSet>(from);
+        bool flipDirection = readInt(from);
+        bool includeOutputs = readInt(from);
+        bool includeDerivers = readInt(from);
+        startWork();
+        PathSet res = store->queryClosure(paths, flipDirection, includeOutputs, includeDerivers);
+        stopWork();
+        writeStrings(res, to);
+        break;
+    }
+
     case wopQueryDerivationOutputNames: {
         Path path = readStorePath(from);
         startWork();
@@ -261,22 +233,14 @@ static void performOp(bool trusted, unsigned int clientVersion,
         }
         HashType hashAlgo = parseHashType(s);
 
-        SavingSourceAdapter savedNAR(from);
-        RetrieveRegularNARSink savedRegular;
-
-        if (recursive) {
-            /* Get the entire NAR dump from the client and save it to
-               a string so that we can pass it to
-               addToStoreFromDump(). */
-            ParseSink sink; /* null sink; just parse the NAR */
-            parseDump(sink, savedNAR);
-        } else
-            parseDump(savedRegular, from);
+        /* Unpack the NAR into the store while receiving it from the
+           client.  This is done outside of startWork() / stopWork(),
+           since an error halfway leaves the rest of the NAR unread;
+           the error is then sent and the connection closed. */
+        Path path = dynamic_cast<LocalStore *>(store.get())
+            ->addToStoreFromNAR(from, baseName, recursive, hashAlgo);
 
         startWork();
-        if (!savedRegular.regular) throw Error("regular file expected");
-        Path path = dynamic_cast<LocalStore *>(store.get())
-            ->addToStoreFromDump(recursive ? savedNAR.s : savedRegular.s, baseName, recursive, hashAlgo);
         stopWork();
 
         writeString(path, to);
@@ -382,6 +346,10 @@ static void performOp(bool trusted, unsigned int clientVersion,
             readInt(from);
             readInt(from);
         }
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 17)
+            options.incremental = readInt(from);
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 18)
+            options.minFree = readLongLong(from);
 
         GCResults results;
 
@@ -508,6 +476,23 @@ static void performOp(bool trusted, unsigned int clientVersion,
         break;
     }
 
+    case wopQueryPathInfos: {
+        PathSet paths = readStorePaths<PathSet>(from);
+        startWork();
+        ValidPathInfoMap infos = store->queryPathInfos(paths);
+        stopWork();
+        writeInt(infos.size(), to);
+        foreach (ValidPathInfoMap::iterator, i, infos) {
+            writeString(i->first, to);
+            writeString(i->second.deriver, to);
+            writeString(printHash(i->second.hash), to);
+            writeStrings(i->second.references, to);
+            writeInt(i->second.registrationTime, to);
+            writeLongLong(i->second.narSize, to);
+        }
+        break;
+    }
+
     default:
         throw Error(format("invalid operation %1%") % op);
     }
@@ -645,6 +630,76 @@ bool matchUser(const string & user, const string & group, const Strings & users)
 #define SD_LISTEN_FDS_START 3
 
 
+/* Number of seconds between checks of the free space in the store. */
+static const int gcCheckInterval = 60;
+
+
+/* If the free space in the store has dropped below `gc-min-free',
+   start a garbage collector in the background that frees space until
+   `gc-max-free' bytes are available.  The collector is incremental so
+   that it doesn't hold the GC lock (and thus block builds) for long.
+   At most one background collector runs at a time. */
+static void maybeStartBackgroundGC()
+{
+    static time_t lastCheck = 0;
+
+    /* The read side of a pipe whose write side is held by the
+       running collector, so EOF means that it has exited.  Its pid
+       can't be used for this: SIGCHLD is ignored, so the pid can be
+       reused (e.g. by a connection handler) as soon as the collector
+       exits. */
+    static AutoCloseFD gcDone;
+
+    if (!settings.gcMinFree) return;
+
+    time_t now = time(0);
+    if (now - lastCheck < gcCheckInterval) return;
+    lastCheck = now;
+
+    if (gcDone != -1) {
+        struct pollfd fds[1];
+        fds[0].fd = gcDone;
+        fds[0].events = POLLIN;
+        if (poll(fds, 1, 0) == 0) return;
+        gcDone.close();
+    }
+
+    unsigned long long avail = getStoreFreeSpace();
+    if (avail >= settings.gcMinFree) return;
+
+    printMsg(lvlError, format("only %1% bytes free in the store; starting the garbage collector") % avail);
+
+    Pipe pipe;
+    pipe.create();
+
+    startProcess([&]() {
+        pipe.readSide.close();
+
+        if (setsid() == -1)
+            throw SysError(format("creating a new session"));
+
+        setSigChldAction(false);
+
+        store = std::shared_ptr<StoreAPI>(new LocalStore(false));
+
+        GCOptions options;
+        options.action = GCOptions::gcDeleteDead;
+        options.incremental = true;
+        options.minFree = std::max(settings.gcMaxFree, settings.gcMinFree);
+
+        GCResults results;
+        store->collectGarbage(options, results);
+
+        printMsg(lvlError, format("background garbage collection freed %1% bytes") % results.bytesFreed);
+
+        _exit(0);
+    }, "background garbage collection failed: ");
+
+    pipe.writeSide.close();
+    gcDone = pipe.readSide.borrow();
+}
+
+
 static void daemonLoop()
 {
     /* Get rid of children automatically; don't let them become
@@ -711,6 +766,22 @@ static void daemonLoop()
                database, because it doesn't like forks very much. */
             assert(!store);
 
+            /* If there is a free space goal, wake up periodically to
+               check it. */
+            if (settings.gcMinFree) {
+                maybeStartBackgroundGC();
+                struct pollfd fds[1];
+                fds[0].fd = fdSocket;
+                fds[0].events = POLLIN;
+                int res = poll(fds, 1, gcCheckInterval * 1000);
+                checkInterrupt();
+                if (res == -1) {
+                    if (errno == EINTR) continue;
+                    throw SysError("waiting for a connection");
+                }
+                if (res == 0) continue;
+            }
+
             /* Accept a connection. */
             struct sockaddr_un remoteAddr;
             socklen_t remoteAddrLen = sizeof(remoteAddr);
@@ -5,6 +5,7 @@
 #include "shared.hh"
 #include "eval.hh"
 #include "get-drvs.hh"
+#include "eval-cache.hh"
 #include "attr-path.hh"
 #include "common-opts.hh"
 #include "xml-writer.hh"
@@ -109,6 +110,8 @@ static void getAllExprs(EvalState & state,
     Strings names = readDirectory(path);
     StringSet namesSorted(names.begin(), names.end());
 
+    if (state.trackInputs) state.recordInput("dir:" + path);
+
     foreach (StringSet::iterator, i, namesSorted) {
         /* Ignore the manifest.nix used by profiles.  This is
            necessary to prevent it from showing up in channels (which
@@ -178,14 +181,39 @@ static void loadSourceExpr(EvalState & state, const Path & path, Value & v)
 
 static void loadDerivations(EvalState & state, Path nixExprPath,
     string systemFilter, Bindings & autoArgs,
-    const string & pathPrefix, DrvInfos & elems)
+    const string & pathPrefix, DrvInfos & elems,
+    unsigned int fields = drvFieldAll)
 {
-    Value vRoot;
-    loadSourceExpr(state, nixExprPath, vRoot);
+    /* The evaluation cache contains fully evaluated derivations, so
+       it can only be used in read-only mode. */
+    bool useCache = settings.evalCache && settings.readOnlyMode && autoArgs.empty();
+    string cacheKey = useCache ? evalCacheKey(state, nixExprPath, pathPrefix) : "";
+    if (useCache) fields = drvFieldAll;
+
+    if (!useCache || !queryEvalCache(state, cacheKey, elems)) {
+
+        if (useCache) {
+            state.trackInputs = true;
+            state.inputs.clear();
+            state.resetFileCache();
+        }
+
+        try {
+            Value vRoot;
+            loadSourceExpr(state, nixExprPath, vRoot);
 
-    Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot));
+            Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot));
 
-    getDerivations(state, v, pathPrefix, autoArgs, elems, true);
+            getDerivations(state, v, pathPrefix, autoArgs, elems, true, fields);
+
+            if (useCache) writeEvalCache(state, cacheKey, elems);
+        } catch (...) {
+            state.trackInputs = false;
+            throw;
+        }
+
+        state.trackInputs = false;
+    }
 
     /* Filter out all derivations not applicable to the current
        system. */
@@ -945,10 +973,17 @@ static void opQuery(Globals & globals,
     if (source == sInstalled || compareVersions || printStatus)
         installedElems = queryInstalled(globals.state, globals.profile);
 
+    /* The fields of the available derivations that we'll query. */
+    unsigned int fields = 0;
+    if (printDrvPath) fields |= drvFieldDrvPath;
+    if (printStatus || globals.prebuiltOnly) fields |= drvFieldOutPath;
+    if (printOutPath) fields |= drvFieldOutputs;
+    if (printDescription || printMeta || jsonOutput) fields |= drvFieldMeta;
+
     if (source == sAvailable || compareVersions)
         loadDerivations(globals.state, globals.instSource.nixExprPath,
             globals.instSource.systemFilter, globals.instSource.autoArgs,
-            attrPath, availElems);
+            attrPath, availElems, fields);
 
     DrvInfos elems_ = filterBySelector(globals.state,
         source == sInstalled ? installedElems : availElems,
@@ -1131,6 +1166,7 @@ static void opQuery(Globals & globals,
                             else {
                                 if (v->type == tString) {
                                     attrs2["type"] = "string";
+                                    flattenString(*v);
                                     attrs2["value"] = v->string.s;
                                     xml.writeEmptyElement("meta", attrs2);
                                 } else if (v->type == tInt) {
@@ -1141,13 +1177,14 @@ static void opQuery(Globals & globals,
                                     attrs2["type"] = "bool";
                                     attrs2["value"] = v->boolean ? "true" : "false";
                                     xml.writeEmptyElement("meta", attrs2);
-                                } else if (v->type == tList) {
+                                } else if (v->isList()) {
                                     attrs2["type"] = "strings";
                                     XMLOpenElement m(xml, "meta", attrs2);
-                                    for (unsigned int j = 0; j < v->list.length; ++j) {
-                                        if (v->list.elems[j]->type != tString) continue;
+                                    for (unsigned int j = 0; j < v->listSize(); ++j) {
+                                        if (v->listElems()[j]->type != tString) continue;
                                         XMLAttrs attrs3;
-                                        attrs3["value"] = v->list.elems[j]->string.s;
+                                        flattenString(*v->listElems()[j]);
+                                        attrs3["value"] = v->listElems()[j]->string.s;
                                         xml.writeEmptyElement("string", attrs3);
                                     }
                                 }
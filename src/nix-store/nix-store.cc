@@ -322,16 +322,17 @@ static void opQuery(Strings opFlags, Strings opArgs)
         case qReferences:
         case qReferrers:
         case qReferrersClosure: {
-            PathSet paths;
+            PathSet paths, roots;
             foreach (Strings::iterator, i, opArgs) {
                 PathSet ps = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
                 foreach (PathSet::iterator, j, ps) {
-                    if (query == qRequisites) computeFSClosure(*store, *j, paths, false, includeOutputs);
-                    else if (query == qReferences) store->queryReferences(*j, paths);
+                    if (query == qReferences) store->queryReferences(*j, paths);
                     else if (query == qReferrers) store->queryReferrers(*j, paths);
-                    else if (query == qReferrersClosure) computeFSClosure(*store, *j, paths, true);
+                    else roots.insert(*j);
                 }
             }
+            if (query == qRequisites) paths = store->queryClosure(roots, false, includeOutputs);
+            else if (query == qReferrersClosure) paths = store->queryClosure(roots, true);
             Paths sorted = topoSortPaths(*store, paths);
             for (Paths::reverse_iterator i = sorted.rbegin();
                  i != sorted.rend(); ++i)
@@ -360,19 +361,25 @@ static void opQuery(Strings opFlags, Strings opArgs)
             break;
 
         case qHash:
-        case qSize:
+        case qSize: {
+            Paths paths;
             foreach (Strings::iterator, i, opArgs) {
-                PathSet paths = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, paths) {
-                    ValidPathInfo info = store->queryPathInfo(*j);
-                    if (query == qHash) {
-                        assert(info.hash.type == htSHA256);
-                        cout << format("sha256:%1%\n") % printHash32(info.hash);
-                    } else if (query == qSize)
-                        cout << format("%1%\n") % info.narSize;
-                }
+                PathSet ps = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
+                paths.insert(paths.end(), ps.begin(), ps.end());
+            }
+            ValidPathInfoMap infos = store->queryPathInfos(PathSet(paths.begin(), paths.end()));
+            foreach (Paths::iterator, i, paths) {
+                ValidPathInfoMap::iterator info = infos.find(*i);
+                if (info == infos.end())
+                    throw Error(format("path `%1%' is not valid") % *i);
+                if (query == qHash) {
+                    assert(info->second.hash.type == htSHA256);
+                    cout << format("sha256:%1%\n") % printHash32(info->second.hash);
+                } else if (query == qSize)
+                    cout << format("%1%\n") % info->second.narSize;
             }
             break;
+        }
 
         case qTree: {
             PathSet done;
@@ -408,13 +415,13 @@ static void opQuery(Strings opFlags, Strings opArgs)
         }
 
         case qRoots: {
-            PathSet referrers;
+            PathSet paths;
             foreach (Strings::iterator, i, opArgs) {
-                PathSet paths = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, paths)
-                    computeFSClosure(*store, *j, referrers, true,
-                        settings.gcKeepOutputs, settings.gcKeepDerivations);
+                PathSet ps = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
+                paths.insert(ps.begin(), ps.end());
             }
+            PathSet referrers = store->queryClosure(paths, true,
+                settings.gcKeepOutputs, settings.gcKeepDerivations);
             Roots roots = store->findRoots();
             foreach (Roots::iterator, i, roots)
                 if (referrers.find(i->second) != referrers.end())
@@ -651,10 +658,15 @@ static void opGC(Strings opFlags, Strings opArgs)
         else if (*i == "--print-live") options.action = GCOptions::gcReturnLive;
         else if (*i == "--print-dead") options.action = GCOptions::gcReturnDead;
         else if (*i == "--delete") options.action = GCOptions::gcDeleteDead;
+        else if (*i == "--incremental") options.incremental = true;
         else if (*i == "--max-freed") {
             long long maxFreed = getIntArg<long long>(*i, i, opFlags.end(), true);
             options.maxFreed = maxFreed >= 0 ? maxFreed : 0;
         }
+        else if (*i == "--min-free") {
+            long long minFree = getIntArg<long long>(*i, i, opFlags.end(), true);
+            options.minFree = minFree >= 0 ? minFree : 0;
+        }
         else throw UsageError(format("bad sub-operation `%1%' in GC") % *i);
 
     if (!opArgs.empty()) throw UsageError("no arguments expected");
@@ -825,8 +837,9 @@ static void opRepairPath(Strings opFlags, Strings opArgs)
 static void showOptimiseStats(OptimiseStats & stats)
 {
     printMsg(lvlError,
-        format("%1% freed by hard-linking %2% files")
+        format("%1% freed by %2% %3% files")
         % showBytes(stats.bytesFreed)
+        % (settings.optimiseStoreMethod == "reflink" ? "deduplicating" : "hard-linking")
         % stats.filesLinked);
 }
 
@@ -934,11 +947,9 @@ static void opServe(Strings opFlags, Strings opArgs)
 
             case cmdQueryPathInfos: {
                 PathSet paths = readStorePaths<PathSet>(in);
-                // !!! Maybe we want a queryPathInfos?
-                foreach (PathSet::iterator, i, paths) {
-                    if (!store->isValidPath(*i))
-                        continue;
-                    ValidPathInfo info = store->queryPathInfo(*i);
+                ValidPathInfoMap infos = store->queryPathInfos(paths);
+                foreach (ValidPathInfoMap::iterator, i, infos) {
+                    ValidPathInfo & info(i->second);
                     writeString(info.path, out);
                     writeString(info.deriver, out);
                     writeStrings(info.references, out);
@@ -998,10 +1009,7 @@ static void opServe(Strings opFlags, Strings opArgs)
             case cmdQueryClosure: {
                 bool includeOutputs = readInt(in);
                 PathSet paths = readStorePaths<PathSet>(in);
-                PathSet closure;
-                for (auto & i : paths)
-                    computeFSClosure(*store, i, closure, false, includeOutputs);
-                writeStrings(closure, out);
+                writeStrings(store->queryClosure(paths, false, includeOutputs), out);
                 break;
             }
 
@@ -1088,7 +1096,7 @@ void run(Strings args)
             op = opServe;
         else if (arg[0] == '-') {
             opFlags.push_back(arg);
-            if (arg == "--max-freed" || arg == "--max-links" || arg == "--max-atime") { /* !!! hack */
+            if (arg == "--max-freed" || arg == "--min-free" || arg == "--max-links" || arg == "--max-atime") { /* !!! hack */
                 if (i != args.end()) opFlags.push_back(*i++);
             }
         }
@@ -26,3 +26,24 @@ hash2=$(nix-hash --type sha256 --base32 ./dummy)
 echo $hash2
 
 test "$hash1" = "sha256:$hash2"
+
+# Querying several paths at once returns one line per argument.
+hashes=$(nix-store -q --hash $path1 $path3 $path1)
+test "$(echo "$hashes" | wc -l)" -eq 3
+test "$(echo "$hashes" | head -n 1)" = "$hash1"
+test "$(echo "$hashes" | tail -n 1)" = "$hash1"
+test "$(nix-store -q --size $path1 $path3 | wc -l)" -eq 2
+
+# Directories are unpacked into the store as they are read.
+rm -rf $TEST_ROOT/add-dir
+mkdir -p $TEST_ROOT/add-dir/sub
+echo foo > $TEST_ROOT/add-dir/sub/foo
+path5=$(nix-store --add $TEST_ROOT/add-dir)
+test "$(cat $path5/sub/foo)" = foo
+test "$(nix-store -q --hash $path5)" = "sha256:$(nix-hash --type sha256 --base32 $TEST_ROOT/add-dir)"
+
+# Flat files lose their executable bit.
+cp ./dummy $TEST_ROOT/dummy-exec
+chmod +x $TEST_ROOT/dummy-exec
+path6=$(nix-store --add-fixed sha256 $TEST_ROOT/dummy-exec)
+test ! -x $path6
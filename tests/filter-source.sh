@@ -18,3 +18,30 @@ test -e $TEST_ROOT/filterout/xyzzy
 test -e $TEST_ROOT/filterout/bak
 test ! -e $TEST_ROOT/filterout/bla.c.bak
 test ! -L $TEST_ROOT/filterout/link
+
+# The filter is called while the path is being added to a local store,
+# so it must be safe for it to allocate (and trigger garbage
+# collection).  The result must be the same as adding the filtered
+# tree directly, and adding it again must give the same path.
+rm -rf $TEST_ROOT/filterexp
+mkdir -p $TEST_ROOT/filterexp/filterin
+touch $TEST_ROOT/filterexp/filterin/xyzzy
+touch $TEST_ROOT/filterexp/filterin/b
+touch $TEST_ROOT/filterexp/filterin/bak
+expected=$(NIX_REMOTE= nix-store --add $TEST_ROOT/filterexp/filterin)
+
+expr='
+  let
+    range = n: if n == 0 then [] else [ (toString n) ] ++ range (n - 1);
+    filter = path: type:
+      builtins.length (range 1000) == 1000
+      && type != "symlink"
+      && baseNameOf path != "foo"
+      && !((import ./lang/lib.nix).hasSuffix ".bak" (baseNameOf path));
+  in "${builtins.filterSource filter ./test-tmp/filterin}"'
+for i in 1 2; do
+    [ "$(NIX_REMOTE= nix-instantiate --eval -E "$expr" | tr -d '"')" = "$expected" ]
+done
+
+# Errors in the filter are reported as such.
+NIX_REMOTE= nix-instantiate --eval -E '"${builtins.filterSource (path: type: throw "filter failed") ./test-tmp/filterin}"' 2>&1 | grep -q "filter failed"
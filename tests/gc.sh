@@ -13,6 +13,8 @@ nix-store --gc --print-roots | grep $outPath
 nix-store --gc --print-live | grep $outPath
 nix-store --gc --print-dead | grep $drvPath
 if nix-store --gc --print-dead | grep $outPath; then false; fi
+nix-store --gc --incremental --print-dead | grep $drvPath
+if nix-store --gc --incremental --print-dead | grep $outPath; then false; fi
 
 nix-store --gc --print-dead
 
@@ -23,6 +25,10 @@ test -e $inUse
 if nix-store --delete $outPath; then false; fi
 test -e $outPath
 
+# There is more than one byte free, so this shouldn't delete anything.
+nix-store --gc --min-free 1
+test -e $drvPath
+
 nix-collect-garbage
 
 # Check that the root and its dependencies haven't been deleted.
@@ -38,3 +44,38 @@ nix-collect-garbage
 
 # Check that the output has been GC'd.
 if test -e $outPath/foobar; then false; fi
+
+# An incremental collection deletes dead paths as well.
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -rvv "$drvPath")
+test -e $outPath/foobar
+nix-store --gc --incremental
+if test -e $outPath/foobar; then false; fi
+
+# An incremental collection that reaches --max-freed stops, and the
+# next one resumes where it left off: `x' is older than `a' and `b',
+# but is alive during the first run, so it is not considered again by
+# the second.
+echo x > $TEST_ROOT/x
+echo a > $TEST_ROOT/a
+echo b > $TEST_ROOT/b
+x=$(nix-store --add $TEST_ROOT/x)
+a=$(nix-store --add $TEST_ROOT/a)
+b=$(nix-store --add $TEST_ROOT/b)
+ln -sf $x "$NIX_STATE_DIR"/gcroots/x
+
+nix-store --gc --incremental --max-freed 1
+test -e $x
+if test -e $a; then false; fi
+test -e $b
+
+rm "$NIX_STATE_DIR"/gcroots/x
+
+nix-store --gc --incremental --max-freed 1
+test -e $x
+if test -e $b; then false; fi
+
+# Once every path has been considered, the next run starts from the
+# oldest path again.
+nix-store --gc --incremental
+if test -e $x; then false; fi
@@ -67,4 +67,40 @@ for i in lang/eval-okay-*.nix; do
     fi
 done
 
+# The parse cache is filled by the first evaluation of a file and
+# used by the next one, which must give the same result.
+rm -rf $NIX_STATE_DIR/parse-cache
+for i in eval-okay-arithmetic eval-okay-attrs eval-okay-list eval-okay-let; do
+    echo "evaluating $i with the parse cache";
+    for pass in 1 2; do
+        if ! nix-instantiate -vvv --option parse-cache true --eval --strict lang/$i.nix \
+                > lang/$i.out 2> $TEST_ROOT/parse-cache.log; then
+            echo "FAIL: $i should evaluate"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.exp; then
+            echo "FAIL: evaluation result of $i not as expected"
+            fail=1
+        fi
+    done
+    if ! grep -q "using parse cache entry .* for \`.*/lang/$i.nix'" $TEST_ROOT/parse-cache.log; then
+        echo "FAIL: parse cache not used for $i"
+        fail=1
+    fi
+done
+if [ "$(ls $NIX_STATE_DIR/parse-cache | wc -l)" -lt 4 ]; then
+    echo "FAIL: parse cache entries missing"
+    fail=1
+fi
+
+# Parse cache entries that haven't been used for a while are removed
+# when new entries are added.
+touch -t 200001010000 $NIX_STATE_DIR/parse-cache/stale
+rm -f $NIX_STATE_DIR/parse-cache/.pruned
+echo 123 > $TEST_ROOT/parse-cache-new.nix
+nix-instantiate --option parse-cache true --eval $TEST_ROOT/parse-cache-new.nix
+if test -e $NIX_STATE_DIR/parse-cache/stale; then
+    echo "FAIL: stale parse cache entry not removed"
+    fail=1
+fi
+
 exit $fail
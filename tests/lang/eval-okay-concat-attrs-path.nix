@@ -0,0 +1,8 @@
+# Adding a path to a set with an `outPath' gives a string, but unlike
+# adding a path to a string, it doesn't copy the path to the store.
+
+let drv = { outPath = "foo"; }; in
+
+[ (drv + ./lib.nix == "foo${toString ./lib.nix}")
+  (drv + ./lib.nix + "bar" == "foo${toString ./lib.nix}bar")
+]
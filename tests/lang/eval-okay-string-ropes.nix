@@ -0,0 +1,23 @@
+# Long strings built by repeated concatenation.
+
+with builtins;
+
+let
+
+  range = first: last: if first == last then [] else [ first ] ++ range (first + 1) last;
+
+  fold = op: nul: list: if list == [] then nul else fold op (op nul (head list)) (tail list);
+
+  line = i: "line ${toString i} of a long string\n";
+
+  appended = fold (s: i: s + line i) "" (range 0 500);
+
+  prepended = fold (s: i: line (499 - i) + s) "" (range 0 500);
+
+  interpolated = "${appended}${prepended}${appended}";
+
+in [ (stringLength appended) (appended == prepended) (substring 0 27 appended)
+     (substring (stringLength appended - 12) 12 prepended)
+     (stringLength interpolated) (hashString "md5" appended == hashString "md5" prepended)
+     (lessThan appended (appended + "x"))
+   ]
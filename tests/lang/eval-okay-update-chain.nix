@@ -0,0 +1,19 @@
+# A long chain of `//' operations that each override and add a few
+# attributes of a big set.
+
+with builtins;
+
+let
+
+  range = first: last: if first == last then [] else [ first ] ++ range (first + 1) last;
+
+  fold = op: nul: list: if list == [] then nul else fold op (op nul (head list)) (tail list);
+
+  big = listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (range 0 200));
+
+  chain = fold (s: i: s // { "a${toString i}" = s."a${toString i}" * 10; "new${toString i}" = i; }) big (range 0 40);
+
+in [ (length (attrNames chain)) chain.a5 chain.a39 chain.a40 chain.new7
+     (chain ? a199) (chain ? nope)
+     (fold (x: y: x + y) 0 (map (n: getAttr n chain) (attrNames chain)))
+   ]
@@ -14,3 +14,8 @@ nix-env --version | grep "$version"
 # Usage errors.
 nix-env --foo 2>&1 | grep "no operation"
 nix-env -q --foo 2>&1 | grep "unknown flag"
+
+# Evaluation profiles.
+NIX_EVAL_PROFILE=$TEST_ROOT/profile nix-instantiate --eval --strict lang/eval-okay-update-chain.nix
+grep -q '^fold at .*/eval-okay-update-chain.nix:[0-9:]*[; ].* [0-9]*$' $TEST_ROOT/profile
+grep -q '"name":"primop listToAttrs"' $TEST_ROOT/profile.json
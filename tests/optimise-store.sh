@@ -18,6 +18,22 @@ if [ "$nlink" != 3 ]; then
     exit 1
 fi
 
+# Files in subdirectories are linked too, but not to executables with
+# the same contents.
+outPath5=$(echo 'with import ./config.nix; mkDerivation { name = "foo5"; builder = builtins.toFile "builder" "mkdir -p $out/sub; echo hello > $out/sub/foo; echo hello > $out/bar; chmod +x $out/bar"; }' | nix-build - --no-out-link --option auto-optimise-store true)
+
+inode5="$(perl -e "print ((lstat('$outPath5/sub/foo'))[1])")"
+if [ "$inode1" != "$inode5" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
+inode5="$(perl -e "print ((lstat('$outPath5/bar'))[1])")"
+if [ "$inode1" = "$inode5" ]; then
+    echo "inodes match unexpectedly"
+    exit 1
+fi
+
 outPath3=$(echo 'with import ./config.nix; mkDerivation { name = "foo3"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
 
 inode3="$(perl -e "print ((lstat('$outPath3/foo'))[1])")"
@@ -35,6 +51,17 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# A second run only looks at paths added since the first one.
+outPath4=$(echo 'with import ./config.nix; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+
+nix-store --optimise
+
+inode4="$(perl -e "print ((lstat('$outPath4/foo'))[1])")"
+if [ "$inode1" != "$inode4" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
@@ -26,6 +26,11 @@ echo "registering..."
 
 nix-store --register-validity < $TEST_ROOT/reg_info
 
+echo "querying closures..."
+test "$(nix-store -qR $NIX_STORE_DIR/0 | wc -l)" -eq $((max + 1))
+test "$(nix-store -qR $NIX_STORE_DIR/$((max - 1)) | wc -l)" -eq 2
+test "$(nix-store -q --referrers-closure $reference | wc -l)" -eq $((max + 1))
+
 echo "collecting garbage..."
 ln -sfn $reference "$NIX_STATE_DIR"/gcroots/ref
 nix-store --gc
@@ -24,6 +24,44 @@ rm -f $HOME/.nix-defexpr
 ln -s $(pwd)/user-envs.nix $HOME/.nix-defexpr
 nix-env -qa '*' --description | grep -q silly
 
+# Parallel evaluation should give the same results.
+for flags in "-P --description" "--out-path --drv-path" "--json"; do
+    [ "$(nix-env -f ./user-envs.nix -qa $flags '*')" = "$(nix-env -f ./user-envs.nix -qa $flags --option eval-jobs 3 '*')" ]
+done
+
+# Attributes that are aliases of the same derivation are listed once,
+# but different sets with the same derivation path are not merged.
+cat > $TEST_ROOT/aliases.nix <<EOF
+with import $(pwd)/config.nix;
+rec {
+  a = mkDerivation { name = "alias"; builder = builtins.toFile "builder" "mkdir \$out"; };
+  b = a;
+  c = a // { extra = true; };
+  d = a;
+}
+EOF
+for jobs in 1 3; do
+    [ "$(nix-env -f $TEST_ROOT/aliases.nix -qaP --drv-path --option eval-jobs $jobs '*' | cut -d ' ' -f 1)" = "$(printf 'a\nc')" ]
+done
+
+# So should the evaluation cache, which must notice changes to the
+# files used by the expression.
+for i in 1 2; do
+    [ "$(nix-env -f ./user-envs.nix -qa --json '*')" = "$(nix-env -f ./user-envs.nix -qa --json --option eval-cache true '*')" ]
+done
+echo -n 1.0 > $TEST_ROOT/cached-version
+echo "with import $(pwd)/config.nix; mkDerivation { name = \"cached-\${builtins.readFile $TEST_ROOT/cached-version}\"; builder = $(pwd)/user-envs.builder.sh; }" > $TEST_ROOT/cached.nix
+nix-env -f $TEST_ROOT/cached.nix -qa --option eval-cache true | grep -q cached-1.0
+echo -n 2.0 > $TEST_ROOT/cached-version
+nix-env -f $TEST_ROOT/cached.nix -qa --option eval-cache true | grep -q cached-2.0
+
+# Evaluations that use the current time aren't cached.
+echo "with import $(pwd)/config.nix; mkDerivation { name = \"time-\${toString builtins.currentTime}\"; builder = $(pwd)/user-envs.builder.sh; }" > $TEST_ROOT/time.nix
+time1=$(nix-env -f $TEST_ROOT/time.nix -qa --option eval-cache true)
+sleep 1
+time2=$(nix-env -f $TEST_ROOT/time.nix -qa --option eval-cache true)
+[ "$time1" != "$time2" ]
+
 # Install "foo-1.0".
 nix-env -i foo-1.0
 